@@ -0,0 +1,233 @@
+/*
+ * usbimager/bmap.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief bmaptool block map parser
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sha.h"
+#include "bmap.h"
+
+/**
+ * Skip white spaces
+ */
+static char *bmap_space(char *s)
+{
+    while(*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') s++;
+    return s;
+}
+
+/**
+ * Returns the contents of a tag, or NULL if there's no such tag
+ */
+static char *bmap_tag(char *s, const char *tag)
+{
+    int l = (int)strlen(tag);
+
+    for(; (s = strchr(s, '<')); s++)
+        if(!strncmp(s + 1, tag, l) && s[l + 1] == '>') return bmap_space(s + l + 2);
+    return NULL;
+}
+
+/**
+ * Parse a decimal number
+ */
+static char *bmap_num(char *s, uint64_t *val)
+{
+    if(*s < '0' || *s > '9') return NULL;
+    for(*val = 0; *s >= '0' && *s <= '9'; s++) {
+        if(*val > ((uint64_t)-1 - 9) / 10) return NULL;
+        *val = *val * 10 + (uint64_t)(*s - '0');
+    }
+    return s;
+}
+
+/**
+ * Parse a checksum in hex, returns its length in bytes
+ */
+static int bmap_hex(const char *s, uint8_t *out)
+{
+    int i, d;
+
+    for(i = 0; i < 2 * SHA_MAXSIZE; i++, s++) {
+        if(*s >= '0' && *s <= '9') d = *s - '0'; else
+        if(*s >= 'a' && *s <= 'f') d = *s - 'a' + 10; else
+        if(*s >= 'A' && *s <= 'F') d = *s - 'A' + 10; else break;
+        if(i & 1) out[i >> 1] |= d; else out[i >> 1] = d << 4;
+    }
+    return i & 1 ? 0 : i / 2;
+}
+
+/**
+ * Check the file's own checksum, which is computed with the checksum itself zeroed out
+ */
+static int bmap_selfcheck(bmap_t *b, char *data, size_t len)
+{
+    uint8_t sum[SHA_MAXSIZE], got[SHA_MAXSIZE];
+    char *s;
+    int n, i;
+
+    if(!(s = bmap_tag(data, "BmapFileChecksum")) && !(s = bmap_tag(data, "BmapFileSHA1"))) return 0;
+    if((n = bmap_hex(s, sum)) != (b->sha1 ? 20 : 32)) return 1;
+    for(i = 0; i < n * 2; i++) s[i] = '0';
+    sha_init(&b->sha, b->sha1);
+    sha_update(&b->sha, (uint8_t*)data, len);
+    sha_final(&b->sha, got);
+    return memcmp(sum, got, n) != 0;
+}
+
+/**
+ * Load and parse a bmap file
+ */
+int bmap_load(bmap_t *b, FILE *f)
+{
+    bmap_range_t *r;
+    uint64_t v, start, end, blocks;
+    char *data, *s, *e;
+    size_t len;
+    int major, max = 0, n;
+
+    memset(b, 0, sizeof(bmap_t));
+    if(!(data = (char*)malloc(BMAP_MAXSIZE + 1))) return 1;
+    len = fread(data, 1, BMAP_MAXSIZE + 1, f);
+    if(len > BMAP_MAXSIZE) goto err;
+    data[len] = 0;
+    /* versions 1.x have SHA-1 checksums, 1.4 might have SHA-256 too, 2.0 only has that */
+    if(!(s = strstr(data, "<bmap")) || !(s = strstr(s, "version=")) || (s[8] != '"' && s[8] != '\'')) goto err;
+    major = atoi(s + 9);
+    if(major < 1 || major > 2) goto err;
+    b->sha1 = major < 2;
+    if((s = bmap_tag(data, "ChecksumType"))) {
+        if(!strncmp(s, "sha256", 6)) b->sha1 = 0; else
+        if(!strncmp(s, "sha1", 4)) b->sha1 = 1; else goto err;
+    }
+    if(!(s = bmap_tag(data, "ImageSize")) || !bmap_num(s, &b->size) || !(s = bmap_tag(data, "BlockSize")) ||
+      !bmap_num(s, &v) || !v || v > 0x7fffffff || !(s = bmap_tag(data, "BlocksCount")) || !bmap_num(s, &blocks) ||
+      blocks != (b->size + v - 1) / v || bmap_selfcheck(b, data, len)) goto err;
+    b->blkSize = (uint32_t)v;
+    if(!(s = bmap_tag(data, "BlockMap"))) goto err;
+    for(; (s = strstr(s, "<Range")); s = e) {
+        if(b->numRange == max) {
+            max += 1024;
+            if(!(r = (bmap_range_t*)realloc(b->range, max * sizeof(bmap_range_t)))) goto err;
+            b->range = r;
+        }
+        r = &b->range[b->numRange];
+        memset(r, 0, sizeof(bmap_range_t));
+        if(!(e = strchr(s, '>'))) goto err;
+        /* checksums are optional */
+        for(; s < e; s++)
+            if(!strncmp(s, "chksum=", n = 7) || !strncmp(s, "sha1=", n = 5)) {
+                if((s[n] != '"' && s[n] != '\'') || bmap_hex(s + n + 1, r->sum) != (b->sha1 ? 20 : 32)) goto err;
+                r->hasSum = 1;
+                break;
+            }
+        if(!(s = bmap_num(bmap_space(e + 1), &start))) goto err;
+        end = start;
+        s = bmap_space(s);
+        if(*s == '-' && !(s = bmap_num(bmap_space(s + 1), &end))) goto err;
+        s = bmap_space(s);
+        /* ranges must be in order */
+        if(strncmp(s, "</Range>", 8) || start > end || end >= blocks ||
+          (b->numRange && start * v < b->range[b->numRange - 1].end)) goto err;
+        r->start = start * v;
+        r->end = (end + 1) * v > b->size ? b->size : (end + 1) * v;
+        b->mapped += r->end - r->start;
+        b->numRange++;
+        e = s + 8;
+    }
+    free(data);
+    return 0;
+err:
+    free(data);
+    bmap_free(b);
+    return 1;
+}
+
+/**
+ * Returns 1 if the data at off is mapped, and in len how long it goes on like that
+ */
+int bmap_mapped(bmap_t *b, uint64_t off, uint64_t *len)
+{
+    int l = 0, h = b->numRange, m;
+
+    /* the first range that ends after off */
+    while(l < h) {
+        m = (l + h) / 2;
+        if(b->range[m].end <= off) l = m + 1; else h = m;
+    }
+    if(l == b->numRange) { *len = (uint64_t)-1 - off; return 0; }
+    if(b->range[l].start <= off) { *len = b->range[l].end - off; return 1; }
+    *len = b->range[l].start - off;
+    return 0;
+}
+
+/**
+ * Check the checksums of the ranges in the next size bytes of the image
+ */
+void bmap_check(bmap_t *b, const uint8_t *buf, int size)
+{
+    bmap_range_t *r;
+    uint64_t end = b->pos + (uint64_t)size, s, e;
+    uint8_t sum[SHA_MAXSIZE];
+
+    for(; b->cur < b->numRange && (r = &b->range[b->cur])->start < end; b->cur++) {
+        s = r->start > b->pos ? r->start : b->pos;
+        e = r->end < end ? r->end : end;
+        if(r->hasSum) {
+            if(s == r->start) sha_init(&b->sha, b->sha1);
+            sha_update(&b->sha, buf + (s - b->pos), (size_t)(e - s));
+        }
+        /* the rest of the range is in the next buffer */
+        if(e < r->end) break;
+        if(r->hasSum) {
+            sha_final(&b->sha, sum);
+            if(memcmp(sum, r->sum, b->sha1 ? 20 : 32)) b->bad++;
+        }
+    }
+    b->pos = end;
+}
+
+/**
+ * Returns 0 if a range's checksum is wrong or there wasn't enough data for all the ranges
+ */
+int bmap_ok(bmap_t *b)
+{
+    return !b->bad && b->cur == b->numRange;
+}
+
+/**
+ * Free the map
+ */
+void bmap_free(bmap_t *b)
+{
+    free(b->range);
+    b->range = NULL;
+    b->numRange = 0;
+}
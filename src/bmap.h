@@ -0,0 +1,77 @@
+/*
+ * usbimager/bmap.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief bmaptool block map parser
+ *
+ */
+
+#define BMAP_MAXSIZE (64*1024*1024)     /* of the XML file */
+
+/* a mapped range */
+typedef struct {
+    uint64_t start, end;        /* bytes of the image, end is exclusive */
+    uint8_t sum[SHA_MAXSIZE];
+    char hasSum;
+} bmap_range_t;
+
+/* the map */
+typedef struct {
+    uint64_t size;              /* of the image */
+    uint32_t blkSize;
+    int sha1;                   /* checksums are SHA-1, SHA-256 otherwise */
+    int numRange;
+    bmap_range_t *range;
+    uint64_t mapped;            /* bytes in the ranges */
+    int cur;                    /* range being checked */
+    uint64_t pos;               /* data checked so far */
+    sha_t sha;
+    int bad;                    /* ranges with a wrong checksum */
+} bmap_t;
+
+/**
+ * Load and parse a bmap file. Returns 0 on success, 1 if it's corrupt or it's a version we
+ * don't know
+ */
+int bmap_load(bmap_t *b, FILE *f);
+
+/**
+ * Returns 1 if the data at off is mapped, and in len how long it goes on like that
+ */
+int bmap_mapped(bmap_t *b, uint64_t off, uint64_t *len);
+
+/**
+ * Check the checksums of the ranges in the next size bytes of the image
+ */
+void bmap_check(bmap_t *b, const uint8_t *buf, int size);
+
+/**
+ * Returns 0 if a range's checksum is wrong or there wasn't enough data for all the ranges
+ */
+int bmap_ok(bmap_t *b);
+
+/**
+ * Free the map
+ */
+void bmap_free(bmap_t *b);
@@ -0,0 +1,495 @@
+/*
+ * usbimager/bzpar.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel bzip2 decompression
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lang.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "bzpar.h"
+
+#define BZPAR_INSIZE (1024*1024)        /* compressed data is scanned in chunks this big */
+#define BZPAR_MAXJOBS 1024
+#define BZPAR_BLOCK 0x314159265359ULL   /* pi, starts a block */
+#define BZPAR_EOS 0x177245385090ULL     /* sqrt(pi), ends a stream */
+
+enum { BZPAR_FREE, BZPAR_READY, BZPAR_BUSY, BZPAR_DONE, BZPAR_FAIL };
+
+/* a block, or the end of a stream */
+typedef struct {
+    uint64_t start;     /* bit offset of the magic */
+    uint64_t end;       /* bit offset of the next magic */
+    uint32_t crc;       /* the block's CRC, or at the end of a stream, the combined CRC */
+    int level;          /* block size in 100k, 0 at the end of a stream */
+    char *data;
+    uint64_t size;
+    uint64_t pos;       /* how much of it has been output */
+    int state;
+} bzpar_job_t;
+
+typedef struct {
+    stream_t *ctx;
+    int fd;
+    uint64_t fs;
+    int quit, alive, scanned, error;
+    pthread_t thread[BZPAR_MAXTHREADS], scanner;
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bzpar_job_t job[BZPAR_MAXJOBS];
+    uint64_t found, next, cur;  /* jobs found by the scanner, taken by the workers, and output */
+    uint64_t skip;              /* a job that was merged into the previous one */
+    uint64_t mem;               /* decoded bytes waiting in jobs */
+    uint64_t pos;               /* compressed offset of the block being output */
+    uint32_t crc;               /* combined CRC of the stream being output */
+    /* scanner */
+    uint64_t mark;              /* the last magic found */
+    uint64_t expect;            /* where the next one must be after the end of a stream */
+    int eos, level;
+} bzpar_t;
+
+/* allocations of a worker's decoder, kept between blocks */
+typedef struct {
+    void *ptr[4];
+    int size[4];
+    int used[4];
+} bzpar_heap_t;
+
+static bzpar_t bzpar;
+
+/**
+ * Allocator for libbz2, which would otherwise allocate (and page fault) megabytes for every block
+ */
+static void *bzpar_alloc(void *opaque, int n, int m)
+{
+    bzpar_heap_t *h = (bzpar_heap_t*)opaque;
+    int i;
+
+    for(i = 0; i < 4; i++)
+        if(h->ptr[i] && !h->used[i] && h->size[i] == n * m) { h->used[i] = 1; return h->ptr[i]; }
+    for(i = 0; i < 4 && h->ptr[i]; i++);
+    if(i == 4) return malloc(n * m);
+    if(!(h->ptr[i] = malloc(n * m))) return NULL;
+    h->size[i] = n * m;
+    h->used[i] = 1;
+    return h->ptr[i];
+}
+
+/**
+ * Release to the worker's heap
+ */
+static void bzpar_free(void *opaque, void *p)
+{
+    bzpar_heap_t *h = (bzpar_heap_t*)opaque;
+    int i;
+
+    for(i = 0; i < 4; i++)
+        if(h->ptr[i] == p) { h->used[i] = 0; return; }
+    free(p);
+}
+
+/**
+ * Read n bits (at most 32) at a bit offset of the source
+ */
+static uint32_t bzpar_bits(bzpar_t *g, uint64_t bit, int n)
+{
+    unsigned char b[5] = { 0 };
+    uint64_t v = 0;
+    int i;
+
+    if(pread(g->fd, b, 5, bit >> 3) < 1) return 0;
+    for(i = 0; i < 5; i++) v = (v << 8) | b[i];
+    return (uint32_t)((v >> (40 - n - (bit & 7))) & ((1ULL << n) - 1));
+}
+
+/**
+ * Append n bits to a zeroed buffer
+ */
+static void bzpar_put(unsigned char *buf, uint64_t *bit, uint64_t v, int n)
+{
+    while(n--) {
+        if((v >> n) & 1) buf[*bit >> 3] |= 0x80 >> (*bit & 7);
+        (*bit)++;
+    }
+}
+
+/**
+ * Add a job, must be called with the mutex held. Returns 0 if we're quitting
+ */
+static int bzpar_add(bzpar_t *g, uint64_t start, uint64_t end, uint32_t crc, int level)
+{
+    bzpar_job_t *j;
+
+    while(!g->quit && g->found - g->cur >= BZPAR_MAXJOBS)
+        pthread_cond_wait(&g->cond, &g->mutex);
+    if(g->quit) return 0;
+    j = &g->job[g->found % BZPAR_MAXJOBS];
+    memset(j, 0, sizeof(bzpar_job_t));
+    j->start = start;
+    j->end = end;
+    j->crc = crc;
+    j->level = level;
+    j->state = BZPAR_READY;
+    g->found++;
+    pthread_cond_broadcast(&g->cond);
+    return 1;
+}
+
+/**
+ * A magic was found, so the previous block ends here. Returns 0 to stop scanning
+ */
+static int bzpar_magic(bzpar_t *g, uint64_t pos, int eos)
+{
+    unsigned char hdr[4];
+    int ret = 1;
+
+    /* after the end of a stream the next one's header must follow, otherwise it's trailing garbage */
+    if(g->eos) {
+        if(pos != g->expect || pread(g->fd, hdr, 4, (pos >> 3) - 4) != 4 || hdr[0] != 'B' || hdr[1] != 'Z' ||
+          hdr[2] != 'h' || hdr[3] < '1' || hdr[3] > '9') return 0;
+        g->level = hdr[3] - '0';
+    }
+    pthread_mutex_lock(&g->mutex);
+    if(!g->eos) ret = bzpar_add(g, g->mark, pos, bzpar_bits(g, g->mark + 48, 32), g->level);
+    if(ret && eos) ret = bzpar_add(g, pos, pos + 80, bzpar_bits(g, pos + 48, 32), 0);
+    pthread_mutex_unlock(&g->mutex);
+    g->mark = pos;
+    g->eos = eos;
+    /* the stream's end is padded to a byte boundary */
+    if(eos) g->expect = (((pos + 80 + 7) >> 3) + 4) << 3;
+    return ret;
+}
+
+/**
+ * Scanner thread, looks for block magics at any bit offset
+ */
+static void *bzpar_scanner(void *data)
+{
+    bzpar_t *g = (bzpar_t*)data;
+    unsigned char *buf = (unsigned char*)malloc(BZPAR_INSIZE);
+    uint64_t off, w = 0, v;
+    int i, s, n = 0, go = buf != NULL;
+
+    for(off = 0; go && off < g->fs; off += n) {
+        /* don't read too far ahead of the output */
+        pthread_mutex_lock(&g->mutex);
+        while(!g->quit && off > g->pos + BZPAR_AHEAD)
+            pthread_cond_wait(&g->cond, &g->mutex);
+        go = !g->quit;
+        pthread_mutex_unlock(&g->mutex);
+        if(!go || (n = (int)pread(g->fd, buf, BZPAR_INSIZE, off)) < 1) break;
+        for(i = 0; go && i < n; i++) {
+            w = (w << 8) | buf[i];
+            for(s = 7; s >= 0; s--) {
+                v = (w >> s) & 0xFFFFFFFFFFFFULL;
+                if((v == BZPAR_BLOCK || v == BZPAR_EOS) &&
+                  !(go = bzpar_magic(g, ((off + i + 1) << 3) - s - 48, v == BZPAR_EOS))) break;
+            }
+        }
+    }
+    pthread_mutex_lock(&g->mutex);
+    /* a block without an end means a truncated file */
+    if(!g->eos || n < 0 || !buf) g->error = 1;
+    g->scanned = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Decode the block from its magic up to the given bit offset. Returns 1 on success
+ */
+static int bzpar_block(bzpar_t *g, bzpar_heap_t *h, bzpar_job_t *j, uint64_t end)
+{
+    uint64_t first = j->start >> 3, len = ((end + 7) >> 3) - first, bit, i, cap = 0;
+    int shift = j->start & 7, ret = BZ_OK;
+    unsigned char *in, *syn = NULL;
+    bz_stream bs;
+    char *p;
+
+    free(j->data);
+    j->data = NULL;
+    j->size = 0;
+    if(!(in = (unsigned char*)malloc(len + 1)) || !(syn = (unsigned char*)calloc(len + 16, 1)) ||
+      pread(g->fd, in, len, first) != (ssize_t)len) { ret = BZ_IO_ERROR; goto err; }
+    in[len] = 0;
+    /* wrap it in a stream of its own: a header, the block shifted to a byte boundary, and the end of
+     * the stream, where the combined CRC is the same as the block's */
+    syn[0] = 'B'; syn[1] = 'Z'; syn[2] = 'h'; syn[3] = '0' + j->level;
+    for(i = 0; i < len; i++)
+        syn[4 + i] = shift ? (unsigned char)((in[i] << shift) | (in[i + 1] >> (8 - shift))) : in[i];
+    bit = 32 + end - j->start;
+    if(bit & 7) syn[bit >> 3] &= 0xFF << (8 - (bit & 7));
+    memset(syn + ((bit + 7) >> 3), 0, len + 16 - ((bit + 7) >> 3));
+    bzpar_put(syn, &bit, BZPAR_EOS, 48);
+    bzpar_put(syn, &bit, j->crc, 32);
+    memset(&bs, 0, sizeof(bs));
+    bs.bzalloc = bzpar_alloc;
+    bs.bzfree = bzpar_free;
+    bs.opaque = h;
+    if((ret = BZ2_bzDecompressInit(&bs, 0, 0)) != BZ_OK) goto err;
+    bs.next_in = (char*)syn;
+    bs.avail_in = (bit + 7) >> 3;
+    do {
+        if(j->size == cap) {
+            cap = cap ? cap * 2 : (uint64_t)j->level * 100000 + 65536;
+            if(!(p = (char*)realloc(j->data, cap))) { ret = BZ_MEM_ERROR; break; }
+            j->data = p;
+        }
+        bs.next_out = j->data + j->size;
+        bs.avail_out = cap - j->size;
+        ret = BZ2_bzDecompress(&bs);
+        j->size = cap - bs.avail_out;
+    } while(ret == BZ_OK && (bs.avail_in || !bs.avail_out) && !__atomic_load_n(&g->quit, __ATOMIC_RELAXED));
+    BZ2_bzDecompressEnd(&bs);
+err:
+    free(syn);
+    free(in);
+    if(verbose > 1) printf("bzpar_block() bit %" PRIu64 " - %" PRIu64 " size %" PRIu64 " ret %d\r\n",
+        j->start, end, j->size, ret);
+    return ret == BZ_STREAM_END;
+}
+
+/**
+ * Worker thread, decodes the blocks in order, but no more than what fits in memory
+ */
+static void *bzpar_worker(void *data)
+{
+    bzpar_t *g = (bzpar_t*)data;
+    bzpar_heap_t heap;
+    bzpar_job_t *j;
+    int i, ok;
+
+    memset(&heap, 0, sizeof(heap));
+    pthread_mutex_lock(&g->mutex);
+    while(!g->quit) {
+        if(g->next >= g->found || g->mem >= BZPAR_MAXMEM) {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+        j = &g->job[g->next++ % BZPAR_MAXJOBS];
+        /* nothing to decode at the end of a stream */
+        if(!j->level) { j->state = BZPAR_DONE; pthread_cond_broadcast(&g->cond); continue; }
+        j->state = BZPAR_BUSY;
+        pthread_mutex_unlock(&g->mutex);
+        ok = bzpar_block(g, &heap, j, j->end);
+        pthread_mutex_lock(&g->mutex);
+        j->state = ok ? BZPAR_DONE : BZPAR_FAIL;
+        if(ok) g->mem += j->size;
+        pthread_cond_broadcast(&g->cond);
+    }
+    g->alive--;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    for(i = 0; i < 4; i++)
+        free(heap.ptr[i]);
+    return NULL;
+}
+
+/**
+ * Wait for the job being output. Returns NULL at the end, must be called with the mutex held
+ */
+static bzpar_job_t *bzpar_wait(bzpar_t *g)
+{
+    bzpar_job_t *j = &g->job[g->cur % BZPAR_MAXJOBS];
+
+    while(g->alive && (g->cur < g->found ? j->state != BZPAR_DONE && j->state != BZPAR_FAIL : !g->scanned))
+        pthread_cond_wait(&g->cond, &g->mutex);
+    return g->cur < g->found && (j->state == BZPAR_DONE || j->state == BZPAR_FAIL) ? j : NULL;
+}
+
+/**
+ * Done with the job being output, must be called with the mutex held
+ */
+static void bzpar_finish(bzpar_t *g, bzpar_job_t *j)
+{
+    if(j->state == BZPAR_DONE) g->mem -= j->size;
+    free(j->data);
+    j->data = NULL;
+    j->state = BZPAR_FREE;
+    g->cur++;
+    /* it was merged into the previous one, so drop it as soon as it's not being decoded */
+    if(g->skip && g->cur == g->skip && (j = bzpar_wait(g))) {
+        g->skip = 0;
+        bzpar_finish(g, j);
+        return;
+    }
+    if(g->cur < g->found) g->pos = g->job[g->cur % BZPAR_MAXJOBS].start >> 3;
+    pthread_cond_broadcast(&g->cond);
+}
+
+/**
+ * Output the next block. Returns the number of bytes, 0 at the end, -1 on error
+ */
+static int bzpar_nextblock(bzpar_t *g, char *buf, int size)
+{
+    bzpar_heap_t heap;
+    bzpar_job_t *j, *k;
+    int i, n;
+
+    for(;;) {
+        pthread_mutex_lock(&g->mutex);
+        if(!(j = bzpar_wait(g))) {
+            n = g->scanned && !g->error && g->cur >= g->found ? 0 : -1;
+            pthread_mutex_unlock(&g->mutex);
+            return n;
+        }
+        if(j->state == BZPAR_FAIL) {
+            /* the magic might occur by chance inside a block, then that continues in the next job */
+            while(g->cur + 1 >= g->found && !g->scanned)
+                pthread_cond_wait(&g->cond, &g->mutex);
+            k = g->cur + 1 < g->found ? &g->job[(g->cur + 1) % BZPAR_MAXJOBS] : NULL;
+            pthread_mutex_unlock(&g->mutex);
+            memset(&heap, 0, sizeof(heap));
+            n = k && k->level && bzpar_block(g, &heap, j, k->end);
+            for(i = 0; i < 4; i++)
+                free(heap.ptr[i]);
+            if(!n) return -1;
+            pthread_mutex_lock(&g->mutex);
+            j->state = BZPAR_DONE;
+            g->mem += j->size;
+            g->skip = g->cur + 1;
+            pthread_mutex_unlock(&g->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&g->mutex);
+        /* end of a stream, check that we haven't missed a block */
+        if(!j->level) {
+            n = j->crc == g->crc;
+            if(!n && verbose) printf("bzpar_nextblock() combined CRC mismatch %08x != %08x\r\n", j->crc, g->crc);
+            g->crc = 0;
+            pthread_mutex_lock(&g->mutex);
+            bzpar_finish(g, j);
+            pthread_mutex_unlock(&g->mutex);
+            if(!n) return -1;
+            continue;
+        }
+        if(!j->pos) g->crc = ((g->crc << 1) | (g->crc >> 31)) ^ j->crc;
+        n = j->size - j->pos < (uint64_t)size ? (int)(j->size - j->pos) : size;
+        memcpy(buf, j->data + j->pos, n);
+        j->pos += n;
+        if(j->pos >= j->size) {
+            pthread_mutex_lock(&g->mutex);
+            bzpar_finish(g, j);
+            pthread_mutex_unlock(&g->mutex);
+        }
+        if(n) return n;
+    }
+}
+
+/**
+ * Output hook for stream_read(), fills the buffer unless we're at the end
+ */
+static int bzpar_output(void *data, char *buf, int size)
+{
+    bzpar_t *g = (bzpar_t*)data;
+    int n, ret = 0;
+
+    while(ret < size) {
+        if((n = bzpar_nextblock(g, buf + ret, size - ret)) < 0) return -1;
+        if(!n) break;
+        ret += n;
+    }
+    if(ret < size) {
+        __atomic_store_n(&g->ctx->cmrdSize, g->fs, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, (uint64_t)-1);
+    } else {
+        __atomic_store_n(&g->ctx->cmrdSize, g->pos, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, g->pos);
+    }
+    return ret;
+}
+
+/**
+ * Start decompressing a bzip2 source on all cores
+ */
+int bzpar_open(stream_t *ctx)
+{
+    bzpar_t *g = &bzpar;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    /* bzip2 entries in a zip archive are left to stream_read(), the scanner expects a .bz2 file */
+    if(n < 2 || ctx->type != TYPE_BZIP2 || !ctx->multi) return 0;
+    if(n > BZPAR_MAXTHREADS) n = BZPAR_MAXTHREADS;
+    memset(g, 0, sizeof(bzpar_t));
+    g->ctx = ctx;
+    g->fd = fileno(ctx->f);
+    g->fs = ctx->compSize;
+    /* as if a stream had ended right before the file */
+    g->eos = 1;
+    g->expect = 32;
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    if(pthread_create(&g->scanner, NULL, bzpar_scanner, g)) {
+        pthread_cond_destroy(&g->cond);
+        pthread_mutex_destroy(&g->mutex);
+        return 0;
+    }
+    for(i = 0; i < n; i++)
+        if(!pthread_create(&g->thread[g->numthreads], NULL, bzpar_worker, g)) g->numthreads++;
+    g->alive = g->numthreads;
+    if(verbose) printf("bzpar_open() threads %d\r\n", g->numthreads);
+    ctx->output = bzpar_output;
+    ctx->outputData = g;
+    return 1;
+}
+
+/**
+ * Stop the threads and free everything
+ */
+void bzpar_close(stream_t *ctx)
+{
+    bzpar_t *g = &bzpar;
+    int i;
+
+    if(ctx->outputData != g) return;
+    pthread_mutex_lock(&g->mutex);
+    __atomic_store_n(&g->quit, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    pthread_join(g->scanner, NULL);
+    for(i = 0; i < g->numthreads; i++)
+        pthread_join(g->thread[i], NULL);
+    for(i = 0; i < BZPAR_MAXJOBS; i++)
+        free(g->job[i].data);
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->mutex);
+    ctx->output = NULL;
+    ctx->outputData = NULL;
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * usbimager/bzpar.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel bzip2 decompression
+ *
+ */
+
+#define BZPAR_AHEAD (64*1024*1024)      /* scan for blocks at most this far ahead of the output */
+#define BZPAR_MAXMEM (256*1024*1024)    /* decoded data waiting to be output */
+#define BZPAR_MAXTHREADS 16
+
+/**
+ * Start decompressing a bzip2 source on all cores. Blocks are found by their magic, and each one
+ * is decoded on its own, wrapped in a stream of one block. Sets the stream's output hook, returns
+ * 1 if it did, 0 if stream_read() should be used as usual
+ */
+int bzpar_open(stream_t *ctx);
+
+/**
+ * Stop the threads and free everything
+ */
+void bzpar_close(stream_t *ctx);
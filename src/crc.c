@@ -0,0 +1,264 @@
+/*
+ * usbimager/crc.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief CRC32 and CRC64 checksums
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "zlib.h"
+#define XZ_USE_CRC64
+#include "xz.h"
+#include "crc.h"
+
+/* carry-less multiplication on x86, the CRC32 instructions on ARMv8 */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC_CLMUL 1
+#include <immintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__aarch64__) && !defined(__AARCH64EB__)
+#define CRC_ARMV8 1
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+
+#define CRC32_POLY 0xEDB88320U                  /* bit reflected */
+#define CRC64_POLY 0xC96C5795D7870F42ULL
+
+static uint32_t crc32_table[8][256];
+static uint64_t crc64_table[8][256];
+/* folding constants, x^(d+63) and x^(d-1) mod P, bit reflected, for 512 and 128 bits apart */
+static uint64_t crc32_k[4], crc64_k[4];
+static int crc_inited;
+#ifdef CRC_CLMUL
+static int crc_clmul;
+#endif
+#ifdef CRC_ARMV8
+static int crc_armv8;
+#endif
+
+/**
+ * Little endian 64 bit value
+ */
+static uint64_t crc_get64(const uint8_t *buf)
+{
+    return buf[0] | ((uint64_t)buf[1] << 8) | ((uint64_t)buf[2] << 16) | ((uint64_t)buf[3] << 24) |
+        ((uint64_t)buf[4] << 32) | ((uint64_t)buf[5] << 40) | ((uint64_t)buf[6] << 48) | ((uint64_t)buf[7] << 56);
+}
+
+/**
+ * x^n mod P, bit reflected so that the top bit is x^0
+ */
+static uint64_t crc_xpow(int n, uint64_t poly, int deg)
+{
+    uint64_t r = 1ULL << (deg - 1);
+
+    while(n--) r = (r >> 1) ^ (poly & (0 - (r & 1)));
+    return r << (64 - deg);
+}
+
+/**
+ * Slice-by-8, without the inversions
+ */
+static uint32_t crc32_sliced(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t v;
+
+    for(; len >= 8; len -= 8, buf += 8) {
+        v = crc_get64(buf) ^ crc;
+        crc = crc32_table[7][v & 0xFF] ^ crc32_table[6][(v >> 8) & 0xFF] ^ crc32_table[5][(v >> 16) & 0xFF] ^
+            crc32_table[4][(v >> 24) & 0xFF] ^ crc32_table[3][(v >> 32) & 0xFF] ^ crc32_table[2][(v >> 40) & 0xFF] ^
+            crc32_table[1][(v >> 48) & 0xFF] ^ crc32_table[0][v >> 56];
+    }
+    for(; len; len--, buf++)
+        crc = crc32_table[0][(crc ^ *buf) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static uint64_t crc64_sliced(uint64_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t v;
+
+    for(; len >= 8; len -= 8, buf += 8) {
+        v = crc_get64(buf) ^ crc;
+        crc = crc64_table[7][v & 0xFF] ^ crc64_table[6][(v >> 8) & 0xFF] ^ crc64_table[5][(v >> 16) & 0xFF] ^
+            crc64_table[4][(v >> 24) & 0xFF] ^ crc64_table[3][(v >> 32) & 0xFF] ^ crc64_table[2][(v >> 40) & 0xFF] ^
+            crc64_table[1][(v >> 48) & 0xFF] ^ crc64_table[0][v >> 56];
+    }
+    for(; len; len--, buf++)
+        crc = crc64_table[0][(crc ^ *buf) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC_CLMUL
+/**
+ * Fold 16 bytes 4 x 128 or 128 bits ahead, onto the next ones
+ */
+__attribute__((target("pclmul,sse2")))
+static __m128i crc_fold(__m128i x, __m128i k, __m128i y)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), y);
+}
+
+/**
+ * Fold all whole 16 byte chunks of at least 64 bytes into one, which has the same remainder as the
+ * whole buffer, with the CRC register already xored in. Returns what's left
+ */
+__attribute__((target("pclmul,sse2")))
+static const uint8_t *crc_clmulfold(const uint8_t *buf, size_t *len, uint64_t crc, const uint64_t *k, uint8_t *out)
+{
+    __m128i x0, x1, x2, x3, k4 = _mm_set_epi64x(k[1], k[0]), k1 = _mm_set_epi64x(k[3], k[2]);
+    size_t n = *len;
+
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)buf), _mm_set_epi64x(0, crc));
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 16));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 32));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 48));
+    for(buf += 64, n -= 64; n >= 64; buf += 64, n -= 64) {
+        x0 = crc_fold(x0, k4, _mm_loadu_si128((const __m128i*)buf));
+        x1 = crc_fold(x1, k4, _mm_loadu_si128((const __m128i*)(buf + 16)));
+        x2 = crc_fold(x2, k4, _mm_loadu_si128((const __m128i*)(buf + 32)));
+        x3 = crc_fold(x3, k4, _mm_loadu_si128((const __m128i*)(buf + 48)));
+    }
+    x3 = crc_fold(crc_fold(crc_fold(x0, k1, x1), k1, x2), k1, x3);
+    for(; n >= 16; buf += 16, n -= 16)
+        x3 = crc_fold(x3, k1, _mm_loadu_si128((const __m128i*)buf));
+    _mm_storeu_si128((__m128i*)out, x3);
+    *len = n;
+    return buf;
+}
+#endif
+
+#ifdef CRC_ARMV8
+/**
+ * With the CRC32 instructions, without the inversions
+ */
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t v;
+
+    for(; len >= 8; len -= 8, buf += 8) {
+        memcpy(&v, buf, 8);
+        __asm__(".arch_extension crc\n\tcrc32x %w0, %w0, %x1" : "+r"(crc) : "r"(v));
+    }
+    for(; len; len--, buf++)
+        __asm__(".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)*buf));
+    return crc;
+}
+#endif
+
+/**
+ * Build the tables and pick the fastest implementation
+ */
+void crc_init(void)
+{
+    int i, j;
+
+    if(crc_inited) return;
+    for(i = 0; i < 256; i++) {
+        crc32_table[0][i] = i;
+        crc64_table[0][i] = i;
+        for(j = 0; j < 8; j++) {
+            crc32_table[0][i] = (crc32_table[0][i] >> 1) ^ (CRC32_POLY & (0 - (crc32_table[0][i] & 1)));
+            crc64_table[0][i] = (crc64_table[0][i] >> 1) ^ (CRC64_POLY & (0 - (crc64_table[0][i] & 1)));
+        }
+    }
+    for(j = 1; j < 8; j++)
+        for(i = 0; i < 256; i++) {
+            crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^ crc32_table[0][crc32_table[j - 1][i] & 0xFF];
+            crc64_table[j][i] = (crc64_table[j - 1][i] >> 8) ^ crc64_table[0][crc64_table[j - 1][i] & 0xFF];
+        }
+    crc32_k[0] = crc_xpow(512 + 63, CRC32_POLY, 32); crc32_k[1] = crc_xpow(512 - 1, CRC32_POLY, 32);
+    crc32_k[2] = crc_xpow(128 + 63, CRC32_POLY, 32); crc32_k[3] = crc_xpow(128 - 1, CRC32_POLY, 32);
+    crc64_k[0] = crc_xpow(512 + 63, CRC64_POLY, 64); crc64_k[1] = crc_xpow(512 - 1, CRC64_POLY, 64);
+    crc64_k[2] = crc_xpow(128 + 63, CRC64_POLY, 64); crc64_k[3] = crc_xpow(128 - 1, CRC64_POLY, 64);
+#ifdef CRC_CLMUL
+    __builtin_cpu_init();
+    crc_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+#endif
+#ifdef CRC_ARMV8
+#ifdef __APPLE__
+    crc_armv8 = 1;
+#elif defined(__linux__)
+    crc_armv8 = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+#endif
+    crc_inited = 1;
+}
+
+/**
+ * Update a CRC32 with a buffer
+ */
+uint32_t crc_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+#ifdef CRC_CLMUL
+    uint8_t tmp[16];
+#endif
+
+    crc = ~crc;
+#ifdef CRC_ARMV8
+    if(crc_armv8) return ~crc32_armv8(crc, buf, len);
+#endif
+#ifdef CRC_CLMUL
+    if(crc_clmul && len >= 64) {
+        buf = crc_clmulfold(buf, &len, crc, crc32_k, tmp);
+        crc = crc32_sliced(0, tmp, 16);
+    }
+#endif
+    return ~crc32_sliced(crc, buf, len);
+}
+
+/**
+ * Update a CRC64 with a buffer
+ */
+uint64_t crc_crc64(uint64_t crc, const uint8_t *buf, size_t len)
+{
+#ifdef CRC_CLMUL
+    uint8_t tmp[16];
+#endif
+
+    crc = ~crc;
+#ifdef CRC_CLMUL
+    if(crc_clmul && len >= 64) {
+        buf = crc_clmulfold(buf, &len, crc, crc64_k, tmp);
+        crc = crc64_sliced(0, tmp, 16);
+    }
+#endif
+    return ~crc64_sliced(crc, buf, len);
+}
+
+/* these replace the byte at a time versions of xz-embedded and zlib, which are left out of their libraries */
+void xz_crc32_init(void) { crc_init(); }
+void xz_crc64_init(void) { crc_init(); }
+uint32_t xz_crc32(const uint8_t *buf, size_t size, uint32_t crc) { return crc_crc32(crc, buf, size); }
+uint64_t xz_crc64(const uint8_t *buf, size_t size, uint64_t crc) { return crc_crc64(crc, buf, size); }
+uLong ZEXPORT crc32_z(uLong crc, const Bytef *buf, z_size_t len) { return buf ? crc_crc32(crc, buf, len) : 0; }
+uLong ZEXPORT crc32(uLong crc, const Bytef *buf, uInt len) { return buf ? crc_crc32(crc, buf, len) : 0; }
@@ -0,0 +1,44 @@
+/*
+ * usbimager/crc.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief CRC32 and CRC64 checksums
+ *
+ */
+
+/**
+ * Build the tables and pick the fastest implementation this CPU has. Must be called before anything
+ * is checked, stream_open() does that
+ */
+void crc_init(void);
+
+/**
+ * Update a CRC32 (IEEE 802.3, used by gzip, zip and xz) with a buffer. Start with 0
+ */
+uint32_t crc_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+
+/**
+ * Update a CRC64 (ECMA-182, used by xz) with a buffer. Start with 0
+ */
+uint64_t crc_crc64(uint64_t crc, const uint8_t *buf, size_t len);
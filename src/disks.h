@@ -34,7 +34,7 @@
 #define DISKS_MAX 128
 #define DISKS_MAXSIZE 256 /* GiB, largest disk we display */
 
-extern int disks_all, disks_serial, disks_maxsize, disks_targets[DISKS_MAX];
+extern int disks_all, disks_serial, disks_maxsize, disks_direct, disks_zero, disks_targets[DISKS_MAX];
 extern uint64_t disks_capacity[DISKS_MAX];
 
 /* some defines if not defined in limit.h */
@@ -71,6 +71,25 @@ char *disks_volumes(int *num, char ***mounts);
  */
 void *disks_open(int targetId, uint64_t size);
 
+/**
+ * Return the logical sector size of the opened target disk
+ * Receives FD or HANDLE
+ */
+int disks_sectorsize(void *ctx);
+
+/**
+ * Return the vendor and model of the opened target disk, or NULL if unknown
+ * Receives FD or HANDLE
+ */
+char *disks_model(void *ctx);
+
+/**
+ * Discard or zero out the first size bytes of the target (the image's extent) before writing, returns 1
+ * if that reads as zeros afterwards, 0 with errno set otherwise
+ * Receives FD or HANDLE
+ */
+int disks_zeroout(void *ctx, uint64_t size);
+
 /**
  * Close the target disk
  * Receives FD or HANDLE
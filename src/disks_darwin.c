@@ -39,6 +39,7 @@
 #import <sys/mount.h>
 #import <sys/stat.h>
 #import <sys/ioctl.h>
+#import <sys/disk.h>
 #import <sys/ttycom.h>
 #import <Foundation/Foundation.h>
 #import <CoreFoundation/CoreFoundation.h>
@@ -55,7 +56,7 @@
 #import "main.h"
 #import "disks.h"
 
-int disks_all = 0, disks_serial = 0, disks_targets[DISKS_MAX], currTarget = 0;
+int disks_all = 0, disks_serial = 0, disks_direct = 0, disks_zero = 0, disks_targets[DISKS_MAX], currTarget = 0;
 uint64_t disks_capacity[DISKS_MAX];
 char disks_serials[DISKS_MAX][64];
 
@@ -459,9 +460,43 @@ sererr:         main_getErrorMessage();
         main_getErrorMessage();
         return NULL;
     }
+    /* rdisk is unbuffered already, but make sure no cache is used */
+    if(disks_direct) fcntl(ret, F_NOCACHE, 1);
     return (void*)((long int)ret);
 }
 
+/**
+ * Return the logical sector size of the opened target disk
+ */
+int disks_sectorsize(void *data)
+{
+    int fd = (int)((long int)data);
+    uint32_t ssz = 0;
+    if(ioctl(fd, DKIOCGETBLOCKSIZE, &ssz) || ssz < 512) ssz = 512;
+    errno = 0;
+    return (int)ssz;
+}
+
+/**
+ * Return the vendor and model of the opened target disk, or NULL if unknown
+ */
+char *disks_model(void *data)
+{
+    (void)data;
+    return NULL;
+}
+
+/**
+ * Discard or zero out the whole target before writing, returns 1 if it reads as zeros afterwards
+ */
+int disks_zeroout(void *data, uint64_t size)
+{
+    /* DKIOCUNMAP does not guarantee that unmapped blocks read back as zeros */
+    (void)data;
+    (void)size;
+    return 0;
+}
+
 /**
  * Close the target disk
  */
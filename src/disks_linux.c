@@ -27,7 +27,10 @@
  *
  */
 
+#define _GNU_SOURCE             /* for O_DIRECT */
+
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,8 +39,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "lang.h"
 #include "main.h"
 #include "disks.h"
@@ -49,7 +54,6 @@ extern char *main_errorMessage;
 #endif
 
 extern int fdatasync(int);
-int usleep(unsigned long int);
 
 /* disks_targets:
  * -1: invalid
@@ -57,7 +61,7 @@ int usleep(unsigned long int);
  * 'a' - 'z': sdX devices
  * 1024+: serial devices
  */
-int disks_all = 0, disks_serial = 0, disks_targets[DISKS_MAX];
+int disks_all = 0, disks_serial = 0, disks_direct = 0, disks_zero = 0, disks_targets[DISKS_MAX];
 uint64_t disks_capacity[DISKS_MAX];
 char *serials[DISKS_MAX], *skip[DISKS_MAX];
 int serialdrivers = 0;
@@ -430,7 +434,12 @@ sererr:         main_getErrorMessage();
         sprintf(deviceName, "./test.bin");
         unlink(deviceName);
         errno = 0;
-        ret = open(deviceName, O_RDWR | O_EXCL | O_CREAT, 0644);
+        ret = open(deviceName, O_RDWR | O_EXCL | O_CREAT | (disks_direct ? O_DIRECT : 0), 0644);
+        /* not all file systems support direct I/O */
+        if(ret < 0 && errno == EINVAL) {
+            errno = 0;
+            ret = open(deviceName, O_RDWR | O_EXCL | O_CREAT, 0644);
+        }
         if(verbose)
             printf("disks_open(%s)\r\n  fd=%d errno=%d err=%s\r\n",
                 deviceName, ret, errno, strerror(errno));
@@ -502,7 +511,9 @@ sererr:         main_getErrorMessage();
     }
 
     errno = 0;
-    ret = open(deviceName, O_RDWR | O_SYNC | O_EXCL);
+    /* with direct I/O the page cache is bypassed, and disks_close() flushes the device's cache. Otherwise
+     * the writer keeps the dirty data within the writeback window, O_SYNC is only used without one */
+    ret = open(deviceName, O_RDWR | (disks_direct ? O_DIRECT : (writeback_window ? 0 : O_SYNC)) | O_EXCL);
     if(verbose) printf("  fd=%d errno=%d err=%s\r\n", ret, errno, strerror(errno));
     if(ret < 0 || errno) {
 #if USE_UDISKS2
@@ -516,7 +527,7 @@ sererr:         main_getErrorMessage();
             }
             error = NULL; main_errorMessage = NULL;
             g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
-            g_variant_builder_add(&builder, "{sv}", "flags", g_variant_new_int32(O_SYNC | O_EXCL));
+            g_variant_builder_add(&builder, "{sv}", "flags", g_variant_new_int32((disks_direct ? O_DIRECT : (writeback_window ? 0 : O_SYNC)) | O_EXCL));
             options = g_variant_builder_end(&builder);
             g_variant_ref_sink(options);
             fdlist = g_unix_fd_list_new();
@@ -543,13 +554,117 @@ sererr:         main_getErrorMessage();
     return (void*)((long int)ret);
 }
 
+/**
+ * Return the logical sector size of the opened target disk
+ */
+int disks_sectorsize(void *data)
+{
+    int fd = (int)((long int)data), ssz = 0;
+    /* this fails on serial ports and image files, use the traditional 512 for those */
+    if(ioctl(fd, BLKSSZGET, &ssz) || ssz < 512) ssz = 512;
+    errno = 0;
+    return ssz;
+}
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
+/**
+ * Read a block queue attribute from sysfs, returns -1 if it doesn't exist
+ */
+static long int disks_queueattr(dev_t dev, char *attr)
+{
+    char path[128];
+    long int ret = -1;
+    FILE *f;
+
+    sprintf(path, "/sys/dev/block/%u:%u/queue/%s", major(dev), minor(dev), attr);
+    /* partitions don't have a queue, their parent disk does */
+    if(!(f = fopen(path, "r"))) {
+        sprintf(path, "/sys/dev/block/%u:%u/../queue/%s", major(dev), minor(dev), attr);
+        f = fopen(path, "r");
+    }
+    if(f) {
+        if(fscanf(f, "%ld", &ret) != 1) ret = -1;
+        fclose(f);
+    }
+    return ret;
+}
+
+/**
+ * Return the vendor and model of the opened target disk, or NULL if unknown
+ */
+char *disks_model(void *data)
+{
+    static char model[256];
+    char path[128], vendorName[96], productName[128], *parent = "";
+    int fd = (int)((long int)data);
+    struct stat st;
+
+    if(fstat(fd, &st) || !S_ISBLK(st.st_mode)) return NULL;
+    sprintf(path, "/sys/dev/block/%u:%u/device", major(st.st_rdev), minor(st.st_rdev));
+    /* partitions don't have a device, their parent disk does */
+    if(access(path, F_OK)) parent = "../";
+    sprintf(path, "/sys/dev/block/%u:%u/%sdevice/vendor", major(st.st_rdev), minor(st.st_rdev), parent);
+    filegetcontent(path, vendorName, sizeof(vendorName));
+    sprintf(path, "/sys/dev/block/%u:%u/%sdevice/model", major(st.st_rdev), minor(st.st_rdev), parent);
+    filegetcontent(path, productName, sizeof(productName));
+    errno = 0;
+    if(!vendorName[0] && !productName[0]) return NULL;
+    snprintf(model, sizeof(model)-1, "%s %s", vendorName, productName);
+    return model;
+}
+
+/**
+ * Discard or zero out the whole target before writing, returns 1 if it reads as zeros afterwards
+ */
+int disks_zeroout(void *data, uint64_t size)
+{
+    int fd = (int)((long int)data), ret = 0;
+    uint64_t range[2] = { 0, 0 };
+    struct stat st;
+    char *how = "none";
+
+    if(!size || fstat(fd, &st)) return 0;
+    errno = EOPNOTSUPP;
+    if(S_ISREG(st.st_mode)) {
+        /* image file, simply make it sparse */
+        if(!ftruncate(fd, 0) && !ftruncate(fd, (off_t)size)) { how = "ftruncate"; ret = 1; }
+    } else
+    if(S_ISBLK(st.st_mode) && !ioctl(fd, BLKGETSIZE64, &range[1])) {
+        /* only the image's extent, what's after it on the device is none of our business. The
+         * ioctls need 512 byte multiples */
+        size = (size + 511) & ~511ULL;
+        if(size < range[1]) range[1] = size;
+        /* discard is only good if the device guarantees zeros afterwards (only kernels before 4.12
+         * report that, newer ones always say 0), otherwise let it write zeros itself, but only if it
+         * can do that without us sending all the zero blocks over the bus */
+        if(disks_queueattr(st.st_rdev, "discard_zeroes_data") == 1) {
+            how = "BLKDISCARD"; ret = !ioctl(fd, BLKDISCARD, &range);
+        } else
+        if(disks_queueattr(st.st_rdev, "write_zeroes_max_bytes") > 0) {
+            how = "BLKZEROOUT"; ret = !ioctl(fd, BLKZEROOUT, &range);
+        }
+    }
+    if(verbose) printf("disks_zeroout(%d) %s size %" PRIu64 " ret %d errno=%d\r\n", fd, how,
+        S_ISREG(st.st_mode) ? size : range[1], ret, ret ? 0 : errno);
+    /* on failure, errno tells why */
+    if(ret) errno = 0;
+    return ret;
+}
+
 /**
  * Close the target disk
  */
 void disks_close(void *data)
 {
-    int fd = (int)((long int)data);
-    fdatasync(fd);
+    int fd = (int)((long int)data), ret;
+    errno = 0;
+    ret = fdatasync(fd);
+    if(verbose) printf("disks_close(%d) fdatasync %d errno=%d\r\n", fd, ret, errno);
     close(fd);
-    if(verbose) printf("disks_close(%d)\r\n", fd);
 }
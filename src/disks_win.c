@@ -36,7 +36,7 @@
 #include "main.h"
 #include "disks.h"
 
-int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_targets[DISKS_MAX], cdrive = 0, nLocks = 0;
+int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_direct = 0, disks_zero = 0, disks_targets[DISKS_MAX], cdrive = 0, nLocks = 0;
 uint64_t disks_capacity[DISKS_MAX];
 
 HANDLE hLocks[32];
@@ -328,6 +328,38 @@ sererr:     main_getErrorMessage();
     return (void*)ret;
 }
 
+/**
+ * Return the logical sector size of the opened target disk
+ */
+int disks_sectorsize(void *data)
+{
+    DISK_GEOMETRY diskGeometry;
+    DWORD bytesReturned;
+    if(DeviceIoControl((HANDLE)data, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &diskGeometry, sizeof diskGeometry, &bytesReturned, NULL) &&
+        diskGeometry.BytesPerSector >= 512)
+        return (int)diskGeometry.BytesPerSector;
+    return 512;
+}
+
+/**
+ * Return the vendor and model of the opened target disk, or NULL if unknown
+ */
+char *disks_model(void *data)
+{
+    (void)data;
+    return NULL;
+}
+
+/**
+ * Discard or zero out the whole target before writing, returns 1 if it reads as zeros afterwards
+ */
+int disks_zeroout(void *data, uint64_t size)
+{
+    (void)data;
+    (void)size;
+    return 0;
+}
+
 /**
  * Close the target disk
  */
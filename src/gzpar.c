@@ -0,0 +1,686 @@
+/*
+ * usbimager/gzpar.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel gzip decompression
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lang.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "gzpar.h"
+
+#define GZPAR_INSIZE (256*1024)         /* compressed data is read and scanned in chunks this big */
+#define GZPAR_WINSIZE 32768             /* deflate's history window */
+#define GZPAR_MAXJOBS 256
+#define GZPAR_MAGIC "UGZI"
+
+enum { GZPAR_FREE, GZPAR_BUSY, GZPAR_DONE, GZPAR_FAIL };
+
+/* a checkpoint of the index, where decoding can start with a primed window */
+typedef struct {
+    uint64_t in;        /* compressed offset of the first whole byte */
+    uint64_t out;       /* uncompressed offset */
+    uint64_t win;       /* offset of the window in the index file */
+    int bits;           /* bits of the byte before in which belong to this point */
+    int wlen;           /* window length, less than 32K at the very beginning */
+} gzpar_point_t;
+
+/* a member or a span, decoded by a worker */
+typedef struct {
+    uint64_t start;     /* compressed offset of the member, or the span's number */
+    uint64_t end;       /* compressed offset after the member's trailer */
+    char *data;
+    uint64_t size;
+    uint64_t pos;       /* how much of it has been output */
+    int state;
+} gzpar_job_t;
+
+typedef struct {
+    stream_t *ctx;
+    int fd;
+    uint64_t fs;
+    int quit, alive;
+    pthread_t thread[GZPAR_MAXTHREADS];
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    gzpar_job_t job[GZPAR_MAXJOBS];
+    uint64_t mem;           /* decoded bytes waiting in jobs */
+    /* members */
+    uint64_t head;          /* compressed offset of the member being output */
+    uint64_t scan;          /* workers have looked for members up to here */
+    uint64_t inpos;         /* we decode the head member ourselves when no worker had it */
+    int inmember;
+    z_stream zs;
+    unsigned char *inbuf;
+    /* spans between the checkpoints of an index */
+    int idx;
+    gzpar_point_t *pts;
+    int numpts, next, cur;
+    uint64_t total;
+    /* an index being built while decoding a single member */
+    FILE *bf;
+    char fn[1024];
+    gzpar_point_t *bpts;
+    int numbpts;
+    uint64_t bout;
+    unsigned char tail[GZPAR_WINSIZE];
+    int taillen;
+} gzpar_t;
+
+static gzpar_t gzpar;
+
+/**
+ * Returns the path of the file where the source's index is remembered
+ */
+static char *gzpar_file(gzpar_t *g)
+{
+    unsigned char buf[65536];
+    struct stat st;
+    char *env;
+    int n, l;
+
+    if(fstat(g->fd, &st) || (n = (int)pread(g->fd, buf, sizeof(buf), 0)) < 1) return NULL;
+    if((env = getenv("XDG_CACHE_HOME")))
+        l = snprintf(g->fn, sizeof(g->fn)-64, "%s/usbimager", env);
+    else if((env = getenv("HOME"))) {
+        l = snprintf(g->fn, sizeof(g->fn)-64, "%s/.cache", env);
+        mkdir(g->fn, 0755);
+        l += snprintf(g->fn + l, 32, "/usbimager");
+    } else
+        return NULL;
+    mkdir(g->fn, 0755);
+    /* the same image has the same size, modification time and beginning, wherever it's copied */
+    snprintf(g->fn + l, 64, "/%016" PRIx64 ".gzi", (uint64_t)XXH64(buf, n, g->fs ^ (uint64_t)st.st_mtime));
+    return g->fn;
+}
+
+/**
+ * Load the index of the source if we have one
+ */
+static void gzpar_load(gzpar_t *g)
+{
+    char magic[4];
+    uint64_t hdr[3];
+    int n;
+
+    if(!gzpar_file(g) || (g->idx = open(g->fn, O_RDONLY)) < 0) return;
+    if(pread(g->idx, magic, 4, 0) != 4 || memcmp(magic, GZPAR_MAGIC, 4) ||
+      pread(g->idx, &n, sizeof(int), 4) != sizeof(int) || n < 2 ||
+      pread(g->idx, hdr, sizeof(hdr), 8) != sizeof(hdr) || hdr[0] != g->fs ||
+      !(g->pts = (gzpar_point_t*)malloc(n * sizeof(gzpar_point_t))) ||
+      pread(g->idx, g->pts, n * sizeof(gzpar_point_t), hdr[2]) != (ssize_t)(n * sizeof(gzpar_point_t))) {
+        if(g->pts) { free(g->pts); g->pts = NULL; }
+        close(g->idx); g->idx = -1;
+        return;
+    }
+    g->numpts = n;
+    g->total = hdr[1];
+}
+
+/**
+ * Drop the index being built
+ */
+static void gzpar_discard(gzpar_t *g)
+{
+    char tmp[1040];
+
+    if(!g->bf) return;
+    fclose(g->bf); g->bf = NULL;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g->fn);
+    unlink(tmp);
+    free(g->bpts); g->bpts = NULL;
+    g->numbpts = 0;
+}
+
+/**
+ * The first member is decoded by us, so start building an index for the next time
+ */
+static void gzpar_build(gzpar_t *g)
+{
+    char tmp[1040];
+
+    if(!gzpar_file(g)) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g->fn);
+    if(!(g->bf = fopen(tmp, "wb"))) return;
+    /* header is written at the end, when we know the points */
+    fseeko(g->bf, 4 + sizeof(int) + 3 * sizeof(uint64_t), SEEK_SET);
+    g->bout = 0;
+    g->taillen = 0;
+}
+
+/**
+ * Remember the output for the windows, and add a point at block boundaries every span
+ */
+static void gzpar_point(gzpar_t *g, unsigned char *out, int n)
+{
+    gzpar_point_t *p;
+    int keep;
+
+    if(n >= GZPAR_WINSIZE) {
+        memcpy(g->tail, out + n - GZPAR_WINSIZE, GZPAR_WINSIZE);
+        g->taillen = GZPAR_WINSIZE;
+    } else if(n > 0) {
+        keep = g->taillen < GZPAR_WINSIZE - n ? g->taillen : GZPAR_WINSIZE - n;
+        memmove(g->tail, g->tail + g->taillen - keep, keep);
+        memcpy(g->tail + keep, out, n);
+        g->taillen = keep + n;
+    }
+    g->bout += n;
+    /* block boundary, but not in the last block */
+    if(!(g->zs.data_type & 128) || (g->zs.data_type & 64) ||
+      (g->numbpts && g->bout - g->bpts[g->numbpts - 1].out < GZPAR_SPAN)) return;
+    if(!(g->numbpts & 63)) {
+        if(!(p = (gzpar_point_t*)realloc(g->bpts, (g->numbpts + 64) * sizeof(gzpar_point_t)))) { gzpar_discard(g); return; }
+        g->bpts = p;
+    }
+    p = &g->bpts[g->numbpts++];
+    p->in = g->inpos - g->zs.avail_in;
+    p->out = g->bout;
+    p->bits = g->zs.data_type & 7;
+    p->wlen = g->taillen;
+    p->win = (uint64_t)ftello(g->bf);
+    if(p->wlen && !fwrite(g->tail, p->wlen, 1, g->bf)) gzpar_discard(g);
+}
+
+/**
+ * The first member has ended, save the index if it was the only one and worth it
+ */
+static void gzpar_built(gzpar_t *g)
+{
+    unsigned char magic[2] = { 0 };
+    uint64_t hdr[3];
+    char tmp[1040];
+    int ok;
+
+    if(g->head < g->fs && pread(g->fd, magic, 2, g->head) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        gzpar_discard(g);
+        return;
+    }
+    if(g->numbpts < 2) { gzpar_discard(g); return; }
+    hdr[0] = g->fs;
+    hdr[1] = g->bout;
+    hdr[2] = (uint64_t)ftello(g->bf);
+    ok = fwrite(g->bpts, g->numbpts * sizeof(gzpar_point_t), 1, g->bf) && !fseeko(g->bf, 0, SEEK_SET) &&
+        fwrite(GZPAR_MAGIC, 4, 1, g->bf) && fwrite(&g->numbpts, sizeof(int), 1, g->bf) &&
+        fwrite(hdr, sizeof(hdr), 1, g->bf);
+    if(fclose(g->bf)) ok = 0;
+    g->bf = NULL;
+    free(g->bpts); g->bpts = NULL;
+    g->numbpts = 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g->fn);
+    if(!ok) { unlink(tmp); return; }
+    rename(tmp, g->fn);
+    if(verbose) printf("gzpar_built() index %s\r\n", g->fn);
+}
+
+/**
+ * Returns the job of the member starting at this offset
+ */
+static gzpar_job_t *gzpar_find(gzpar_t *g, uint64_t start)
+{
+    int i;
+
+    for(i = 0; i < GZPAR_MAXJOBS; i++)
+        if(g->job[i].state != GZPAR_FREE && g->job[i].start == start) return &g->job[i];
+    return NULL;
+}
+
+/**
+ * Returns an unused job, or NULL if there's none
+ */
+static gzpar_job_t *gzpar_slot(gzpar_t *g)
+{
+    int i;
+
+    for(i = 0; i < GZPAR_MAXJOBS; i++)
+        if(g->job[i].state == GZPAR_FREE) {
+            memset(&g->job[i], 0, sizeof(gzpar_job_t));
+            return &g->job[i];
+        }
+    return NULL;
+}
+
+/**
+ * Free a job's data, must be called with the mutex held
+ */
+static void gzpar_drop(gzpar_t *g, gzpar_job_t *j)
+{
+    if(j->state == GZPAR_DONE) g->mem -= j->size;
+    free(j->data);
+    j->data = NULL;
+    j->state = GZPAR_FREE;
+}
+
+/**
+ * Free the members that we have passed, a candidate there was inside another member's data
+ */
+static void gzpar_reap(gzpar_t *g)
+{
+    int i;
+
+    for(i = 0; i < GZPAR_MAXJOBS; i++)
+        if((g->job[i].state == GZPAR_DONE || g->job[i].state == GZPAR_FAIL) && g->job[i].start < g->head)
+            gzpar_drop(g, &g->job[i]);
+}
+
+/**
+ * Decode a whole member speculatively, up to GZPAR_SPAN bytes. Returns 1 if it was a valid member
+ */
+static int gzpar_member(gzpar_t *g, z_stream *zs, unsigned char *in, gzpar_job_t *j)
+{
+    uint64_t pos = j->start, cap = 0;
+    ssize_t n;
+    char *p;
+    int ret = Z_OK;
+
+    inflateReset(zs);
+    zs->avail_in = 0;
+    do {
+        if(!zs->avail_in) {
+            if((n = pread(g->fd, in, GZPAR_INSIZE, pos)) < 1) break;
+            zs->next_in = in;
+            zs->avail_in = n;
+            pos += n;
+        }
+        if(j->size == cap) {
+            if(cap >= GZPAR_SPAN || __atomic_load_n(&g->quit, __ATOMIC_RELAXED)) break;
+            cap = cap ? cap * 2 : 1024*1024;
+            if(!(p = (char*)realloc(j->data, cap))) break;
+            j->data = p;
+        }
+        zs->next_out = (unsigned char*)j->data + j->size;
+        zs->avail_out = cap - j->size;
+        ret = inflate(zs, Z_NO_FLUSH);
+        j->size = cap - zs->avail_out;
+    } while(ret == Z_OK);
+    if(ret != Z_STREAM_END) return 0;
+    j->end = pos - zs->avail_in;
+    return 1;
+}
+
+/**
+ * Worker without an index: look for gzip headers ahead of the output, and decode members there
+ */
+static void gzpar_members(gzpar_t *g, z_stream *zs, unsigned char *in)
+{
+    unsigned char *scan = in + GZPAR_INSIZE;
+    uint64_t start, c;
+    gzpar_job_t *j;
+    int i, n, ok;
+
+    pthread_mutex_lock(&g->mutex);
+    while(!g->quit) {
+        if(g->scan < g->head) g->scan = g->head;
+        if(g->scan >= g->fs || g->scan >= g->head + GZPAR_AHEAD) { pthread_cond_wait(&g->cond, &g->mutex); continue; }
+        start = g->scan;
+        g->scan += GZPAR_INSIZE;
+        pthread_mutex_unlock(&g->mutex);
+        n = (int)pread(g->fd, scan, GZPAR_INSIZE + 4, start);
+        pthread_mutex_lock(&g->mutex);
+        for(i = 0; i < n - 4 && i < GZPAR_INSIZE && !g->quit; i++) {
+            /* magic, deflate, no reserved flags */
+            if(scan[i] != 0x1f || scan[i + 1] != 0x8b || scan[i + 2] != 8 || (scan[i + 3] & 0xe0)) continue;
+            c = start + i;
+            /* wait for room. By then we might have passed it, or it could be the one we decode ourselves */
+            for(j = NULL; !g->quit && (c > g->head || (c == g->head && !g->inmember)) && !gzpar_find(g, c);
+              pthread_cond_wait(&g->cond, &g->mutex))
+                if(g->mem < GZPAR_MAXMEM && (j = gzpar_slot(g))) break;
+            if(!j) continue;
+            j->start = c;
+            j->state = GZPAR_BUSY;
+            pthread_mutex_unlock(&g->mutex);
+            ok = gzpar_member(g, zs, in, j);
+            if(verbose > 1) printf("gzpar_members() offset %" PRIu64 " %s, size %" PRIu64 "\r\n", c, ok ? "member" : "no member", j->size);
+            pthread_mutex_lock(&g->mutex);
+            j->state = ok ? GZPAR_DONE : GZPAR_FAIL;
+            if(ok) g->mem += j->size;
+            pthread_cond_broadcast(&g->cond);
+        }
+    }
+    pthread_mutex_unlock(&g->mutex);
+}
+
+/**
+ * Decode a span between two checkpoints. Returns 1 on success
+ */
+static int gzpar_span(gzpar_t *g, z_stream *zs, unsigned char *in, gzpar_job_t *j)
+{
+    gzpar_point_t *pt = &g->pts[j->start];
+    uint64_t pos = pt->in - (pt->bits ? 1 : 0);
+    ssize_t n;
+    int ret;
+
+    j->size = (j->start + 1 < (uint64_t)g->numpts ? pt[1].out : g->total) - pt->out;
+    if(j->size && !(j->data = (char*)malloc(j->size))) return 0;
+    inflateReset(zs);
+    if(pt->bits) {
+        if(pread(g->fd, in, 1, pos) != 1) return 0;
+        pos++;
+        inflatePrime(zs, pt->bits, in[0] >> (8 - pt->bits));
+    }
+    if(pt->wlen && (pread(g->idx, in, pt->wlen, pt->win) != pt->wlen ||
+      inflateSetDictionary(zs, in, pt->wlen) != Z_OK)) return 0;
+    zs->next_out = (unsigned char*)j->data;
+    zs->avail_out = j->size;
+    zs->avail_in = 0;
+    while(zs->avail_out && !__atomic_load_n(&g->quit, __ATOMIC_RELAXED)) {
+        if(!zs->avail_in) {
+            if((n = pread(g->fd, in, GZPAR_INSIZE, pos)) < 1) break;
+            zs->next_in = in;
+            zs->avail_in = n;
+            pos += n;
+        }
+        if((ret = inflate(zs, Z_NO_FLUSH)) != Z_OK) break;
+    }
+    if(zs->avail_out) return 0;
+    /* the spans are inflated raw, so the last one also looks up the trailer for the pipeline to check */
+    if(j->start + 1 == (uint64_t)g->numpts) {
+        ret = Z_OK;
+        while(ret != Z_STREAM_END) {
+            if(!zs->avail_in) {
+                if((n = pread(g->fd, in, GZPAR_INSIZE, pos)) < 1) return 0;
+                zs->next_in = in;
+                zs->avail_in = n;
+                pos += n;
+            }
+            /* there must be nothing left to output */
+            zs->next_out = in + GZPAR_INSIZE;
+            zs->avail_out = 1;
+            if(((ret = inflate(zs, Z_NO_FLUSH)) != Z_OK && ret != Z_STREAM_END) || !zs->avail_out) return 0;
+        }
+        if(pread(g->fd, in, 8, pos - zs->avail_in) != 8 ||
+          (uint32_t)(in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24)) != (uint32_t)g->total) return 0;
+        g->ctx->crcExpect = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+    }
+    return 1;
+}
+
+/**
+ * Worker with an index: decode the spans in order, but no more than what fits in memory
+ */
+static void gzpar_spans(gzpar_t *g, z_stream *zs, unsigned char *in)
+{
+    gzpar_job_t *j;
+    int ok;
+
+    pthread_mutex_lock(&g->mutex);
+    while(!g->quit) {
+        if(g->next >= g->numpts || g->next >= g->cur + GZPAR_MAXMEM / GZPAR_SPAN) {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+        j = &g->job[g->next % GZPAR_MAXJOBS];
+        memset(j, 0, sizeof(gzpar_job_t));
+        j->start = g->next++;
+        j->state = GZPAR_BUSY;
+        pthread_mutex_unlock(&g->mutex);
+        ok = gzpar_span(g, zs, in, j);
+        pthread_mutex_lock(&g->mutex);
+        j->state = ok ? GZPAR_DONE : GZPAR_FAIL;
+        pthread_cond_broadcast(&g->cond);
+    }
+    pthread_mutex_unlock(&g->mutex);
+}
+
+/**
+ * Worker thread
+ */
+static void *gzpar_worker(void *data)
+{
+    gzpar_t *g = (gzpar_t*)data;
+    unsigned char *in = (unsigned char*)malloc(2 * GZPAR_INSIZE + 4);
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    if(in && inflateInit2(&zs, g->pts ? -MAX_WBITS : 16 + MAX_WBITS) == Z_OK) {
+        if(g->pts) gzpar_spans(g, &zs, in); else gzpar_members(g, &zs, in);
+        inflateEnd(&zs);
+    }
+    free(in);
+    pthread_mutex_lock(&g->mutex);
+    g->alive--;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    return NULL;
+}
+
+/**
+ * Output the next span. Returns the number of bytes, 0 at the end, -1 on error
+ */
+static int gzpar_nextspan(gzpar_t *g, char *buf, int size)
+{
+    gzpar_job_t *j;
+    int n;
+
+    while(g->cur < g->numpts) {
+        j = &g->job[g->cur % GZPAR_MAXJOBS];
+        pthread_mutex_lock(&g->mutex);
+        while((j->state != GZPAR_DONE && j->state != GZPAR_FAIL) || j->start != (uint64_t)g->cur) {
+            if(!g->alive) { pthread_mutex_unlock(&g->mutex); return -1; }
+            pthread_cond_wait(&g->cond, &g->mutex);
+        }
+        pthread_mutex_unlock(&g->mutex);
+        if(j->state != GZPAR_DONE) return -1;
+        n = j->size - j->pos < (uint64_t)size ? (int)(j->size - j->pos) : size;
+        memcpy(buf, j->data + j->pos, n);
+        j->pos += n;
+        if(j->pos >= j->size) {
+            pthread_mutex_lock(&g->mutex);
+            free(j->data);
+            j->data = NULL;
+            j->state = GZPAR_FREE;
+            g->cur++;
+            pthread_cond_broadcast(&g->cond);
+            pthread_mutex_unlock(&g->mutex);
+        }
+        if(n) return n;
+    }
+    return 0;
+}
+
+/**
+ * Output the member at head, either decoded by a worker, or by us right here. Returns the
+ * number of bytes, 0 at the end, -1 on error
+ */
+static int gzpar_nextmember(gzpar_t *g, char *buf, int size)
+{
+    unsigned char magic[2] = { 0 }, *out;
+    gzpar_job_t *j;
+    ssize_t n;
+    int ret;
+
+    for(;;) {
+        if(!g->inmember) {
+            pthread_mutex_lock(&g->mutex);
+            while((j = gzpar_find(g, g->head)) && j->state == GZPAR_BUSY)
+                pthread_cond_wait(&g->cond, &g->mutex);
+            if(j && j->state == GZPAR_DONE) {
+                pthread_mutex_unlock(&g->mutex);
+                /* the trailer's size was only that of the last member */
+                if(g->head) stream_setsize(g->ctx, 0);
+                n = j->size - j->pos < (uint64_t)size ? (int)(j->size - j->pos) : size;
+                memcpy(buf, j->data + j->pos, n);
+                j->pos += n;
+                if(j->pos >= j->size) {
+                    pthread_mutex_lock(&g->mutex);
+                    g->head = j->end;
+                    gzpar_drop(g, j);
+                    gzpar_reap(g);
+                    pthread_cond_broadcast(&g->cond);
+                    pthread_mutex_unlock(&g->mutex);
+                }
+                if(n) return n;
+                continue;
+            }
+            /* not a member a worker could decode, like a big one. Do it ourselves */
+            if(j) gzpar_drop(g, j);
+            if(g->head < g->fs) g->inmember = 1;
+            pthread_mutex_unlock(&g->mutex);
+            if(!g->inmember) return 0;
+            /* ignore trailing garbage (zero padding) */
+            if(pread(g->fd, magic, 2, g->head) != 2 || magic[0] != 0x1f || magic[1] != 0x8b) {
+                pthread_mutex_lock(&g->mutex);
+                g->head = g->fs;
+                g->inmember = 0;
+                pthread_cond_broadcast(&g->cond);
+                pthread_mutex_unlock(&g->mutex);
+                return 0;
+            }
+            if(verbose > 1) printf("gzpar_nextmember() decoding member at %" PRIu64 "\r\n", g->head);
+            if(g->head) stream_setsize(g->ctx, 0); else gzpar_build(g);
+            inflateReset(&g->zs);
+            g->zs.avail_in = 0;
+            g->inpos = g->head;
+        }
+        g->zs.next_out = (unsigned char*)buf;
+        g->zs.avail_out = size;
+        do {
+            if(!g->zs.avail_in) {
+                if((n = pread(g->fd, g->inbuf, GZPAR_INSIZE, g->inpos)) < 1) return -1;
+                g->zs.next_in = g->inbuf;
+                g->zs.avail_in = n;
+                g->inpos += n;
+            }
+            out = g->zs.next_out;
+            ret = inflate(&g->zs, g->bf ? Z_BLOCK : Z_NO_FLUSH);
+            if(g->bf) gzpar_point(g, out, (int)(g->zs.next_out - out));
+        } while(ret == Z_OK && g->zs.avail_out);
+        if(ret == Z_STREAM_END) {
+            pthread_mutex_lock(&g->mutex);
+            g->head = g->inpos - g->zs.avail_in;
+            g->inmember = 0;
+            gzpar_reap(g);
+            pthread_cond_broadcast(&g->cond);
+            pthread_mutex_unlock(&g->mutex);
+            if(g->bf) gzpar_built(g);
+        } else if(ret != Z_OK) {
+            if(verbose) printf("  zlib inflate error %d\r\n", ret);
+            return -1;
+        }
+        if(g->zs.avail_out < (uInt)size) return size - g->zs.avail_out;
+    }
+}
+
+/**
+ * Output hook for stream_read(), fills the buffer unless we're at the end
+ */
+static int gzpar_output(void *data, char *buf, int size)
+{
+    gzpar_t *g = (gzpar_t*)data;
+    uint64_t pos;
+    int n, ret = 0;
+
+    while(ret < size) {
+        n = g->pts ? gzpar_nextspan(g, buf + ret, size - ret) : gzpar_nextmember(g, buf + ret, size - ret);
+        if(n < 0) return -1;
+        if(!n) break;
+        ret += n;
+    }
+    if(ret < size) {
+        __atomic_store_n(&g->ctx->cmrdSize, g->fs, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, (uint64_t)-1);
+    } else {
+        pos = g->pts ? g->pts[g->cur < g->numpts ? g->cur : g->numpts - 1].in : (g->inmember ? g->inpos : g->head);
+        __atomic_store_n(&g->ctx->cmrdSize, pos, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, pos);
+    }
+    return ret;
+}
+
+/**
+ * Start decompressing a gzip source on all cores
+ */
+int gzpar_open(stream_t *ctx)
+{
+    gzpar_t *g = &gzpar;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if(n < 2 || ctx->type != TYPE_DEFLATE || !ctx->multi) return 0;
+    if(n > GZPAR_MAXTHREADS) n = GZPAR_MAXTHREADS;
+    memset(g, 0, sizeof(gzpar_t));
+    g->ctx = ctx;
+    g->fd = fileno(ctx->f);
+    g->fs = ctx->compSize;
+    g->idx = -1;
+    if(!(g->inbuf = (unsigned char*)malloc(GZPAR_INSIZE))) return 0;
+    if(inflateInit2(&g->zs, 16 + MAX_WBITS) != Z_OK) { free(g->inbuf); return 0; }
+    gzpar_load(g);
+    if(g->pts) {
+        /* the raw spans aren't checked by zlib, the last one provides the CRC */
+        stream_setsize(ctx, g->total);
+        ctx->hasCrc = 1;
+    }
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    for(i = 0; i < n; i++)
+        if(!pthread_create(&g->thread[g->numthreads], NULL, gzpar_worker, g)) g->numthreads++;
+    g->alive = g->numthreads;
+    if(verbose) printf("gzpar_open() threads %d index %s points %d\r\n", g->numthreads,
+        g->pts ? g->fn : "none", g->numpts);
+    ctx->output = gzpar_output;
+    ctx->outputData = g;
+    return 1;
+}
+
+/**
+ * Stop the threads and free everything
+ */
+void gzpar_close(stream_t *ctx)
+{
+    gzpar_t *g = &gzpar;
+    int i;
+
+    if(ctx->outputData != g) return;
+    pthread_mutex_lock(&g->mutex);
+    __atomic_store_n(&g->quit, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    for(i = 0; i < g->numthreads; i++)
+        pthread_join(g->thread[i], NULL);
+    gzpar_discard(g);
+    for(i = 0; i < GZPAR_MAXJOBS; i++)
+        free(g->job[i].data);
+    free(g->pts);
+    if(g->idx >= 0) close(g->idx);
+    free(g->inbuf);
+    inflateEnd(&g->zs);
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->mutex);
+    ctx->output = NULL;
+    ctx->outputData = NULL;
+}
+
+#endif
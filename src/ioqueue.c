@@ -0,0 +1,349 @@
+/*
+ * usbimager/ioqueue.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Asynchronous write submission queue
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "main.h"
+#include "ioqueue.h"
+
+#if USE_IOURING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**
+ * Try to set up an io_uring for the queue, on failure we silently fall back to pwrite
+ */
+static void ioqueue_uring(ioqueue_t *q)
+{
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, q->depth, &p);
+    if(fd < 0) {
+        if(verbose) printf("  io_uring_setup errno=%d err=%s\r\n", errno, strerror(errno));
+        errno = 0;
+        return;
+    }
+    q->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(q->cqsize > q->sqsize) q->sqsize = q->cqsize;
+        q->cqsize = q->sqsize;
+    }
+    q->sqptr = mmap(NULL, q->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+    if(q->sqptr == MAP_FAILED) { q->sqptr = NULL; goto err; }
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        q->cqptr = q->sqptr;
+    else {
+        q->cqptr = mmap(NULL, q->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING);
+        if(q->cqptr == MAP_FAILED) { q->cqptr = NULL; goto err; }
+    }
+    q->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = mmap(NULL, q->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+    if(q->sqes == MAP_FAILED) { q->sqes = NULL; goto err; }
+    q->sqhead = (unsigned*)((char*)q->sqptr + p.sq_off.head);
+    q->sqtail = (unsigned*)((char*)q->sqptr + p.sq_off.tail);
+    q->sqmask = (unsigned*)((char*)q->sqptr + p.sq_off.ring_mask);
+    q->sqarray = (unsigned*)((char*)q->sqptr + p.sq_off.array);
+    q->cqhead = (unsigned*)((char*)q->cqptr + p.cq_off.head);
+    q->cqtail = (unsigned*)((char*)q->cqptr + p.cq_off.tail);
+    q->cqmask = (unsigned*)((char*)q->cqptr + p.cq_off.ring_mask);
+    q->cqes = (char*)q->cqptr + p.cq_off.cqes;
+    q->uring = fd;
+    return;
+err:
+    if(verbose) printf("  io_uring mmap errno=%d err=%s\r\n", errno, strerror(errno));
+    if(q->sqes) munmap(q->sqes, q->sqessize);
+    if(q->cqptr && q->cqptr != q->sqptr) munmap(q->cqptr, q->cqsize);
+    if(q->sqptr) munmap(q->sqptr, q->sqsize);
+    q->sqptr = q->cqptr = q->sqes = NULL;
+    close(fd);
+    errno = 0;
+}
+
+/**
+ * Put a request on the submission ring. If the kernel didn't take it, it's taken off the ring again,
+ * so that it can't be submitted later along with another one, when its buffer might be reused
+ */
+static int ioqueue_submit(ioqueue_t *q, int i)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *q->sqtail, idx = tail & *q->sqmask;
+
+    sqe = &((struct io_uring_sqe*)q->sqes)[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    /* writev is available since the very first io_uring kernel */
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = q->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&q->req[i].iov;
+    sqe->len = 1;
+    sqe->off = q->req[i].offset;
+    sqe->user_data = (uint64_t)i;
+    q->sqarray[idx] = idx;
+    __atomic_store_n(q->sqtail, tail + 1, __ATOMIC_RELEASE);
+    while(syscall(__NR_io_uring_enter, q->uring, 1, 0, 0, NULL, 0) < 0)
+        if(errno != EINTR) {
+            /* there's no SQ polling thread, so the kernel only consumes entries during the enter call */
+            if(__atomic_load_n(q->sqhead, __ATOMIC_ACQUIRE) != tail) return 0;
+            __atomic_store_n(q->sqtail, tail, __ATOMIC_RELEASE);
+            return -1;
+        }
+    return 0;
+}
+
+/**
+ * Get the next completion from the completion ring, returns the request's index
+ */
+static int ioqueue_reap(ioqueue_t *q)
+{
+    struct io_uring_cqe *cqe;
+    ioqueue_req_t *r;
+    unsigned head;
+    int i, res;
+
+    while(1) {
+        head = *q->cqhead;
+        if(head == __atomic_load_n(q->cqtail, __ATOMIC_ACQUIRE)) {
+            if(syscall(__NR_io_uring_enter, q->uring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+        cqe = &((struct io_uring_cqe*)q->cqes)[head & *q->cqmask];
+        i = (int)cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(q->cqhead, head + 1, __ATOMIC_RELEASE);
+        r = &q->req[i];
+        if(res > 0 && (size_t)res < r->iov.iov_len) {
+            /* short write, submit the remaining part */
+            r->iov.iov_base = (char*)r->iov.iov_base + res;
+            r->iov.iov_len -= res;
+            r->offset += res;
+            r->done += res;
+            if(!ioqueue_submit(q, i)) continue;
+            res = -errno;
+        }
+        r->res = res < 0 ? res : r->done + res;
+        return i;
+    }
+}
+#endif
+
+/**
+ * Set up a queue for fd with at most depth writes in flight
+ */
+int ioqueue_open(ioqueue_t *q, int fd, int depth)
+{
+    memset(q, 0, sizeof(ioqueue_t));
+    q->fd = fd;
+    q->uring = -1;
+    if(depth < 1) depth = 1;
+    if(depth > IOQUEUE_MAXDEPTH) depth = IOQUEUE_MAXDEPTH;
+    /* serial ports can't do positioned writes */
+    q->stream = lseek(fd, 0, SEEK_CUR) == (off_t)-1;
+    if(q->stream) depth = 1;
+    q->depth = depth;
+#if USE_IOURING
+    if(depth > 1) ioqueue_uring(q);
+#endif
+    errno = 0;
+    if(verbose) printf("ioqueue_open(%d) depth %d %s\r\n", fd, q->depth,
+        q->uring != -1 ? "io_uring" : (q->stream ? "write" : "pwrite"));
+    return 0;
+}
+
+/**
+ * Submit a write of size bytes from buf at offset, data is passed back on completion
+ */
+int ioqueue_write(ioqueue_t *q, void *buf, int size, uint64_t offset, void *data)
+{
+    ioqueue_req_t *r;
+    int i, n;
+
+    if(q->failed) { errno = q->failed; return -1; }
+    for(i = 0; i < q->depth && q->req[i].busy; i++);
+    if(i >= q->depth) return -1;
+    r = &q->req[i];
+    r->iov.iov_base = buf;
+    r->iov.iov_len = size;
+    r->offset = offset;
+    r->size = size;
+    r->busy = 1;
+    r->done = r->res = 0;
+    r->data = data;
+    q->inflight++;
+#if USE_IOURING
+    if(q->uring != -1) {
+        if(!ioqueue_submit(q, i)) return 0;
+        r->busy = 0;
+        q->inflight--;
+        return -1;
+    }
+#endif
+    /* synchronous fallback, the request is completed by the time we return */
+    while(r->done < size) {
+        errno = 0;
+        n = q->stream ? (int)write(q->fd, (char*)buf + r->done, size - r->done) :
+            (int)pwrite(q->fd, (char*)buf + r->done, size - r->done, (off_t)(offset + r->done));
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 1) break;
+        r->done += n;
+    }
+    r->res = r->done < size && errno ? -errno : r->done;
+    q->fifo[(q->fifohead + q->fifonum++) % IOQUEUE_MAXDEPTH] = i;
+    return 0;
+}
+
+/**
+ * Wait for the next completed write, returns number of bytes written or -1 on error (short writes included).
+ * If data is NULL then, the queue has failed, and the writes still in flight are abandoned
+ */
+int ioqueue_wait(ioqueue_t *q, void **data)
+{
+    ioqueue_req_t *r;
+    int i;
+
+    *data = NULL;
+    if(!q->inflight) return -1;
+#if USE_IOURING
+    if(q->uring != -1) {
+        if((i = ioqueue_reap(q)) < 0) {
+            /* we can't tell when the writes in flight are done with their buffers any more, so the queue
+             * is failed for good. Their slots stay busy, and nothing is submitted after this */
+            q->failed = errno ? errno : EIO;
+            q->inflight = 0;
+            errno = q->failed;
+            return -1;
+        }
+    } else
+#endif
+    {
+        i = q->fifo[q->fifohead];
+        q->fifohead = (q->fifohead + 1) % IOQUEUE_MAXDEPTH;
+        q->fifonum--;
+    }
+    r = &q->req[i];
+    r->busy = 0;
+    q->inflight--;
+    *data = r->data;
+    if(r->res < 0) { errno = -r->res; return -1; }
+    errno = 0;
+    return r->res < r->size ? -1 : r->res;
+}
+
+/**
+ * Wait for all writes in flight and free resources
+ */
+void ioqueue_close(ioqueue_t *q)
+{
+    void *data;
+
+    while(q->inflight) ioqueue_wait(q, &data);
+#if USE_IOURING
+    if(q->uring != -1) {
+        munmap(q->sqes, q->sqessize);
+        if(q->cqptr != q->sqptr) munmap(q->cqptr, q->cqsize);
+        munmap(q->sqptr, q->sqsize);
+        close(q->uring);
+        q->uring = -1;
+    }
+#endif
+}
+
+/**
+ * Set up writeback control for fd
+ */
+void ioqueue_wbopen(ioqueue_wb_t *wb, int fd)
+{
+    memset(wb, 0, sizeof(ioqueue_wb_t));
+    wb->fd = fd;
+#ifdef SYNC_FILE_RANGE_WRITE
+    /* not needed if every write waits for the device anyway, and serial ports can't do it */
+    if(!(fcntl(fd, F_GETFL) & (O_SYNC | O_DIRECT)) && lseek(fd, 0, SEEK_CUR) != (off_t)-1)
+        wb->window = (uint64_t)writeback_window << 20;
+#endif
+    errno = 0;
+    if(verbose) printf("ioqueue_wbopen(%d) window %" PRIu64 "\r\n", fd, wb->window);
+}
+
+/**
+ * Wait until the device has everything up to end
+ */
+static int ioqueue_wbwait(ioqueue_wb_t *wb, uint64_t end)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+    if(end > wb->synced && sync_file_range(wb->fd, (off_t)wb->synced, (off_t)(end - wb->synced),
+      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)) return -1;
+#endif
+    wb->synced = end;
+    return 0;
+}
+
+/**
+ * Account size bytes written in order, and keep the unflushed data within the window
+ */
+int ioqueue_wbwritten(ioqueue_wb_t *wb, uint64_t size)
+{
+    uint64_t start = wb->queued;
+
+    wb->queued += size;
+    if(!wb->window) { wb->synced = wb->queued; return 0; }
+#ifdef SYNC_FILE_RANGE_WRITE
+    /* start writing back this range, but don't wait for it */
+    if(sync_file_range(wb->fd, (off_t)start, (off_t)size, SYNC_FILE_RANGE_WRITE)) return -1;
+#else
+    (void)start;
+#endif
+    /* too much at risk, wait for the older half */
+    if(wb->queued - wb->synced > wb->window) {
+        if(verbose > 1) printf("ioqueue_wbwritten() waiting for %" PRIu64 " - %" PRIu64 "\r\n", wb->synced,
+            wb->queued - wb->window / 2);
+        return ioqueue_wbwait(wb, wb->queued - wb->window / 2);
+    }
+    return 0;
+}
+
+/**
+ * Wait until everything written so far is on the device
+ */
+int ioqueue_wbflush(ioqueue_wb_t *wb)
+{
+    return ioqueue_wbwait(wb, wb->queued);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * usbimager/ioqueue.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Asynchronous write submission queue
+ *
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define IOQUEUE_MAXDEPTH 64
+
+/* one write request */
+typedef struct {
+    struct iovec iov;
+    uint64_t offset;
+    int size;
+    int busy;
+    int done;               /* bytes already written in case of short writes */
+    int res;
+    void *data;
+} ioqueue_req_t;
+
+/* submission queue context */
+typedef struct {
+    int fd;
+    int depth;
+    int inflight;
+    int stream;             /* target is not seekable (serial port), sequential write() only */
+    int uring;              /* io_uring file descriptor, -1 when using the pwrite fallback */
+    int failed;             /* errno of a failed completion ring, the queue can't be used after that */
+    ioqueue_req_t req[IOQUEUE_MAXDEPTH];
+    int fifo[IOQUEUE_MAXDEPTH], fifohead, fifonum;
+    /* io_uring rings */
+    void *sqptr, *cqptr, *sqes;
+    size_t sqsize, cqsize, sqessize;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    void *cqes;
+} ioqueue_t;
+
+/* writeback controller, bounds the data that's written but not on the device yet */
+typedef struct {
+    int fd;
+    uint64_t window;        /* most unflushed bytes allowed, 0 if writes are synchronous anyway */
+    uint64_t queued;        /* written in order up to here */
+    uint64_t synced;        /* known to be on the device up to here */
+} ioqueue_wb_t;
+
+/**
+ * Set up a queue for fd with at most depth writes in flight
+ */
+int ioqueue_open(ioqueue_t *q, int fd, int depth);
+
+/**
+ * Submit a write of size bytes from buf at offset, data is passed back on completion
+ */
+int ioqueue_write(ioqueue_t *q, void *buf, int size, uint64_t offset, void *data);
+
+/**
+ * Wait for the next completed write, returns number of bytes written or -1 on error (short writes included).
+ * If data is NULL then, the queue has failed, and the writes still in flight are abandoned
+ */
+int ioqueue_wait(ioqueue_t *q, void **data);
+
+/**
+ * Wait for all writes in flight and free resources
+ */
+void ioqueue_close(ioqueue_t *q);
+
+/**
+ * Set up writeback control for fd, with a window of writeback_window megabytes
+ */
+void ioqueue_wbopen(ioqueue_wb_t *wb, int fd);
+
+/**
+ * Account size bytes written in order, start their writeback, and wait for the oldest ones if there's
+ * more than the window unflushed. Returns 0 on success, -1 on error
+ */
+int ioqueue_wbwritten(ioqueue_wb_t *wb, uint64_t size);
+
+/**
+ * Wait until everything written so far is on the device. Returns 0 on success, -1 on error
+ */
+int ioqueue_wbflush(ioqueue_wb_t *wb);
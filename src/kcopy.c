@@ -0,0 +1,146 @@
+/*
+ * usbimager/kcopy.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Kernel side copy of plain data between files and disks
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lang.h"
+#include "stream.h"
+#include "ioqueue.h"
+#include "pipeline.h"
+#include "kcopy.h"
+
+/**
+ * Copy size bytes from src to dst in buffer_size chunks, reporting progress after each. Tries
+ * copy_file_range() first, then splice() through a pipe. Returns 1 if done, 0 if the kernel can't
+ * copy between these two and nothing was written, -1 on error. With wb, writeback is controlled too
+ */
+static int kcopy_copy(stream_t *ctx, ioqueue_wb_t *wb, int src, uint64_t srcoff, int dst, uint64_t dstoff, uint64_t size)
+{
+#ifdef __linux__
+    loff_t in = (loff_t)srcoff, out = (loff_t)dstoff;
+    uint64_t done = 0;
+    ssize_t n, m, k;
+    int chunk, ret = 1, pfd[2] = { -1, -1 };
+
+    while(done < size) {
+        chunk = size - done > (uint64_t)buffer_size ? buffer_size : (int)(size - done);
+        errno = 0;
+        if(pfd[0] == -1) {
+            n = copy_file_range(src, &in, dst, &out, chunk, 0);
+            /* not between these two (block devices, different file systems), try splice */
+            if(n < 0 && !done && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                if(pipe(pfd)) { pfd[0] = pfd[1] = -1; ret = 0; break; }
+                fcntl(pfd[1], F_SETPIPE_SZ, buffer_size);
+                if(verbose) printf("kcopy_copy() using splice\r\n");
+                continue;
+            }
+        } else {
+            n = splice(src, &in, pfd[1], NULL, chunk, SPLICE_F_MOVE);
+            for(m = 0; n > 0 && m < n; m += k)
+                if((k = splice(pfd[0], NULL, dst, &out, n - m, SPLICE_F_MOVE)) < 1) break;
+            if(n > 0 && m < n) n = -1;
+        }
+        if(verbose > 1) printf("kcopy_copy() offset %" PRIu64 " size %d n %d errno=%d\r\n", dstoff + done, chunk, (int)n, errno);
+        if(n < 1) {
+            /* nothing written yet, the caller can still fall back to the read / write loop */
+            ret = !done && out == (loff_t)dstoff && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                errno == EOPNOTSUPP) ? 0 : -1;
+            if(!n && !errno) errno = EIO;
+            break;
+        }
+        done += (uint64_t)n;
+        pipeline_advise(ctx, src, (uint64_t)in);
+        __atomic_add_fetch(&ctx->readSize, (uint64_t)n, __ATOMIC_RELAXED);
+        if(!wb)
+            __atomic_add_fetch(&ctx->wrtnSize, (uint64_t)n, __ATOMIC_RELAXED);
+        else {
+            if(ioqueue_wbwritten(wb, (uint64_t)n)) { ret = -1; break; }
+            __atomic_store_n(&ctx->wrtnSize, wb->synced, __ATOMIC_RELAXED);
+        }
+        main_onProgress(ctx);
+    }
+    pipeline_advise(ctx, src, (uint64_t)-1);
+    if(pfd[0] != -1) { close(pfd[0]); close(pfd[1]); }
+    if(!ret) errno = 0;
+    return ret;
+#else
+    (void)ctx; (void)wb; (void)src; (void)srcoff; (void)dst; (void)dstoff; (void)size;
+    return 0;
+#endif
+}
+
+/**
+ * Write a plain image to the target disk inside the kernel
+ */
+int kcopy_write(stream_t *ctx, int dst)
+{
+    static ioqueue_wb_t wb;
+    uint64_t start, size;
+    int ret, tail;
+
+    /* sparse images and files, those with a block map and serial ports are written by the normal path */
+    if(ctx->type != TYPE_PLAIN || ctx->sparse || !ctx->f || !ctx->fileSize || lseek(dst, 0, SEEK_CUR) < 0) { errno = 0; return 0; }
+    start = (uint64_t)ftello(ctx->f);
+    /* the last, partial sector has to be padded, that's done in user space */
+    size = ctx->fileSize & ~((uint64_t)ctx->secSize - 1);
+    if(verbose) printf("kcopy_write() data offset %" PRIu64 " size %" PRIu64 "\r\n", start, ctx->fileSize);
+    ioqueue_wbopen(&wb, dst);
+    /* report what's on the device, not what has been copied */
+    ctx->pipelined = 1;
+    if(size && (ret = kcopy_copy(ctx, &wb, fileno(ctx->f), start, dst, 0, size)) < 1) return ret;
+    if((tail = (int)(ctx->fileSize - size))) {
+        if(fseeko(ctx->f, (off_t)(start + size), SEEK_SET) || !fread(ctx->buffer, tail, 1, ctx->f)) return -1;
+        memset(ctx->buffer + tail, 0, ctx->secSize - tail);
+        if(pwrite(dst, ctx->buffer, ctx->secSize, (off_t)size) != ctx->secSize) return -1;
+        __atomic_add_fetch(&ctx->readSize, (uint64_t)ctx->secSize, __ATOMIC_RELAXED);
+        if(ioqueue_wbwritten(&wb, (uint64_t)ctx->secSize)) return -1;
+    }
+    if(ioqueue_wbflush(&wb)) return -1;
+    __atomic_store_n(&ctx->wrtnSize, wb.synced, __ATOMIC_RELAXED);
+    main_onProgress(ctx);
+    return 1;
+}
+
+/**
+ * Back up the disk into a plain image file inside the kernel
+ */
+int kcopy_read(stream_t *ctx, int src)
+{
+    if(ctx->type != TYPE_PLAIN || !ctx->f) return 0;
+    if(verbose) printf("kcopy_read() size %" PRIu64 "\r\n", ctx->fileSize);
+    fflush(ctx->f);
+    return kcopy_copy(ctx, NULL, src, 0, fileno(ctx->f), 0, ctx->fileSize);
+}
+
+#endif
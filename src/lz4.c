@@ -0,0 +1,290 @@
+/*
+ * usbimager/lz4.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief LZ4 frame format decoder
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+#define XXH_NAMESPACE ZSTD_
+#define XXH_STATIC_LINKING_ONLY
+#include "common/xxhash.h"
+
+enum { LZ4_S_MAGIC, LZ4_S_SKIPSIZE, LZ4_S_SKIP, LZ4_S_HEADER, LZ4_S_BSIZE, LZ4_S_BLOCK, LZ4_S_FLUSH, LZ4_S_CHECKSUM };
+
+struct lz4_dec_s {
+    int state;
+    lz4_frame_t fh;
+    uint8_t tmp[LZ4_HEADERMAX]; /* magic, header, block size or checksum being collected */
+    size_t pos, need;           /* of the bytes being collected */
+    uint64_t skip;              /* what's left of a skippable frame */
+    uint32_t bsize;
+    uint8_t *cbuf;              /* compressed block and its checksum, if it's not in the input in one piece */
+    uint8_t *win;               /* history of linked blocks, followed by the decoded block */
+    size_t cap;                 /* largest block the buffers can hold */
+    size_t wpos, wend;          /* decoded block not output yet */
+    uint64_t total;
+    XXH32_state_t xs;
+};
+
+/**
+ * Little endian 32 bit value
+ */
+static uint32_t lz4_get32(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/**
+ * Size of the frame header from its flags
+ */
+static int lz4_hdrsize(uint8_t flg)
+{
+    return 7 + (flg & 8 ? 8 : 0) + (flg & 1 ? 4 : 0);
+}
+
+/**
+ * Parse a frame header. Returns its size, 0 if len is too short, -1 if it's not valid
+ */
+int lz4_header(const uint8_t *buf, int len, lz4_frame_t *fh)
+{
+    int n;
+
+    if(len < 7) return 0;
+    if(lz4_get32(buf) != LZ4_MAGIC) return -1;
+    /* version 01, no reserved bits, a valid block size and no dictionary (we couldn't have that) */
+    if((buf[4] & 0xC3) != 0x40 || (buf[5] & 0x8F) || ((buf[5] >> 4) & 7) < 4) return -1;
+    n = lz4_hdrsize(buf[4]);
+    if(len < n) return 0;
+    if(((XXH32(buf + 4, n - 5, 0) >> 8) & 0xFF) != buf[n - 1]) return -1;
+    memset(fh, 0, sizeof(lz4_frame_t));
+    fh->hdrSize = n;
+    fh->blockMax = 1 << (8 + 2 * ((buf[5] >> 4) & 7));
+    fh->linked = !(buf[4] & 0x20);
+    fh->blockSum = (buf[4] & 0x10) != 0;
+    fh->contentSum = (buf[4] & 4) != 0;
+    fh->hasSize = (buf[4] & 8) != 0;
+    if(fh->hasSize) fh->contentSize = lz4_get32(buf + 6) | ((uint64_t)lz4_get32(buf + 10) << 32);
+    return n;
+}
+
+/**
+ * Decode one block. With hist set, the block may refer to that many bytes before dst.
+ * Returns the decoded size, -1 on error
+ */
+int lz4_block(const uint8_t *src, int srcSize, uint8_t *dst, int dstCap, int hist)
+{
+    const uint8_t *ip = src, *iend = src + srcSize, *match;
+    uint8_t *op = dst, *oend = dst + dstCap;
+    size_t len, off, n;
+    unsigned int token, c;
+
+    while(ip < iend) {
+        token = *ip++;
+        /* literals */
+        if((len = token >> 4) == 15)
+            do { if(ip >= iend) return -1; len += c = *ip++; } while(c == 255);
+        if(len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, len);
+        op += len; ip += len;
+        /* the last sequence has no match */
+        if(ip == iend) break;
+        if(iend - ip < 2) return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(!off || off > (size_t)(op - dst) + (size_t)hist) return -1;
+        if((len = token & 15) == 15)
+            do { if(ip >= iend) return -1; len += c = *ip++; } while(c == 255);
+        len += 4;
+        if(len > (size_t)(oend - op)) return -1;
+        match = op - off;
+        /* an overlapping match repeats the last off bytes, so the copied chunks can double each time */
+        while(len) {
+            n = (size_t)(op - match) < len ? (size_t)(op - match) : len;
+            memcpy(op, match, n);
+            op += n; len -= n;
+        }
+    }
+    return (int)(op - dst);
+}
+
+/**
+ * Allocate a streaming decoder
+ */
+lz4_dec_t *lz4_dec_init(void)
+{
+    lz4_dec_t *s = (lz4_dec_t*)calloc(1, sizeof(lz4_dec_t));
+    if(s) lz4_dec_reset(s);
+    return s;
+}
+
+/**
+ * Prepare for the next frame
+ */
+void lz4_dec_reset(lz4_dec_t *s)
+{
+    s->state = LZ4_S_MAGIC;
+    s->pos = 0;
+    s->need = 4;
+}
+
+/**
+ * Collect the needed bytes into dst, returns 1 once they're all there
+ */
+static int lz4_fill(lz4_dec_t *s, lz4_buf_t *b, uint8_t *dst)
+{
+    size_t n = s->need - s->pos;
+
+    if(n > b->in_size - b->in_pos) n = b->in_size - b->in_pos;
+    memcpy(dst + s->pos, b->in + b->in_pos, n);
+    s->pos += n;
+    b->in_pos += n;
+    return s->pos == s->need;
+}
+
+/**
+ * Start collecting the next part
+ */
+static void lz4_next(lz4_dec_t *s, int state, size_t need)
+{
+    s->state = state;
+    s->pos = 0;
+    s->need = need;
+}
+
+/**
+ * Decode as much as possible, stops at the end of each frame
+ */
+int lz4_dec_run(lz4_dec_t *s, lz4_buf_t *b)
+{
+    const uint8_t *src;
+    uint8_t *p;
+    size_t n, len;
+    int ret;
+
+    for(;;)
+        switch(s->state) {
+            case LZ4_S_MAGIC:
+                if(!lz4_fill(s, b, s->tmp)) return LZ4_OK;
+                if((lz4_get32(s->tmp) & 0xFFFFFFF0) == LZ4_SKIPPABLE) { s->state = LZ4_S_SKIPSIZE; s->need = 8; break; }
+                if(lz4_get32(s->tmp) != LZ4_MAGIC) return LZ4_DATA_ERROR;
+                s->state = LZ4_S_HEADER;
+                s->need = 5;
+            break;
+            case LZ4_S_SKIPSIZE:
+                if(!lz4_fill(s, b, s->tmp)) return LZ4_OK;
+                s->skip = lz4_get32(s->tmp + 4);
+                s->state = LZ4_S_SKIP;
+            /* fall through */
+            case LZ4_S_SKIP:
+                n = b->in_size - b->in_pos < s->skip ? b->in_size - b->in_pos : s->skip;
+                b->in_pos += n;
+                s->skip -= n;
+                if(s->skip) return LZ4_OK;
+                lz4_dec_reset(s);
+                return LZ4_STREAM_END;
+            case LZ4_S_HEADER:
+                if(!lz4_fill(s, b, s->tmp)) return LZ4_OK;
+                /* now that we have the flags, we know how long it is */
+                if(s->need < (size_t)lz4_hdrsize(s->tmp[4])) { s->need = lz4_hdrsize(s->tmp[4]); break; }
+                if(lz4_header(s->tmp, s->need, &s->fh) < 1) return LZ4_DATA_ERROR;
+                if((size_t)s->fh.blockMax > s->cap) {
+                    free(s->cbuf);
+                    free(s->win);
+                    s->cap = s->fh.blockMax;
+                    s->cbuf = (uint8_t*)malloc(s->cap + 4);
+                    s->win = (uint8_t*)malloc(LZ4_WINDOW + s->cap);
+                    if(!s->cbuf || !s->win) { s->cap = 0; return LZ4_MEM_ERROR; }
+                }
+                XXH32_reset(&s->xs, 0);
+                s->total = 0;
+                s->wpos = s->wend = 0;
+                lz4_next(s, LZ4_S_BSIZE, 4);
+            break;
+            case LZ4_S_BSIZE:
+                if(!lz4_fill(s, b, s->tmp)) return LZ4_OK;
+                s->bsize = lz4_get32(s->tmp);
+                /* end mark */
+                if(!s->bsize) { lz4_next(s, LZ4_S_CHECKSUM, s->fh.contentSum ? 4 : 0); break; }
+                if((s->bsize & 0x7FFFFFFF) > (uint32_t)s->fh.blockMax) return LZ4_DATA_ERROR;
+                lz4_next(s, LZ4_S_BLOCK, (s->bsize & 0x7FFFFFFF) + (s->fh.blockSum ? 4 : 0));
+            break;
+            case LZ4_S_BLOCK:
+                /* no need to copy it if the whole block is in the input */
+                if(!s->pos && b->in_size - b->in_pos >= s->need) {
+                    src = b->in + b->in_pos;
+                    b->in_pos += s->need;
+                } else {
+                    if(!lz4_fill(s, b, s->cbuf)) return LZ4_OK;
+                    src = s->cbuf;
+                }
+                len = s->bsize & 0x7FFFFFFF;
+                if(s->fh.blockSum && XXH32(src, len, 0) != lz4_get32(src + len)) return LZ4_DATA_ERROR;
+                /* linked blocks need the last 64k of the history, the others start over */
+                if(!s->fh.linked) s->wend = 0; else
+                if(s->wend + s->fh.blockMax > LZ4_WINDOW + s->cap) {
+                    n = s->wend < LZ4_WINDOW ? s->wend : LZ4_WINDOW;
+                    memmove(s->win, s->win + s->wend - n, n);
+                    s->wend = n;
+                }
+                p = s->win + s->wend;
+                if(s->bsize & 0x80000000) { memcpy(p, src, len); ret = (int)len; }
+                else if((ret = lz4_block(src, (int)len, p, s->fh.blockMax, (int)s->wend)) < 0) return LZ4_DATA_ERROR;
+                if(s->fh.contentSum) XXH32_update(&s->xs, p, ret);
+                s->wpos = s->wend;
+                s->wend += ret;
+                s->total += ret;
+                s->state = LZ4_S_FLUSH;
+            /* fall through */
+            case LZ4_S_FLUSH:
+                n = s->wend - s->wpos;
+                if(n > b->out_size - b->out_pos) n = b->out_size - b->out_pos;
+                memcpy(b->out + b->out_pos, s->win + s->wpos, n);
+                b->out_pos += n;
+                s->wpos += n;
+                if(s->wpos < s->wend) return LZ4_OK;
+                lz4_next(s, LZ4_S_BSIZE, 4);
+            break;
+            case LZ4_S_CHECKSUM:
+                if(!lz4_fill(s, b, s->tmp)) return LZ4_OK;
+                if((s->fh.contentSum && XXH32_digest(&s->xs) != lz4_get32(s->tmp)) ||
+                  (s->fh.hasSize && s->total != s->fh.contentSize)) return LZ4_DATA_ERROR;
+                lz4_dec_reset(s);
+                return LZ4_STREAM_END;
+        }
+}
+
+/**
+ * Free the decoder
+ */
+void lz4_dec_end(lz4_dec_t *s)
+{
+    if(!s) return;
+    free(s->cbuf);
+    free(s->win);
+    free(s);
+}
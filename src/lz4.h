@@ -0,0 +1,100 @@
+/*
+ * usbimager/lz4.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief LZ4 frame format decoder
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_SKIPPABLE 0x184D2A50        /* skippable frames have any of the 16 magics from here */
+#define LZ4_HEADERMAX 19                /* magic, descriptor with content size and dictionary id, checksum */
+#define LZ4_BLOCKMAX (4*1024*1024)
+#define LZ4_WINDOW 65536                /* linked blocks may refer back this far */
+
+/* return values */
+enum {
+    LZ4_OK,                 /* everything is fine, go on */
+    LZ4_STREAM_END,         /* a frame (or a skippable frame) has ended */
+    LZ4_MEM_ERROR,
+    LZ4_OPTIONS_ERROR,      /* dictionaries and unknown versions aren't supported */
+    LZ4_DATA_ERROR          /* corrupt data or checksum mismatch */
+};
+
+/* input and output buffers, like in xz-embedded */
+typedef struct {
+    const uint8_t *in;
+    size_t in_pos;
+    size_t in_size;
+    uint8_t *out;
+    size_t out_pos;
+    size_t out_size;
+} lz4_buf_t;
+
+/* parsed frame header */
+typedef struct {
+    int hdrSize;            /* including the magic */
+    int blockMax;
+    char linked;            /* blocks may refer to the previous ones */
+    char blockSum;          /* blocks are followed by their checksum */
+    char contentSum;        /* the end mark is followed by the checksum of the content */
+    char hasSize;
+    uint64_t contentSize;
+} lz4_frame_t;
+
+typedef struct lz4_dec_s lz4_dec_t;
+
+/**
+ * Parse a frame header. Returns its size, 0 if len is too short, -1 if it's not valid
+ */
+int lz4_header(const uint8_t *buf, int len, lz4_frame_t *fh);
+
+/**
+ * Decode one block. With hist set, the block may refer to that many bytes before dst.
+ * Returns the decoded size, -1 on error
+ */
+int lz4_block(const uint8_t *src, int srcSize, uint8_t *dst, int dstCap, int hist);
+
+/**
+ * Allocate a streaming decoder
+ */
+lz4_dec_t *lz4_dec_init(void);
+
+/**
+ * Prepare for the next frame
+ */
+void lz4_dec_reset(lz4_dec_t *s);
+
+/**
+ * Decode as much as possible, stops at the end of each frame
+ */
+int lz4_dec_run(lz4_dec_t *s, lz4_buf_t *b);
+
+/**
+ * Free the decoder
+ */
+void lz4_dec_end(lz4_dec_t *s);
@@ -0,0 +1,404 @@
+/*
+ * usbimager/lz4par.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel lz4 decompression
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lang.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "lz4par.h"
+
+#define LZ4PAR_MAXJOBS 1024
+
+enum { LZ4PAR_FREE, LZ4PAR_READY, LZ4PAR_BUSY, LZ4PAR_DONE, LZ4PAR_FAIL };
+
+/* job flags */
+#define LZ4PAR_FIRST 1      /* first group of blocks in a frame */
+#define LZ4PAR_LAST 2       /* last group, the frame's content is checked after this */
+#define LZ4PAR_LINKED 4     /* a whole frame with linked blocks, decoded and checked on its own */
+
+/* a group of blocks, or a whole frame */
+typedef struct {
+    uint64_t in;        /* offset of the first block, or of the frame */
+    uint64_t csize;     /* compressed size */
+    int numblocks, blockMax, flags;
+    char blockSum, contentSum, hasSize;
+    uint32_t sum;       /* content checksum of the frame, on the last group */
+    uint64_t expect;    /* content size of the frame, if it's in the header */
+    char *data;
+    uint64_t size;
+    uint64_t pos;       /* how much of it has been output */
+    int state;
+} lz4par_job_t;
+
+typedef struct {
+    stream_t *ctx;
+    int fd;
+    uint64_t fs;
+    int quit, alive, scanned, error;
+    pthread_t thread[LZ4PAR_MAXTHREADS], scanner;
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    lz4par_job_t job[LZ4PAR_MAXJOBS];
+    uint64_t found, next, cur;  /* jobs found by the scanner, taken by the workers, and output */
+    uint64_t mem;               /* decoded bytes waiting in jobs */
+    uint64_t pos;               /* compressed offset of the job being output */
+    XXH32_state_t xs;           /* content checksum of the frame being output */
+    uint64_t total;
+} lz4par_t;
+
+static lz4par_t lz4par;
+
+/**
+ * Little endian 32 bit value
+ */
+static uint32_t lz4par_get32(unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/**
+ * Add a job, but don't get too far ahead of the output. Returns 0 if we're quitting
+ */
+static int lz4par_add(lz4par_t *g, lz4par_job_t *job)
+{
+    int ret;
+
+    pthread_mutex_lock(&g->mutex);
+    while(!g->quit && (g->found - g->cur >= LZ4PAR_MAXJOBS || job->in > g->pos + LZ4PAR_AHEAD))
+        pthread_cond_wait(&g->cond, &g->mutex);
+    if((ret = !g->quit)) {
+        memcpy(&g->job[g->found % LZ4PAR_MAXJOBS], job, sizeof(lz4par_job_t));
+        g->job[g->found % LZ4PAR_MAXJOBS].state = LZ4PAR_READY;
+        g->found++;
+        pthread_cond_broadcast(&g->cond);
+    }
+    pthread_mutex_unlock(&g->mutex);
+    return ret;
+}
+
+/**
+ * Scanner thread, walks the block headers and splits the frames into jobs
+ */
+static void *lz4par_scanner(void *data)
+{
+    lz4par_t *g = (lz4par_t*)data;
+    unsigned char hdr[LZ4_HEADERMAX];
+    lz4par_job_t j;
+    lz4_frame_t fh;
+    uint64_t pos = 0, p;
+    uint32_t v;
+    int n, go = 1, err = 0;
+
+    while(go && pos < g->fs) {
+        if((n = (int)pread(g->fd, hdr, sizeof(hdr), pos)) < 8) { err = 1; break; }
+        if((lz4par_get32(hdr) & 0xFFFFFFF0) == LZ4_SKIPPABLE) { pos += 8 + (uint64_t)lz4par_get32(hdr + 4); continue; }
+        if(lz4_header(hdr, n, &fh) < 1) { err = 1; break; }
+        memset(&j, 0, sizeof(lz4par_job_t));
+        j.blockMax = fh.blockMax;
+        j.blockSum = fh.blockSum;
+        j.contentSum = fh.contentSum;
+        j.hasSize = fh.hasSize;
+        j.expect = fh.contentSize;
+        j.flags = fh.linked ? LZ4PAR_LINKED : LZ4PAR_FIRST;
+        j.in = fh.linked ? pos : pos + fh.hdrSize;
+        for(p = pos + fh.hdrSize; !__atomic_load_n(&g->quit, __ATOMIC_RELAXED);) {
+            if(pread(g->fd, hdr, 4, p) != 4) { err = 1; break; }
+            v = lz4par_get32(hdr);
+            p += 4;
+            /* end mark */
+            if(!v) break;
+            if((v & 0x7FFFFFFF) > (uint32_t)fh.blockMax) { err = 1; break; }
+            p += (v & 0x7FFFFFFF) + (fh.blockSum ? 4 : 0);
+            if(!fh.linked && ++j.numblocks * (uint64_t)fh.blockMax >= LZ4PAR_JOB) {
+                j.csize = p - j.in;
+                if(!(go = lz4par_add(g, &j))) break;
+                j.flags = 0;
+                j.in = p;
+                j.numblocks = 0;
+            }
+        }
+        if(err || !go || __atomic_load_n(&g->quit, __ATOMIC_RELAXED)) break;
+        if(fh.contentSum) {
+            if(pread(g->fd, hdr, 4, p) != 4) { err = 1; break; }
+            j.sum = lz4par_get32(hdr);
+            p += 4;
+        }
+        j.flags |= LZ4PAR_LAST;
+        j.csize = p - j.in;
+        go = lz4par_add(g, &j);
+        pos = p;
+    }
+    pthread_mutex_lock(&g->mutex);
+    /* a block that goes beyond the end means a truncated file */
+    if(err || pos > g->fs) g->error = 1;
+    g->scanned = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    return NULL;
+}
+
+/**
+ * Decode a group of blocks, or a whole frame with linked blocks. Returns 1 on success
+ */
+static int lz4par_decode(lz4par_t *g, lz4par_job_t *j)
+{
+    unsigned char *buf, *p;
+    lz4_dec_t *s = NULL;
+    lz4_buf_t b;
+    uint64_t cap;
+    uint32_t v, len;
+    char *d;
+    int i, n, ret = LZ4_DATA_ERROR;
+
+    if(!(buf = (unsigned char*)malloc(j->csize)) || pread(g->fd, buf, j->csize, j->in) != (ssize_t)j->csize) goto err;
+    if(j->flags & LZ4PAR_LINKED) {
+        cap = j->hasSize ? j->expect + 1 : j->csize * 4 + j->blockMax;
+        if(!(s = lz4_dec_init()) || !(j->data = (char*)malloc(cap))) goto err;
+        memset(&b, 0, sizeof(b));
+        b.in = buf;
+        b.in_size = j->csize;
+        for(;;) {
+            b.out = (unsigned char*)j->data;
+            b.out_size = cap;
+            ret = lz4_dec_run(s, &b);
+            if(ret != LZ4_OK || __atomic_load_n(&g->quit, __ATOMIC_RELAXED)) break;
+            if(b.out_pos < b.out_size) { ret = LZ4_DATA_ERROR; break; }    /* input ended before the frame did */
+            cap *= 2;
+            if(!(d = (char*)realloc(j->data, cap))) { ret = LZ4_MEM_ERROR; break; }
+            j->data = d;
+        }
+        j->size = b.out_pos;
+        /* the frame must end exactly where the next one starts */
+        if(ret == LZ4_STREAM_END && b.in_pos == b.in_size) ret = LZ4_OK; else if(ret == LZ4_OK) ret = LZ4_DATA_ERROR;
+    } else {
+        /* the scanner has already checked the block sizes */
+        if(!(j->data = (char*)malloc((uint64_t)j->numblocks * j->blockMax + 1))) goto err;
+        for(p = buf, i = 0; i < j->numblocks && !__atomic_load_n(&g->quit, __ATOMIC_RELAXED); i++) {
+            v = lz4par_get32(p);
+            len = v & 0x7FFFFFFF;
+            p += 4;
+            if(j->blockSum && XXH32(p, len, 0) != lz4par_get32(p + len)) break;
+            if(v & 0x80000000) { memcpy(j->data + j->size, p, len); n = (int)len; }
+            else if((n = lz4_block(p, (int)len, (uint8_t*)j->data + j->size, j->blockMax, 0)) < 0) break;
+            j->size += n;
+            p += len + (j->blockSum ? 4 : 0);
+        }
+        ret = i == j->numblocks ? LZ4_OK : LZ4_DATA_ERROR;
+    }
+err:
+    lz4_dec_end(s);
+    free(buf);
+    if(verbose > 1) printf("lz4par_decode() offset %" PRIu64 " csize %" PRIu64 " blocks %d size %" PRIu64 " ret %d\r\n",
+        j->in, j->csize, j->numblocks, j->size, ret);
+    return ret == LZ4_OK;
+}
+
+/**
+ * Worker thread, decodes the jobs in order, but no more than what fits in memory
+ */
+static void *lz4par_worker(void *data)
+{
+    lz4par_t *g = (lz4par_t*)data;
+    lz4par_job_t *j;
+    int ok;
+
+    pthread_mutex_lock(&g->mutex);
+    while(!g->quit) {
+        if(g->next >= g->found || g->mem >= LZ4PAR_MAXMEM) {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+        j = &g->job[g->next++ % LZ4PAR_MAXJOBS];
+        j->state = LZ4PAR_BUSY;
+        pthread_mutex_unlock(&g->mutex);
+        ok = lz4par_decode(g, j);
+        pthread_mutex_lock(&g->mutex);
+        j->state = ok ? LZ4PAR_DONE : LZ4PAR_FAIL;
+        if(ok) g->mem += j->size;
+        pthread_cond_broadcast(&g->cond);
+    }
+    g->alive--;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    return NULL;
+}
+
+/**
+ * Wait for the job being output. Returns NULL at the end, must be called with the mutex held
+ */
+static lz4par_job_t *lz4par_wait(lz4par_t *g)
+{
+    lz4par_job_t *j = &g->job[g->cur % LZ4PAR_MAXJOBS];
+
+    while(g->alive && (g->cur < g->found ? j->state != LZ4PAR_DONE && j->state != LZ4PAR_FAIL : !g->scanned))
+        pthread_cond_wait(&g->cond, &g->mutex);
+    return g->cur < g->found && (j->state == LZ4PAR_DONE || j->state == LZ4PAR_FAIL) ? j : NULL;
+}
+
+/**
+ * Output the next job. Returns the number of bytes, 0 at the end, -1 on error
+ */
+static int lz4par_nextjob(lz4par_t *g, char *buf, int size)
+{
+    lz4par_job_t *j;
+    int n, sum;
+
+    for(;;) {
+        pthread_mutex_lock(&g->mutex);
+        if(!(j = lz4par_wait(g)) || j->state == LZ4PAR_FAIL) {
+            n = !j && g->scanned && !g->error && g->cur >= g->found ? 0 : -1;
+            pthread_mutex_unlock(&g->mutex);
+            return n;
+        }
+        pthread_mutex_unlock(&g->mutex);
+        /* the content checksum can't be split, so it's calculated here, in order. Linked frames are checked by the decoder */
+        sum = j->contentSum && !(j->flags & LZ4PAR_LINKED);
+        if(!j->pos && (j->flags & LZ4PAR_FIRST)) {
+            XXH32_reset(&g->xs, 0);
+            g->total = 0;
+        }
+        n = j->size - j->pos < (uint64_t)size ? (int)(j->size - j->pos) : size;
+        memcpy(buf, j->data + j->pos, n);
+        if(sum) XXH32_update(&g->xs, buf, n);
+        g->total += n;
+        j->pos += n;
+        if(j->pos >= j->size) {
+            if((j->flags & LZ4PAR_LAST) && ((sum && XXH32_digest(&g->xs) != j->sum) ||
+              (j->hasSize && !(j->flags & LZ4PAR_LINKED) && g->total != j->expect))) {
+                if(verbose) printf("lz4par_nextjob() content checksum or size mismatch\r\n");
+                return -1;
+            }
+            pthread_mutex_lock(&g->mutex);
+            g->mem -= j->size;
+            free(j->data);
+            j->data = NULL;
+            j->state = LZ4PAR_FREE;
+            g->cur++;
+            if(g->cur < g->found) g->pos = g->job[g->cur % LZ4PAR_MAXJOBS].in;
+            pthread_cond_broadcast(&g->cond);
+            pthread_mutex_unlock(&g->mutex);
+        }
+        if(n) return n;
+    }
+}
+
+/**
+ * Output hook for stream_read(), fills the buffer unless we're at the end
+ */
+static int lz4par_output(void *data, char *buf, int size)
+{
+    lz4par_t *g = (lz4par_t*)data;
+    int n, ret = 0;
+
+    while(ret < size) {
+        if((n = lz4par_nextjob(g, buf + ret, size - ret)) < 0) return -1;
+        if(!n) break;
+        ret += n;
+    }
+    if(ret < size) {
+        __atomic_store_n(&g->ctx->cmrdSize, g->fs, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, (uint64_t)-1);
+    } else {
+        __atomic_store_n(&g->ctx->cmrdSize, g->pos, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, g->pos);
+    }
+    return ret;
+}
+
+/**
+ * Start decompressing an lz4 source on all cores
+ */
+int lz4par_open(stream_t *ctx)
+{
+    lz4par_t *g = &lz4par;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char hdr[LZ4_HEADERMAX];
+    lz4_frame_t fh;
+    uint64_t pos = 0;
+    int i, len;
+
+    if(n < 2 || ctx->type != TYPE_LZ4) return 0;
+    if(n > LZ4PAR_MAXTHREADS) n = LZ4PAR_MAXTHREADS;
+    memset(g, 0, sizeof(lz4par_t));
+    g->ctx = ctx;
+    g->fd = fileno(ctx->f);
+    g->fs = ctx->compSize;
+    /* linked blocks can only be decoded one after another */
+    while((len = (int)pread(g->fd, hdr, sizeof(hdr), pos)) >= 8 && (lz4par_get32(hdr) & 0xFFFFFFF0) == LZ4_SKIPPABLE)
+        pos += 8 + (uint64_t)lz4par_get32(hdr + 4);
+    if(len < 8 || lz4_header(hdr, len, &fh) < 1 || fh.linked) return 0;
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    if(pthread_create(&g->scanner, NULL, lz4par_scanner, g)) {
+        pthread_cond_destroy(&g->cond);
+        pthread_mutex_destroy(&g->mutex);
+        return 0;
+    }
+    for(i = 0; i < n; i++)
+        if(!pthread_create(&g->thread[g->numthreads], NULL, lz4par_worker, g)) g->numthreads++;
+    g->alive = g->numthreads;
+    if(verbose) printf("lz4par_open() threads %d block size %d\r\n", g->numthreads, fh.blockMax);
+    ctx->output = lz4par_output;
+    ctx->outputData = g;
+    return 1;
+}
+
+/**
+ * Stop the threads and free everything
+ */
+void lz4par_close(stream_t *ctx)
+{
+    lz4par_t *g = &lz4par;
+    int i;
+
+    if(ctx->outputData != g) return;
+    pthread_mutex_lock(&g->mutex);
+    __atomic_store_n(&g->quit, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    pthread_join(g->scanner, NULL);
+    for(i = 0; i < g->numthreads; i++)
+        pthread_join(g->thread[i], NULL);
+    for(i = 0; i < LZ4PAR_MAXJOBS; i++)
+        free(g->job[i].data);
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->mutex);
+    ctx->output = NULL;
+    ctx->outputData = NULL;
+}
+
+#endif
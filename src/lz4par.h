@@ -0,0 +1,46 @@
+/*
+ * usbimager/lz4par.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel lz4 decompression
+ *
+ */
+
+#define LZ4PAR_JOB (8*1024*1024)        /* blocks are decoded in groups of at most this many bytes */
+#define LZ4PAR_AHEAD (64*1024*1024)     /* look for blocks at most this far ahead of the output */
+#define LZ4PAR_MAXMEM (256*1024*1024)   /* decoded data waiting to be output */
+#define LZ4PAR_MAXTHREADS 16
+
+/**
+ * Start decompressing an lz4 source on all cores. Frames with independent blocks are split into
+ * groups of blocks that are decoded concurrently, and the content checksum is calculated as the
+ * data is output. Sets the stream's output hook, returns 1 if it did, 0 if stream_read() should
+ * be used as usual (like when the first frame has linked blocks)
+ */
+int lz4par_open(stream_t *ctx);
+
+/**
+ * Stop the threads and free everything
+ */
+void lz4par_close(stream_t *ctx);
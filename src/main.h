@@ -36,13 +36,20 @@ enum {
     TYPE_DEFLATE,
     TYPE_BZIP2,
     TYPE_XZ,
-    TYPE_ZSTD
+    TYPE_ZSTD,
+    TYPE_LZ4,
+    TYPE_QCOW2
 };
 
 extern int verbose;
 extern int buffer_size;
 extern int baud;
 extern int force;
+extern int compare;
+extern int autotune;
+extern int queue_depth;
+extern int cache_window;
+extern int writeback_window;
 
 /**
  * Add an option to the combobox
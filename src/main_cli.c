@@ -0,0 +1,338 @@
+/*
+ * usbimager/main_cli.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Command line interface without a GUI, for scripts and headless hosts
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "lang.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "kcopy.h"
+#include "disks.h"
+
+char **lang = NULL;
+extern char *dict[NUMLANGS][NUMTEXTS + 1];
+
+static char targetList[DISKS_MAX][128];
+static int numTargetList = 0;
+
+static pipeline_target_t fanTargets[PIPELINE_MAXTARGETS];
+static char *fanDevices[PIPELINE_MAXTARGETS];
+static int numFan = 0;
+
+char *main_errorMessage = NULL;
+
+void main_addToCombobox(char *option)
+{
+    strncpy(targetList[numTargetList++], option, 128);
+}
+
+void main_getErrorMessage()
+{
+    main_errorMessage = errno ? strerror(errno) : NULL;
+}
+
+/**
+ * Print progress in a machine readable form: percentage, bytes done, total bytes
+ */
+void main_onProgress(void *data)
+{
+    stream_t *ctx = (stream_t*)data;
+    char status[128];
+    uint64_t written;
+    int i, progress;
+
+    if(!ctx || !stream_progressdue()) return;
+    progress = stream_status(ctx, status, 0);
+    /* when writing more devices at once, report each of them before the overall (slowest) one */
+    if(ctx->pipelined && numFan > 1)
+        for(i = 0; i < numFan; i++) {
+            written = __atomic_load_n(&fanTargets[i].written, __ATOMIC_RELAXED);
+            printf("target %s %d %" PRIu64 " %" PRIu64 "\n", fanDevices[i],
+                ctx->fileSize ? (int)(written * 100 / ctx->fileSize) : progress, written, ctx->fileSize);
+        }
+    printf("progress %d %" PRIu64 " %" PRIu64 "\n", progress, ctx->pipelined ? ctx->wrtnSize : ctx->readSize, ctx->fileSize);
+    fflush(stdout);
+}
+
+/**
+ * Print an error message and return an exit code
+ */
+static int onError(int msg)
+{
+    if(main_errorMessage && *main_errorMessage)
+        fprintf(stderr, "usbimager-cli: %s: %s\n", lang[msg], main_errorMessage);
+    else
+        fprintf(stderr, "usbimager-cli: %s\n", lang[msg]);
+    return 2;
+}
+
+/**
+ * Print an error message about one of the devices and return an exit code
+ */
+static int onDeviceError(char *dev, int msg)
+{
+    if(main_errorMessage && *main_errorMessage)
+        fprintf(stderr, "usbimager-cli: %s: %s: %s\n", dev, lang[msg], main_errorMessage);
+    else
+        fprintf(stderr, "usbimager-cli: %s: %s\n", dev, lang[msg]);
+    return 2;
+}
+
+/**
+ * Look up a device in the target list, returns targetId or -1
+ */
+static int findTarget(char *dev)
+{
+    int i, l;
+
+    if(!memcmp(dev, "/dev/", 5)) dev += 5;
+    l = strlen(dev);
+    for(i = 0; i < numTargetList; i++)
+        if(!memcmp(targetList[i], dev, l) && (!targetList[i][l] || targetList[i][l] == ' '))
+            return i;
+    return -1;
+}
+
+/**
+ * Read from input and write to disks. With more devices the image is decompressed only once,
+ * and a device that fails doesn't stop the others
+ */
+static int writerRoutine(char *source, int *targetIds, int needVerify)
+{
+    int i, dst, ret = 0;
+    static stream_t ctx;
+
+    dst = stream_open(&ctx, source, disks_targets[targetIds[0]] >= 1024);
+    if(!dst) {
+        for(i = 0; i < numFan; i++) {
+            dst = (int)((long int)disks_open(targetIds[i], ctx.fileSize));
+            if(dst > 0) {
+                fanTargets[i].fd = dst;
+            } else {
+                ret = onDeviceError(fanDevices[i], dst == -1 ? L_TRGERR : (dst == -2 ? L_UMOUNTERR : (dst == -4 ? L_COMMERR : L_OPENTRGERR)));
+                break;
+            }
+        }
+        if(!ret) {
+            if(numFan == 1) {
+                if((ret = pipeline_write(&ctx, fanTargets[0].fd, needVerify)))
+                    ret = onError(ret);
+            } else
+            if(pipeline_fanout(&ctx, fanTargets, numFan, needVerify)) {
+                for(i = 0; i < numFan; i++)
+                    if(fanTargets[i].error) ret = onDeviceError(fanDevices[i], fanTargets[i].error);
+            }
+        }
+        for(i = 0; i < numFan; i++)
+            if(fanTargets[i].fd > 0) disks_close((void*)((long int)fanTargets[i].fd));
+        stream_close(&ctx);
+    } else {
+        if(errno) main_errorMessage = strerror(errno);
+        ret = onError(dst == 2 ? L_ENCZIPERR : (dst == 3 ? L_CMPZIPERR : (dst == 4 ? L_CMPERR : L_SRCERR)));
+    }
+    if(!ret) printf("progress 100 %" PRIu64 " %" PRIu64 "\n", ctx.wrtnSize, ctx.fileSize);
+    return ret;
+}
+
+/**
+ * Read from disk and write to output file, compressed if its name ends in .bz2
+ */
+static int readerRoutine(int targetId, char *fn)
+{
+    int src, size, numberOfBytesRead, copied, ret = 0, l = strlen(fn);
+    static stream_t ctx;
+
+    if(disks_targets[targetId] >= 1024) return onError(L_TRGERR);
+    src = (int)((long int)disks_open(targetId, 0));
+    if(src > 0) {
+        if(!stream_create(&ctx, fn, l > 4 && !strcmp(fn + l - 4, ".bz2"), disks_capacity[targetId])) {
+            /* plain backups are copied by the kernel if it can */
+            if((copied = kcopy_read(&ctx, src)) < 0) {
+                if(errno) main_errorMessage = strerror(errno);
+                ret = onError(L_WRIMGERR);
+            }
+            while(!copied && ctx.readSize < ctx.fileSize) {
+                errno = 0;
+                size = ctx.fileSize - ctx.readSize < (uint64_t)buffer_size ? (int)(ctx.fileSize - ctx.readSize) : buffer_size;
+                numberOfBytesRead = (int)read(src, ctx.buffer, size);
+                if(verbose) printf("read(%d) numberOfBytesRead %d errno=%d\n", size, numberOfBytesRead, errno);
+                if(numberOfBytesRead == size) {
+                    if(stream_write(&ctx, ctx.buffer, size)) {
+                        main_onProgress(&ctx);
+                    } else {
+                        if(errno) main_errorMessage = strerror(errno);
+                        ret = onError(L_WRIMGERR);
+                        break;
+                    }
+                } else {
+                    if(errno) main_errorMessage = strerror(errno);
+                    ret = onError(L_RDSRCERR);
+                    break;
+                }
+            }
+            if(!ret) printf("progress 100 %" PRIu64 " %" PRIu64 "\n", ctx.readSize, ctx.fileSize);
+            stream_close(&ctx);
+        } else {
+            if(errno) main_errorMessage = strerror(errno);
+            ret = onError(L_OPENIMGERR);
+        }
+        disks_close((void*)((long int)src));
+    } else {
+        ret = onError(src == -1 ? L_TRGERR : (src == -2 ? L_UMOUNTERR : (src == -4 ? L_COMMERR : L_OPENTRGERR)));
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, targetId, targetIds[PIPELINE_MAXTARGETS], needVerify = 0;
+    char *lc = getenv("LANG"), *image = NULL, *device = NULL, cmd = 0;
+    char help[] = "USBImager " USBIMAGER_VERSION
+#ifdef USBIMAGER_BUILD
+        " (build " USBIMAGER_BUILD ")"
+#endif
+        " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
+        "./usbimager-cli [-v|-vv|-a|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-Q(n)|-R(n)|-W(n)|-t|-D|-z|-c|-L(xx)] [--verify]\r\n"
+        "    --write <image> <device> [device...] | --read <device> <image> | --list\r\n\r\n"
+        "https://gitlab.com/bztsrc/usbimager\r\n\r\n";
+
+    for(j = 1; j < argc && argv[j]; j++) {
+        if(argv[j][0] == '-' && argv[j][1] == '-') {
+            if(!strcmp(argv[j], "--version")) {
+                printf(USBIMAGER_VERSION "\n");
+                exit(0);
+            }
+            if(!strcmp(argv[j], "--verify")) { needVerify = 1; continue; }
+            if(!strcmp(argv[j], "--list")) { cmd = 'l'; continue; }
+            if(!strcmp(argv[j], "--write") && j + 2 < argc) {
+                cmd = 'w'; image = argv[++j];
+                while(j + 1 < argc && argv[j + 1][0] != '-' && numFan < PIPELINE_MAXTARGETS)
+                    fanDevices[numFan++] = argv[++j];
+                if(numFan) { device = fanDevices[0]; continue; }
+            }
+            if(!strcmp(argv[j], "--read") && j + 2 < argc) { cmd = 'r'; device = argv[++j]; image = argv[++j]; continue; }
+            printf("%s", help);
+            exit(!strcmp(argv[j], "--help") ? 0 : 1);
+        } else
+        if(argv[j][0] == '-') {
+            for(i = 1; argv[j][i]; i++)
+                switch(argv[j][i]) {
+                    case 'v': verbose++; break;
+                    case 's':
+                        disks_serial = 1;
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            stream_baud(atoi(argv[j] + i + 1));
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'S':
+                        disks_serial = 2;
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            stream_baud(atoi(argv[j] + i + 1));
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'a': disks_all = 1; break;
+                    case 'D': disks_direct = 1; break;
+                    case 'z': disks_zero = 1; break;
+                    case 'c': compare = 1; break;
+                    case 't': autotune = 1; break;
+                    case 'Q':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            queue_depth = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'R':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            cache_window = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'W':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            writeback_window = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case '1': buffer_size = 2*1024*1024; break;
+                    case '2': buffer_size = 4*1024*1024; break;
+                    case '3': buffer_size = 8*1024*1024; break;
+                    case '4': buffer_size = 16*1024*1024; break;
+                    case '5': buffer_size = 32*1024*1024; break;
+                    case '6': buffer_size = 64*1024*1024; break;
+                    case '7': buffer_size = 128*1024*1024; break;
+                    case '8': buffer_size = 256*1024*1024; break;
+                    case '9': buffer_size = 512*1024*1024; break;
+                    case 'L': lc = &argv[j][++i]; ++i; break;
+                }
+        } else {
+            printf("%s", help);
+            exit(1);
+        }
+    }
+    if(!cmd) {
+        printf("%s", help);
+        exit(1);
+    }
+
+    if(!lc) lc = "en";
+    for(i = 0; i < NUMLANGS; i++) {
+        if(!memcmp(lc, dict[i][0], strlen(dict[i][0]))) {
+            lang = &dict[i][1];
+            break;
+        }
+    }
+    if(!lang) lang = &dict[0][1];
+
+    if(verbose)
+        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, queue_depth %d\r\n",
+            lc, lang[-1], disks_serial, buffer_size/1024/1024, queue_depth);
+
+    /* only the devices the GUI would offer are accepted as targets */
+    disks_refreshlist();
+    if(cmd == 'l') {
+        for(i = 0; i < numTargetList; i++)
+            printf("%s\n", targetList[i]);
+        return 0;
+    }
+    if(cmd == 'w') {
+        for(i = 0; i < numFan; i++) {
+            /* serial ports can only be written on their own, and each device only once */
+            if((targetIds[i] = findTarget(fanDevices[i])) == -1 || (numFan > 1 && disks_targets[targetIds[i]] >= 1024))
+                return onDeviceError(fanDevices[i], L_TRGERR);
+            for(j = 0; j < i; j++)
+                if(targetIds[j] == targetIds[i]) return onDeviceError(fanDevices[i], L_TRGERR);
+        }
+        return writerRoutine(image, targetIds, needVerify);
+    }
+    if((targetId = findTarget(device)) == -1) return onError(L_TRGERR);
+    return readerRoutine(targetId, image);
+}
@@ -32,6 +32,8 @@
 #include <sys/stat.h>
 #include "lang.h"
 #include "stream.h"
+#include "pipeline.h"
+#include "kcopy.h"
 #include "disks.h"
 #include "libui/ui.h"
 
@@ -95,9 +97,42 @@ static void onProgress(void *data)
     uiLabelSetText(status, !data ? lang[L_WAITING] : textstat);
 }
 
+/**
+ * Progress channel, the worker only publishes the context, and the UI samples it with a timer
+ */
+static stream_t *progressCtx = NULL;
+static int progressTimer = 0;
+
+static int onProgressTick(void *data)
+{
+    stream_t *ctx = __atomic_load_n(&progressCtx, __ATOMIC_ACQUIRE);
+    (void)data;
+    if(ctx) onProgress(ctx);
+    else progressTimer = 0;
+    return progressTimer;
+}
+
+static void onProgressStart(void *data)
+{
+    (void)data;
+    if(!progressTimer) {
+        progressTimer = 1;
+        uiTimer(STREAM_PROGRESSMS, onProgressTick, NULL);
+    }
+}
+
+static void onProgressStop(void)
+{
+    __atomic_store_n(&progressCtx, NULL, __ATOMIC_RELEASE);
+}
+
 void main_onProgress(void *data)
 {
-    uiQueueMain(onProgress, data);
+    if(!data)
+        uiQueueMain(onProgress, NULL);
+    else
+    if(!__atomic_exchange_n(&progressCtx, (stream_t*)data, __ATOMIC_ACQ_REL))
+        uiQueueMain(onProgressStart, NULL);
 }
 
 static void onThreadError(void *data)
@@ -117,8 +152,7 @@ static void onSourceSet(void *data)
  */
 static void *writerRoutine(void *data)
 {
-    int dst, needVerify = uiCheckboxChecked(verify), numberOfBytesRead;
-    int numberOfBytesWritten, numberOfBytesVerify, targetId = uiComboboxSelected(target);
+    int dst, ret, needVerify = uiCheckboxChecked(verify), targetId = uiComboboxSelected(target);
     static char lpStatus[128];
     static stream_t ctx;
     (void)data;
@@ -128,39 +162,8 @@ static void *writerRoutine(void *data)
     if(!dst) {
         dst = (int)((long int)disks_open(targetId, ctx.fileSize));
         if(dst > 0) {
-            while(1) {
-                if((numberOfBytesRead = stream_read(&ctx)) >= 0) {
-                    if(numberOfBytesRead == 0) {
-                        if(!ctx.fileSize) ctx.fileSize = ctx.readSize;
-                        break;
-                    } else {
-                        errno = 0;
-                        numberOfBytesWritten = (int)write(dst, ctx.buffer, numberOfBytesRead);
-                        if(verbose) printf("write(%d) numberOfBytesWritten %d errno=%d\n",
-                            numberOfBytesRead, numberOfBytesWritten, errno);
-                        if(numberOfBytesWritten == numberOfBytesRead) {
-                            if(needVerify) {
-                                lseek(dst, -((off_t)numberOfBytesWritten), SEEK_CUR);
-                                numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesWritten);
-                                if(verbose) printf("  numberOfBytesVerify %d\n", numberOfBytesVerify);
-                                if(numberOfBytesVerify != numberOfBytesWritten ||
-                                    memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
-                                        uiQueueMain(onThreadError, lang[L_VRFYERR]);
-                                    break;
-                                }
-                            }
-                            uiQueueMain(onProgress, &ctx);
-                        } else {
-                            if(errno) main_errorMessage = strerror(errno);
-                            uiQueueMain(onThreadError, lang[L_WRTRGERR]);
-                            break;
-                        }
-                    }
-                } else {
-                    uiQueueMain(onThreadError, lang[L_RDSRCERR]);
-                    break;
-                }
-            }
+            if((ret = pipeline_write(&ctx, dst, needVerify)))
+                uiQueueMain(onThreadError, lang[ret]);
             disks_close((void*)((long int)dst));
         } else {
             uiQueueMain(onThreadError, lang[dst == -1 ? L_TRGERR : (dst == -2 ? L_UMOUNTERR : (dst == -4 ? L_COMMERR : L_OPENTRGERR))]);
@@ -170,6 +173,7 @@ static void *writerRoutine(void *data)
         if(errno) main_errorMessage = strerror(errno);
         uiQueueMain(onThreadError, lang[dst == 2 ? L_ENCZIPERR : (dst == 3 ? L_CMPZIPERR : (dst == 4 ? L_CMPERR : L_SRCERR))]);
     }
+    onProgressStop();
     stream_status(&ctx, lpStatus, 1);
     uiQueueMain(onDone, &lpStatus);
     if(verbose) printf("Worker thread finished.\r\n");
@@ -201,7 +205,7 @@ static void onWriteButtonClicked(uiButton *b, void *data)
  */
 static void *readerRoutine(void *data)
 {
-    int src, size, needCompress = uiCheckboxChecked(compr), numberOfBytesRead;
+    int src, size, needCompress = uiCheckboxChecked(compr), numberOfBytesRead, copied;
     static char lpStatus[128];
     static stream_t ctx;
     char *env, fn[PATH_MAX];
@@ -240,14 +244,19 @@ static void *readerRoutine(void *data)
         uiQueueMain(onSourceSet, fn);
 
         if(!stream_create(&ctx, fn, needCompress, disks_capacity[targetId])) {
-            while(ctx.readSize < ctx.fileSize) {
+            /* plain backups are copied by the kernel if it can */
+            if((copied = kcopy_read(&ctx, src)) < 0) {
+                if(errno) main_errorMessage = strerror(errno);
+                uiQueueMain(onThreadError, lang[L_WRIMGERR]);
+            }
+            while(!copied && ctx.readSize < ctx.fileSize) {
                 errno = 0;
                 size = ctx.fileSize - ctx.readSize < (uint64_t)buffer_size ? (int)(ctx.fileSize - ctx.readSize) : buffer_size;
                 numberOfBytesRead = (int)read(src, ctx.buffer, size);
                 if(verbose) printf("read(%d) numberOfBytesRead %d errno=%d\n", size, numberOfBytesRead, errno);
                 if(numberOfBytesRead == size) {
                     if(stream_write(&ctx, ctx.buffer, size)) {
-                        uiQueueMain(onProgress, &ctx);
+                        main_onProgress(&ctx);
                     } else {
                         if(errno) main_errorMessage = strerror(errno);
                         uiQueueMain(onThreadError, lang[L_WRIMGERR]);
@@ -267,6 +276,7 @@ static void *readerRoutine(void *data)
     } else {
         uiQueueMain(onThreadError, lang[src == -1 ? L_TRGERR : (src == -2 ? L_UMOUNTERR : (src == -4 ? L_COMMERR : L_OPENTRGERR))]);
     }
+    onProgressStop();
     stream_status(&ctx, lpStatus, 1);
     uiQueueMain(onDone, &lpStatus);
     if(verbose) printf("Worker thread finished.\r\n");
@@ -369,7 +379,7 @@ int main(int argc, char **argv)
         " (build " USBIMAGER_BUILD ")"
 #endif
         " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
-        "./usbimager [-v|-vv|-a|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)] <backup path>\r\n\r\n"
+        "./usbimager [-v|-vv|-a|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-Q(n)|-R(n)|-W(n)|-t|-D|-z|-c|-L(xx)] <backup path>\r\n\r\n"
         "https://gitlab.com/bztsrc/usbimager\r\n\r\n";
 
     for(j = 1; j < argc && argv[j]; j++) {
@@ -403,6 +413,28 @@ int main(int argc, char **argv)
                         }
                         break;
                     case 'a': disks_all = 1; break;
+                    case 'D': disks_direct = 1; break;
+                    case 'z': disks_zero = 1; break;
+                    case 'c': compare = 1; break;
+                    case 't': autotune = 1; break;
+                    case 'Q':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            queue_depth = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'R':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            cache_window = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'W':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            writeback_window = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
                     case '1': blksizesel = 1; buffer_size = 2*1024*1024; break;
                     case '2': blksizesel = 2; buffer_size = 4*1024*1024; break;
                     case '3': blksizesel = 3; buffer_size = 8*1024*1024; break;
@@ -431,8 +463,8 @@ int main(int argc, char **argv)
     if(!lang) lang = &dict[0][1];
 
     if(verbose) {
-        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB\r\n",
-            lc, lang[-1], disks_serial, buffer_size/1024/1024);
+        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, queue_depth %d\r\n",
+            lc, lang[-1], disks_serial, buffer_size/1024/1024, queue_depth);
         if(disks_serial) printf("Serial %d,8,n,1\r\n", baud);
         if(bkpdir) printf("bkpdir '%s'\r\n", bkpdir);
     }
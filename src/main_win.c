@@ -124,6 +124,24 @@ static void onDone(HWND hwndDlg)
     }
 }
 
+/**
+ * Read back size bytes from the target in small chunks, and compare their hash
+ */
+static int verifyRead(HANDLE hTargetDevice, char *vbuf, DWORD size, uint64_t hash)
+{
+    XXH64_state_t state;
+    DWORD n, pos, numberOfBytesVerify;
+
+    XXH64_reset(&state, 0);
+    for (pos = 0; pos < size; pos += n) {
+        n = size - pos > STREAM_VRFSIZE ? STREAM_VRFSIZE : size - pos;
+        if (!ReadFile(hTargetDevice, vbuf, n, &numberOfBytesVerify, NULL) || numberOfBytesVerify != n)
+            return 0;
+        XXH64_update(&state, vbuf, n);
+    }
+    return XXH64_digest(&state) == hash;
+}
+
 /**
  * Function that reads from input and writes to disk
  */
@@ -138,10 +156,16 @@ static DWORD WINAPI writerRoutine(LPVOID lpParam)
     static wchar_t lpStatus[128];
     static stream_t ctx;
     int ret = 1, needWrite;
+    uint64_t hash;
+    char *vbuf = NULL;
 
     ctx.fileSize = 0;
     GetDlgItemTextW(hwndDlg, IDC_MAINDLG_SOURCE, szFilePathName, sizeof(szFilePathName) / sizeof(szFilePathName[0]));
     ret = stream_open(&ctx, szFilePathName, index >= 0 && index < DISKS_MAX &&disks_targets[index] >= 1024);
+    if (!ret && !(vbuf = (char*)stream_malloc(STREAM_VRFSIZE))) {
+        stream_close(&ctx);
+        ret = 1;
+    }
 
     if (!ret) {
 #if !defined(USE_WRONLY) || !USE_WRONLY
@@ -161,16 +185,18 @@ static DWORD WINAPI writerRoutine(LPVOID lpParam)
                 if((numberOfBytesRead = stream_read(&ctx)) >= 0) {
                     if(numberOfBytesRead == 0) {
                         if(!ctx.fileSize) ctx.fileSize = ctx.readSize;
+                        if(!stream_crcok(&ctx)) MainDlgMsgBox(hwndDlg, lang[L_RDSRCERR]);
                         break;
                     } else {
-                        DWORD numberOfBytesWritten = 0, numberOfBytesVerify = 0;
+                        DWORD numberOfBytesWritten = 0;
+                        stream_crc(&ctx, ctx.buffer, numberOfBytesRead);
                         errno = 0; needWrite = 1;
+                        hash = !force || needVerify ? XXH64(ctx.buffer, numberOfBytesRead, 0) : 0;
                         if (!force) {
-                            if (ReadFile(hTargetDevice, ctx.verifyBuf, numberOfBytesRead, &numberOfBytesVerify, NULL) &&
-                                numberOfBytesRead == (int)numberOfBytesVerify && !memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesRead)) {
+                            if (verifyRead(hTargetDevice, vbuf, numberOfBytesRead, hash)) {
                                 if (verbose > 1) printf("  numberOfBytesVerify %d matches disk, skipping write\n", numberOfBytesRead);
                                 needWrite = 0;
-                                totalNumberOfBytesWritten.QuadPart += numberOfBytesVerify;
+                                totalNumberOfBytesWritten.QuadPart += numberOfBytesRead;
                                 pos = (DWORD)stream_status(&ctx, (char *)&lpStatus, 0);
                                 /* time throttle spam to 100ms */
                                 if ((GetTickCount64() - t1) > 100) {
@@ -188,12 +214,11 @@ static DWORD WINAPI writerRoutine(LPVOID lpParam)
                                 if (verbose > 1) printf("WriteFile(%d) numberOfBytesWritten %lu\r\n", numberOfBytesRead, numberOfBytesWritten);
                                 if (needVerify) {
                                     SetFilePointerEx(hTargetDevice, totalNumberOfBytesWritten, NULL, FILE_BEGIN);
-                                    if (!ReadFile(hTargetDevice, ctx.verifyBuf, numberOfBytesWritten, &numberOfBytesVerify, NULL) ||
-                                        numberOfBytesWritten != numberOfBytesVerify || memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
+                                    if (numberOfBytesWritten != (DWORD)numberOfBytesRead || !verifyRead(hTargetDevice, vbuf, numberOfBytesWritten, hash)) {
                                         MessageBoxW(hwndDlg, lang[L_VRFYERR], lang[L_ERROR], MB_ICONERROR);
                                         break;
                                     }
-                                    if (verbose > 1) printf("  numberOfBytesVerify %lu\n", numberOfBytesVerify);
+                                    if (verbose > 1) printf("  numberOfBytesVerify %lu\n", numberOfBytesWritten);
                                 }
                                 totalNumberOfBytesWritten.QuadPart += numberOfBytesWritten;
 
@@ -229,6 +254,7 @@ static DWORD WINAPI writerRoutine(LPVOID lpParam)
                 L_OPENTRGERR)))]);
         }
         stream_close(&ctx);
+        stream_free(vbuf);
     } else {
         main_getErrorMessage();
         MainDlgMsgBox(hwndDlg, lang[ret == 2 ? L_ENCZIPERR :
@@ -37,9 +37,13 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
 #include <sys/stat.h>
 #include "lang.h"
 #include "stream.h"
+#include "pipeline.h"
+#include "kcopy.h"
 #include "disks.h"
 #include "misc/icons.xbm"       /* get icons for the Open File dialog */
 #include "misc/wm_icon.h"       /* window manager icon */
@@ -90,6 +94,7 @@ static char blksizeList[10][128];
 static int fonth = 0, fonta = 0, inactive = 0, pressedBtn = 0, half;
 static int needVerify = 1, needCompress = 0, progress = 0, numTargetList = 0, targetId = -1;
 static int mainsel = -1, sorting = 0, shift = 0, blksizesel = 0;
+static char lpStatus[128], *workerError = NULL;
 
 char *main_errorMessage = NULL;
 
@@ -572,38 +577,45 @@ static void onQuit()
     XCloseDisplay(dpy);
 }
 
+/**
+ * Progress channel, the worker only publishes the context, and the main loop samples it with a timeout
+ */
+static stream_t *progressCtx = NULL;
+static int progressWait = 0, sourceChanged = 0, workerDone = 0;
+
 void main_onProgress(void *data)
 {
-    stream_t *ctx = (stream_t*)data;
+    __atomic_store_n(&progressWait, !data, __ATOMIC_RELAXED);
+    __atomic_store_n(&progressCtx, (stream_t*)data, __ATOMIC_RELEASE);
+}
+
+static void mainProgressTick()
+{
+    stream_t *ctx = __atomic_load_n(&progressCtx, __ATOMIC_ACQUIRE);
     XWindowAttributes  wa;
-    XEvent e;
 
-    if(!ctx) {
+    if(__atomic_exchange_n(&sourceChanged, 0, __ATOMIC_ACQUIRE)) mainRedraw();
+    if(ctx)
+        progress = stream_status(ctx, status, 0);
+    else if(__atomic_load_n(&progressWait, __ATOMIC_RELAXED)) {
         progress = 0;
         strcpy(status, lang[L_WAITING]);
     } else
-        progress = stream_status(ctx, status, 0);
-
-    if(XPending(dpy)) {
-        XNextEvent(dpy, &e);
-        if(e.type == ClientMessage && (Atom)(e.xclient.data.l[0]) == delAtom) {
-            if(ctx && ctx->b) stream_close(ctx);
-            onQuit();
-            exit(1);
-        }
-        if(e.type == Expose && !e.xexpose.count) {
-            mainRedraw();
-            XFlush(dpy);
-            return;
-        }
-    }
+        return;
     XGetWindowAttributes(dpy, mainwin, &wa);
     half = wa.width/2;
     mainProgress(mainwin, 10, 70+4*fonth, wa.width - 20, progress);
     XSetForeground(dpy, gc, colors[color_winbg].pixel);
     XFillRectangle(dpy, mainwin, gc, 10, 80+4*fonth, wa.width - 20, fonth);
     mainPrint(mainwin, statgc, 10, 80+4*fonth, wa.width - 20, 0, status);
-    XFlush(dpy);
+}
+
+/**
+ * Errors are reported by the main thread once the worker has finished, only the first one counts
+ */
+static void onWorkerError(char *msg)
+{
+    if(!workerError) workerError = msg;
 }
 
 static void onThreadError(void *data)
@@ -682,8 +694,7 @@ static void onThreadError(void *data)
  */
 static void *writerRoutine()
 {
-    int dst, numberOfBytesRead;
-    int numberOfBytesWritten, numberOfBytesVerify;
+    int dst, ret;
     static stream_t ctx;
 
     ctx.readSize = 0;
@@ -691,77 +702,29 @@ static void *writerRoutine()
     if(!dst) {
         dst = (int)((long int)disks_open(targetId, ctx.fileSize));
         if(dst > 0) {
-            while(1) {
-                if((numberOfBytesRead = stream_read(&ctx)) >= 0) {
-                    if(numberOfBytesRead == 0) {
-                        if(!ctx.fileSize) ctx.fileSize = ctx.readSize;
-                        break;
-                    } else {
-                        errno = 0;
-                        numberOfBytesWritten = (int)write(dst, ctx.buffer, numberOfBytesRead);
-                        if(verbose) printf("write(%d) numberOfBytesWritten %d errno=%d\n",
-                            numberOfBytesRead, numberOfBytesWritten, errno);
-                        if(numberOfBytesWritten == numberOfBytesRead) {
-                            if(needVerify) {
-                                lseek(dst, -((off_t)numberOfBytesWritten), SEEK_CUR);
-                                numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesWritten);
-                                if(verbose) printf("  numberOfBytesVerify %d\n", numberOfBytesVerify);
-                                if(numberOfBytesVerify != numberOfBytesWritten ||
-                                    memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
-                                    onThreadError(lang[L_VRFYERR]);
-                                    break;
-                                }
-                            }
-                            main_onProgress(&ctx);
-                        } else {
-                            if(errno) main_errorMessage = strerror(errno);
-                            onThreadError(lang[L_WRTRGERR]);
-                            break;
-                        }
-                    }
-                } else {
-                    onThreadError(lang[L_RDSRCERR]);
-                    break;
-                }
-            }
+            if((ret = pipeline_write(&ctx, dst, needVerify)))
+                onWorkerError(lang[ret]);
             disks_close((void*)((long int)dst));
         } else {
-            onThreadError(lang[dst == -1 ? L_TRGERR : (dst == -2 ? L_UMOUNTERR : (dst == -4 ? L_COMMERR : L_OPENTRGERR))]);
+            onWorkerError(lang[dst == -1 ? L_TRGERR : (dst == -2 ? L_UMOUNTERR : (dst == -4 ? L_COMMERR : L_OPENTRGERR))]);
         }
         stream_close(&ctx);
     } else {
         if(errno) main_errorMessage = strerror(errno);
-        onThreadError(lang[dst == 2 ? L_ENCZIPERR : (dst == 3 ? L_CMPZIPERR : (dst == 4 ? L_CMPERR : L_SRCERR))]);
+        onWorkerError(lang[dst == 2 ? L_ENCZIPERR : (dst == 3 ? L_CMPZIPERR : (dst == 4 ? L_CMPERR : L_SRCERR))]);
     }
-    stream_status(&ctx, status, 1);
+    __atomic_store_n(&progressCtx, NULL, __ATOMIC_RELEASE);
+    stream_status(&ctx, lpStatus, 1);
     if(verbose) printf("Worker thread finished.\r\n");
     return NULL;
 }
 
-static void onWriteButtonClicked()
-{
-    inactive = 1;
-    progress = 0;
-    mainsel = -1;
-    XDefineCursor(dpy, mainwin, loading);
-    mainRedraw();
-    XFlush(dpy);
-    if(verbose) printf("Starting worker thread for writing.\r\n");
-    writerRoutine();
-    inactive = progress = 0;
-    XDefineCursor(dpy, mainwin, pointer);
-    mainRedraw();
-    main_errorMessage = NULL;
-    memset(status, 0, sizeof(status));
-    XSync(dpy, True);
-}
-
 /**
  * Function that reads from disk and writes to output file
  */
 static void *readerRoutine()
 {
-    int src, size, numberOfBytesRead;
+    int src, size, numberOfBytesRead, copied;
     static stream_t ctx;
     char *env, fn[PATH_MAX];
     struct stat st;
@@ -796,9 +759,14 @@ static void *readerRoutine()
             lt->tm_year+1900, lt->tm_mon+1, lt->tm_mday, lt->tm_hour, lt->tm_min,
             needCompress ? ".bz2" : "");
         strcpy(source, fn);
-        mainRedraw();
+        __atomic_store_n(&sourceChanged, 1, __ATOMIC_RELEASE);
         if(!stream_create(&ctx, fn, needCompress, disks_capacity[targetId])) {
-            while(ctx.readSize < ctx.fileSize) {
+            /* plain backups are copied by the kernel if it can */
+            if((copied = kcopy_read(&ctx, src)) < 0) {
+                if(errno) main_errorMessage = strerror(errno);
+                onWorkerError(lang[L_WRIMGERR]);
+            }
+            while(!copied && ctx.readSize < ctx.fileSize) {
                 errno = 0;
                 size = ctx.fileSize - ctx.readSize < (uint64_t)buffer_size ? (int)(ctx.fileSize - ctx.readSize) : buffer_size;
                 numberOfBytesRead = (int)read(src, ctx.buffer, size);
@@ -808,29 +776,102 @@ static void *readerRoutine()
                         main_onProgress(&ctx);
                     } else {
                         if(errno) main_errorMessage = strerror(errno);
-                        onThreadError(lang[L_WRIMGERR]);
+                        onWorkerError(lang[L_WRIMGERR]);
                         break;
                     }
                 } else {
                     if(errno) main_errorMessage = strerror(errno);
-                    onThreadError(lang[L_RDSRCERR]);
+                    onWorkerError(lang[L_RDSRCERR]);
                     break;
                 }
             }
             stream_close(&ctx);
         } else {
             if(errno) main_errorMessage = strerror(errno);
-            onThreadError(lang[L_OPENIMGERR]);
+            onWorkerError(lang[L_OPENIMGERR]);
         }
         disks_close((void*)((long int)src));
     } else {
-        onThreadError(lang[src == -1 ? L_TRGERR : (src == -2 ? L_UMOUNTERR : (src == -4 ? L_COMMERR : L_OPENTRGERR))]);
+        onWorkerError(lang[src == -1 ? L_TRGERR : (src == -2 ? L_UMOUNTERR : (src == -4 ? L_COMMERR : L_OPENTRGERR))]);
     }
-    stream_status(&ctx, status, 1);
+    __atomic_store_n(&progressCtx, NULL, __ATOMIC_RELEASE);
+    stream_status(&ctx, lpStatus, 1);
     if(verbose) printf("Worker thread finished.\r\n");
     return NULL;
 }
 
+static void *workerRoutine(void *data)
+{
+    if(data) writerRoutine(); else readerRoutine();
+    __atomic_store_n(&workerDone, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Run the worker on its own thread, and keep the window responsive meanwhile. The worker doesn't
+ * make X calls, this loop waits on the X connection with a timeout and samples its progress
+ */
+static void mainWork(int writing)
+{
+    XEvent e;
+    fd_set fds;
+    struct timeval tv;
+    pthread_t thrd;
+    int x = ConnectionNumber(dpy);
+
+    workerError = NULL;
+    memset(lpStatus, 0, sizeof(lpStatus));
+    __atomic_store_n(&progressCtx, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&progressWait, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&workerDone, 0, __ATOMIC_RELAXED);
+    if(pthread_create(&thrd, NULL, workerRoutine, writing ? (void*)1 : NULL)) {
+        /* without a thread, there's no progress, but the job still gets done */
+        if(verbose) printf("pthread_create failed errno=%d, running on the main thread.\r\n", errno);
+        workerRoutine(writing ? (void*)1 : NULL);
+    } else {
+        while(!__atomic_load_n(&workerDone, __ATOMIC_ACQUIRE)) {
+            if(!XPending(dpy)) {
+                FD_ZERO(&fds);
+                FD_SET(x, &fds);
+                tv.tv_sec = 0; tv.tv_usec = STREAM_PROGRESSMS * 1000;
+                select(x + 1, &fds, NULL, NULL, &tv);
+            }
+            while(XPending(dpy)) {
+                XNextEvent(dpy, &e);
+                if(e.type == ClientMessage && (Atom)(e.xclient.data.l[0]) == delAtom) {
+                    pthread_cancel(thrd);
+                    onQuit();
+                    exit(1);
+                }
+                if(e.type == Expose && !e.xexpose.count) mainRedraw();
+            }
+            if(stream_progressdue()) mainProgressTick();
+            XFlush(dpy);
+        }
+        pthread_join(thrd, NULL);
+    }
+    if(workerError) onThreadError(workerError);
+    memcpy(status, lpStatus, sizeof(status));
+}
+
+static void onWriteButtonClicked()
+{
+    inactive = 1;
+    progress = 0;
+    mainsel = -1;
+    XDefineCursor(dpy, mainwin, loading);
+    mainRedraw();
+    XFlush(dpy);
+    if(verbose) printf("Starting worker thread for writing.\r\n");
+    mainWork(1);
+    inactive = progress = 0;
+    XDefineCursor(dpy, mainwin, pointer);
+    mainRedraw();
+    main_errorMessage = NULL;
+    memset(status, 0, sizeof(status));
+    XSync(dpy, True);
+}
+
 static void onReadButtonClicked()
 {
     inactive = 1;
@@ -840,7 +881,7 @@ static void onReadButtonClicked()
     mainRedraw();
     XFlush(dpy);
     if(verbose) printf("Starting worker thread for reading.\r\n");
-    readerRoutine();
+    mainWork(0);
     inactive = progress = 0;
     XDefineCursor(dpy, mainwin, pointer);
     mainRedraw();
@@ -1419,7 +1460,7 @@ int main(int argc, char **argv)
         " (build " USBIMAGER_BUILD ")"
 #endif
         " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
-        "./usbimager [-v|-vv|-a|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)] <backup path>\r\n\r\n"
+        "./usbimager [-v|-vv|-a|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-Q(n)|-R(n)|-W(n)|-t|-D|-z|-c|-L(xx)] <backup path>\r\n\r\n"
         "https://gitlab.com/bztsrc/usbimager\r\n\r\n";
 
     for(j = 1; j < argc && argv[j]; j++) {
@@ -1453,6 +1494,28 @@ int main(int argc, char **argv)
                         }
                         break;
                     case 'a': disks_all = 1; break;
+                    case 'D': disks_direct = 1; break;
+                    case 'z': disks_zero = 1; break;
+                    case 'c': compare = 1; break;
+                    case 't': autotune = 1; break;
+                    case 'Q':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            queue_depth = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'R':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            cache_window = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
+                    case 'W':
+                        if(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') {
+                            writeback_window = atoi(argv[j] + i + 1);
+                            while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        }
+                        break;
                     case '1': blksizesel = 1; buffer_size = 2*1024*1024; break;
                     case '2': blksizesel = 2; buffer_size = 4*1024*1024; break;
                     case '3': blksizesel = 3; buffer_size = 8*1024*1024; break;
@@ -1478,8 +1541,8 @@ int main(int argc, char **argv)
     if(!lang) lang = &dict[0][1];
 
     if(verbose) {
-        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB\r\n",
-            lc, lang[-1], disks_serial, buffer_size/1024/1024);
+        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, queue_depth %d\r\n",
+            lc, lang[-1], disks_serial, buffer_size/1024/1024, queue_depth);
         if(disks_serial) printf("Serial %d,8,n,1\r\n", baud);
         if(bkpdir) printf("bkpdir '%s'\r\n", bkpdir);
     }
@@ -0,0 +1,989 @@
+/*
+ * usbimager/pipeline.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Threaded read / decompress / write pipeline
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#endif
+#include "lang.h"
+#include "stream.h"
+#include "disks.h"
+#include "ioqueue.h"
+#include "tune.h"
+#include "pipeline.h"
+#include "kcopy.h"
+#include "gzpar.h"
+#include "bzpar.h"
+#include "xzpar.h"
+#include "zstdpar.h"
+#include "lz4par.h"
+#include "qcow2par.h"
+
+extern char *main_errorMessage;
+
+/* one slot in a ring */
+typedef struct {
+    char *data;
+    int size;
+    uint64_t hash;      /* XXH64 of data, computed when decompressed */
+    int refs;           /* consumers that haven't released this slot yet */
+    int hole;           /* all zeros, a hole of a sparse source */
+} pipeline_buf_t;
+
+/* bounded ring of buffers between a producer and one or more consumers. Positions are
+ * absolute counters, and a slot is only reused once every consumer has released it */
+typedef struct {
+    pipeline_buf_t *buf;
+    int num;
+    uint64_t head, tail;
+    int consumers;  /* attached consumers */
+    int passive;    /* of those, the ones that don't keep the producer going on their own */
+    int done;       /* producer finished */
+    int abort;      /* all consumers gave up */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} pipeline_ring_t;
+
+/* one consumer's position in a ring */
+typedef struct {
+    pipeline_ring_t *r;
+    uint64_t taken, passed, released;
+    int mid;        /* there's a middle stage between producer and this consumer */
+    int signal;     /* wake up the consumer, see ring_signal() */
+    int active;     /* cleared when the consumer quits, stops its middle stage */
+} pipeline_cursor_t;
+
+/* per slot state of one target */
+typedef struct {
+    pipeline_buf_t *b;
+    uint64_t offset;    /* position on the target */
+    int pending;        /* writes in flight */
+    int done;           /* all written and verified */
+    unsigned char *same;    /* per piece flags, already on the target (compare mode) */
+} pipeline_slot_t;
+
+struct pipeline_s;
+
+/* one target with its own write, verify and compare stages */
+typedef struct {
+    struct pipeline_s *p;
+    pipeline_target_t *t;
+    pipeline_cursor_t cur;
+    pipeline_slot_t slot[PIPELINE_NUMBUF];
+    ioqueue_t q;
+    ioqueue_wb_t wb;
+    tune_t tn;
+    int fd, piece, cmp, tuning;
+    uint64_t zeroed;    /* the target reads as zeros up to here */
+    int report;         /* call main_onProgress() from the writer */
+    int finished;
+    pthread_t writer, verifier, comparer;
+    int writing, verifying, comparing;  /* those threads have been started */
+    /* verifier stage */
+    pipeline_slot_t *vq[PIPELINE_NUMBUF];
+    int vqhead, vqnum, vqstop;
+    int verify, vfd, verror;
+    char *vbuf;
+    pthread_mutex_t vmutex;
+    pthread_cond_t vcond;
+    /* compare stage */
+    char *cbuf;
+} pipeline_writer_t;
+
+/* pipeline context */
+typedef struct pipeline_s {
+    stream_t *ctx;
+    pipeline_ring_t in;
+    pipeline_ring_t out;
+    pipeline_cursor_t incur;
+    pipeline_cursor_t ccur;     /* CRC checker */
+    pipeline_buf_t inbuf[PIPELINE_INBUF];
+    pipeline_buf_t outbuf[PIPELINE_NUMBUF];
+    pipeline_buf_t *cur;
+    int pos;
+    int error;
+    int verify;
+    pipeline_writer_t w[PIPELINE_MAXTARGETS];
+} pipeline_t;
+
+/**
+ * Initialize a ring
+ */
+static void ring_init(pipeline_ring_t *r, pipeline_buf_t *buf, int num)
+{
+    memset(r, 0, sizeof(pipeline_ring_t));
+    r->buf = buf;
+    r->num = num;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+}
+
+/**
+ * Free ring resources
+ */
+static void ring_free(pipeline_ring_t *r)
+{
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+}
+
+/**
+ * Add a consumer to a ring, must be called before the producer starts
+ */
+static void ring_attach(pipeline_ring_t *r, pipeline_cursor_t *c, int mid)
+{
+    memset(c, 0, sizeof(pipeline_cursor_t));
+    c->r = r;
+    c->mid = mid;
+    c->active = 1;
+    r->consumers++;
+}
+
+/**
+ * Producer: wait for an empty slot. Returns NULL if all consumers gave up
+ */
+static pipeline_buf_t *ring_empty(pipeline_ring_t *r)
+{
+    pipeline_buf_t *b = NULL;
+    pthread_mutex_lock(&r->mutex);
+    while(!r->abort && r->head - r->tail == (uint64_t)r->num)
+        pthread_cond_wait(&r->cond, &r->mutex);
+    if(!r->abort) b = &r->buf[r->head % r->num];
+    pthread_mutex_unlock(&r->mutex);
+    return b;
+}
+
+/**
+ * Producer: pass the slot returned by ring_empty() to the consumers
+ */
+static void ring_put(pipeline_ring_t *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->buf[r->head % r->num].refs = r->consumers;
+    r->head++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/**
+ * Consumer: take the next filled slot, the consumer may hold more than one at a time.
+ * Returns NULL at the end of data, if wait is not set and there's no data yet, or if signaled
+ */
+static pipeline_buf_t *ring_take(pipeline_cursor_t *c, int wait)
+{
+    pipeline_ring_t *r = c->r;
+    pipeline_buf_t *b = NULL;
+    pthread_mutex_lock(&r->mutex);
+    /* at the end of data, we still have to wait for the slots taken so far */
+    while(wait && (c->mid ? c->passed : r->head) == c->taken && !c->signal &&
+      (!r->done || c->taken > c->released || (c->mid && c->passed < r->head)))
+        pthread_cond_wait(&r->cond, &r->mutex);
+    c->signal = 0;
+    if((c->mid ? c->passed : r->head) > c->taken) b = &r->buf[c->taken++ % r->num];
+    pthread_mutex_unlock(&r->mutex);
+    return b;
+}
+
+/**
+ * Middle stage: wait for the next filled slot, in order. Returns NULL at the end of data or if the consumer quit
+ */
+static pipeline_buf_t *ring_next(pipeline_cursor_t *c)
+{
+    pipeline_ring_t *r = c->r;
+    pipeline_buf_t *b = NULL;
+    pthread_mutex_lock(&r->mutex);
+    while(c->active && !r->done && c->passed == r->head)
+        pthread_cond_wait(&r->cond, &r->mutex);
+    if(c->active && c->passed < r->head) b = &r->buf[c->passed % r->num];
+    pthread_mutex_unlock(&r->mutex);
+    return b;
+}
+
+/**
+ * Middle stage: pass the slot returned by ring_next() on to the consumer
+ */
+static void ring_pass(pipeline_cursor_t *c)
+{
+    pthread_mutex_lock(&c->r->mutex);
+    c->passed++;
+    pthread_cond_broadcast(&c->r->cond);
+    pthread_mutex_unlock(&c->r->mutex);
+}
+
+/**
+ * Returns true if the producer has finished and the consumer has released every slot
+ */
+static int ring_finished(pipeline_cursor_t *c)
+{
+    int ret;
+    pthread_mutex_lock(&c->r->mutex);
+    ret = c->r->done && c->released == c->r->head;
+    pthread_mutex_unlock(&c->r->mutex);
+    return ret;
+}
+
+/**
+ * Set a taken slot's done flag, and wake up the consumer if asked to
+ */
+static void ring_signal(pipeline_cursor_t *c, int *done, int wake)
+{
+    pthread_mutex_lock(&c->r->mutex);
+    if(done) *done = 1;
+    if(wake) {
+        c->signal = 1;
+        pthread_cond_broadcast(&c->r->cond);
+    }
+    pthread_mutex_unlock(&c->r->mutex);
+}
+
+/**
+ * Drop one reference to a slot, and give back the oldest slots to the producer once nobody holds them
+ */
+static void ring_unref(pipeline_ring_t *r, uint64_t pos)
+{
+    r->buf[pos % r->num].refs--;
+    while(r->tail < r->head && !r->buf[r->tail % r->num].refs) r->tail++;
+}
+
+/**
+ * Consumer: release the oldest slot returned by ring_take()
+ */
+static void ring_release(pipeline_cursor_t *c)
+{
+    pthread_mutex_lock(&c->r->mutex);
+    ring_unref(c->r, c->released++);
+    pthread_cond_broadcast(&c->r->cond);
+    pthread_mutex_unlock(&c->r->mutex);
+}
+
+/**
+ * Consumer: stop the middle stage, but keep holding the slots
+ */
+static void ring_quit(pipeline_cursor_t *c)
+{
+    pthread_mutex_lock(&c->r->mutex);
+    c->active = 0;
+    pthread_cond_broadcast(&c->r->cond);
+    pthread_mutex_unlock(&c->r->mutex);
+}
+
+/**
+ * Consumer: leave the ring and release everything still held, the others go on without us.
+ * When the last non-passive consumer leaves, the producer is stopped
+ */
+static void ring_detach(pipeline_cursor_t *c)
+{
+    pipeline_ring_t *r = c->r;
+    pthread_mutex_lock(&r->mutex);
+    c->active = 0;
+    while(c->released < r->head) ring_unref(r, c->released++);
+    if(--r->consumers == r->passive) r->abort = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/**
+ * Producer: no more data, wake up the consumers
+ */
+static void ring_stop(pipeline_ring_t *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->done = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/**
+ * Keep a window of cache_window megabytes ahead of pos being read in asynchronously, and drop
+ * what's behind pos from the page cache, so that long runs don't push out everything else
+ */
+void pipeline_advise(stream_t *ctx, int fd, uint64_t pos)
+{
+#ifdef POSIX_FADV_WILLNEED
+    uint64_t win = (uint64_t)cache_window << 20, step = win / 4 < 4*1024*1024 ? 4*1024*1024 : win / 4, start, end;
+
+    if(!win) return;
+    /* at the end, drop everything that's left */
+    if(pos == (uint64_t)-1) {
+        start = ctx->cacheTail > step ? ctx->cacheTail - step : 0;
+        if(ctx->cacheHead) posix_fadvise(fd, (off_t)start, 0, POSIX_FADV_DONTNEED);
+        return;
+    }
+    if(!ctx->cacheHead) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    /* extend the window when half of it has been consumed, so there's always a read in flight */
+    if(pos + win / 2 >= ctx->cacheHead) {
+        end = pos + win;
+        if(verbose > 1) printf("pipeline_advise() willneed %" PRIu64 " - %" PRIu64 "\r\n", ctx->cacheHead, end);
+        posix_fadvise(fd, (off_t)ctx->cacheHead, (off_t)(end - ctx->cacheHead), POSIX_FADV_WILLNEED);
+        ctx->cacheHead = end;
+    }
+    /* drop in steps, overlapping the previous range, because a large folio straddling a boundary
+     * is only dropped when it's entirely inside the range */
+    end = pos & ~4095ULL;
+    if(end >= ctx->cacheTail + step) {
+        start = ctx->cacheTail > step ? ctx->cacheTail - step : 0;
+        posix_fadvise(fd, (off_t)start, (off_t)(end - start), POSIX_FADV_DONTNEED);
+        ctx->cacheTail = end;
+    }
+#else
+    (void)ctx; (void)fd; (void)pos;
+#endif
+}
+
+/**
+ * Input prefetch stage, reads compressed data ahead of the decompressor
+ */
+static void *pipeline_reader(void *data)
+{
+    pipeline_t *p = (pipeline_t*)data;
+    pipeline_buf_t *b;
+
+    while((b = ring_empty(&p->in))) {
+        b->size = (int)fread(b->data, 1, PIPELINE_INSIZE, p->ctx->f);
+        if(b->size < 1) break;
+        pipeline_advise(p->ctx, fileno(p->ctx->f), (uint64_t)ftello(p->ctx->f));
+        ring_put(&p->in);
+    }
+    pipeline_advise(p->ctx, fileno(p->ctx->f), (uint64_t)-1);
+    ring_stop(&p->in);
+    return NULL;
+}
+
+/**
+ * Input hook for stream_read(), same semantics as fread(buf, size, 1, f)
+ */
+static int pipeline_input(void *data, unsigned char *buf, int size)
+{
+    pipeline_t *p = (pipeline_t*)data;
+    int n;
+
+    while(size > 0) {
+        if(!p->cur) {
+            if(!(p->cur = ring_take(&p->incur, 1))) return 0;
+            p->pos = 0;
+        }
+        n = p->cur->size - p->pos;
+        if(n > size) n = size;
+        memcpy(buf, p->cur->data + p->pos, n);
+        buf += n; size -= n; p->pos += n;
+        if(p->pos >= p->cur->size) {
+            ring_release(&p->incur);
+            p->cur = NULL;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Decompressor stage, fills the output ring using stream_read()
+ */
+static void *pipeline_decoder(void *data)
+{
+    pipeline_t *p = (pipeline_t*)data;
+    pipeline_buf_t *b;
+
+    while((b = ring_empty(&p->out))) {
+        p->ctx->buffer = b->data;
+        b->size = stream_read(p->ctx);
+        if(b->size < 1) {
+            if(b->size < 0) p->error = L_RDSRCERR;
+            break;
+        }
+        /* plain images are read right here, there's no prefetch stage for them */
+        if(p->ctx->type == TYPE_PLAIN) pipeline_advise(p->ctx, fileno(p->ctx->f), (uint64_t)ftello(p->ctx->f));
+        if(p->verify) b->hash = XXH64(b->data, b->size, 0);
+        b->hole = p->ctx->hole;
+        ring_put(&p->out);
+    }
+    if(p->ctx->type == TYPE_PLAIN) pipeline_advise(p->ctx, fileno(p->ctx->f), (uint64_t)-1);
+    ring_stop(&p->out);
+    /* let the prefetch stage finish too if we have stopped early */
+    if(p->incur.r) ring_detach(&p->incur);
+    return NULL;
+}
+
+/**
+ * Checker stage, computes the CRC or the block map checksums of the decompressed data alongside the writers
+ */
+static void *pipeline_checker(void *data)
+{
+    pipeline_t *p = (pipeline_t*)data;
+    pipeline_buf_t *b;
+
+    while((b = ring_take(&p->ccur, 1))) {
+        stream_crc(p->ctx, b->data, b->size);
+        ring_release(&p->ccur);
+    }
+    return NULL;
+}
+
+/**
+ * Verifier stage: wait for the next written buffer. Returns NULL when stopped
+ */
+static pipeline_slot_t *pipeline_verifynext(pipeline_writer_t *w)
+{
+    pipeline_slot_t *s = NULL;
+    pthread_mutex_lock(&w->vmutex);
+    while(!w->vqstop && !w->vqnum)
+        pthread_cond_wait(&w->vcond, &w->vmutex);
+    if(!w->vqstop) {
+        s = w->vq[w->vqhead];
+        w->vqhead = (w->vqhead + 1) % PIPELINE_NUMBUF;
+        w->vqnum--;
+    }
+    pthread_mutex_unlock(&w->vmutex);
+    return s;
+}
+
+/**
+ * Write stage: pass a written buffer to the verifier
+ */
+static void pipeline_verifypush(pipeline_writer_t *w, pipeline_slot_t *s)
+{
+    pthread_mutex_lock(&w->vmutex);
+    w->vq[(w->vqhead + w->vqnum++) % PIPELINE_NUMBUF] = s;
+    pthread_cond_broadcast(&w->vcond);
+    pthread_mutex_unlock(&w->vmutex);
+}
+
+/**
+ * Verifier stage: make sure that a range is read back from the medium and not from the page cache,
+ * when the target couldn't be opened for direct I/O. Dirty pages aren't dropped, so write them
+ * out first, then drop everything the block device has cached, or at least this range
+ */
+static void pipeline_dropcache(pipeline_writer_t *w, uint64_t offset, int size)
+{
+#ifdef __linux__
+    struct stat st;
+#endif
+
+#ifdef __linux__
+    if(fdatasync(w->fd) && verbose) printf("  verify fd %d fdatasync errno=%d\n", w->fd, errno);
+#else
+    if(fsync(w->fd) && verbose) printf("  verify fd %d fsync errno=%d\n", w->fd, errno);
+#endif
+#ifdef BLKFLSBUF
+    if(!fstat(w->fd, &st) && S_ISBLK(st.st_mode) && !ioctl(w->fd, BLKFLSBUF, 0)) { errno = 0; return; }
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(w->fd, (off_t)offset, (off_t)size, POSIX_FADV_DONTNEED);
+#else
+    (void)offset; (void)size;
+#endif
+    errno = 0;
+}
+
+/**
+ * Verifier stage, reads back written buffers from the medium while the writer keeps going
+ */
+static void *pipeline_verifier(void *data)
+{
+    pipeline_writer_t *w = (pipeline_writer_t*)data;
+    pipeline_slot_t *s;
+    XXH64_state_t state;
+    int n, pos, size, numberOfBytesVerify;
+
+    while((s = pipeline_verifynext(w))) {
+        size = s->b->size;
+        /* if we couldn't open the target for direct I/O, then the page cache must not answer the readback */
+        if(w->vfd == w->fd) pipeline_dropcache(w, s->offset, size);
+        /* no need for a full sized copy, hash the readback in small chunks */
+        XXH64_reset(&state, 0);
+        for(pos = numberOfBytesVerify = 0; pos < size; pos += n) {
+            n = size - pos > STREAM_VRFSIZE ? STREAM_VRFSIZE : size - pos;
+            if((int)pread(w->vfd, w->vbuf, n, (off_t)(s->offset + pos)) != n) break;
+            XXH64_update(&state, w->vbuf, n);
+            numberOfBytesVerify += n;
+        }
+        if(verbose) printf("  verify fd %d offset %" PRIu64 " numberOfBytesVerify %d\n", w->fd, s->offset,
+            numberOfBytesVerify);
+        if(numberOfBytesVerify != size || XXH64_digest(&state) != s->b->hash) {
+            w->verror = L_VRFYERR;
+            ring_signal(&w->cur, NULL, 1);
+            break;
+        }
+        ring_signal(&w->cur, &s->done, 1);
+    }
+    return NULL;
+}
+
+/**
+ * Compare stage, reads the target ahead of the writer and marks pieces that are already there
+ */
+static void *pipeline_comparer(void *data)
+{
+    pipeline_writer_t *w = (pipeline_writer_t*)data;
+    pipeline_buf_t *b;
+    pipeline_slot_t *s;
+    uint64_t offset = 0;
+    int i, n, k, pos, len;
+
+    while((b = ring_next(&w->cur))) {
+        s = &w->slot[b - w->p->outbuf];
+        for(i = pos = 0; pos < b->size; i++, pos += w->piece) {
+            len = b->size - pos > w->piece ? w->piece : b->size - pos;
+            s->same[i] = 1;
+            /* stop reading this piece at the first difference, it has to be written anyway */
+            for(n = 0; s->same[i] && n < len; n += k) {
+                k = len - n > STREAM_VRFSIZE ? STREAM_VRFSIZE : len - n;
+                if((int)pread(w->vfd, w->cbuf, k, (off_t)(offset + pos + n)) != k ||
+                    memcmp(w->cbuf, b->data + pos + n, k)) s->same[i] = 0;
+            }
+            if(verbose > 1) printf("  compare fd %d offset %" PRIu64 " size %d same %d\n", w->fd, offset + pos, len,
+                s->same[i]);
+        }
+        offset += (uint64_t)b->size;
+        ring_pass(&w->cur);
+    }
+    return NULL;
+}
+
+/**
+ * Open a second descriptor for the verifier that bypasses the page cache
+ */
+static int pipeline_verifyopen(int dst)
+{
+#if defined(O_DIRECT) && defined(__linux__)
+    char path[64];
+    int fd;
+
+    if(fcntl(dst, F_GETFL) & O_DIRECT) return dst;
+    sprintf(path, "/proc/self/fd/%d", dst);
+    fd = open(path, O_RDONLY | O_DIRECT);
+    errno = 0;
+    if(fd >= 0) return fd;
+#endif
+    return dst;
+}
+
+/**
+ * Write stage: report what's on the device
+ */
+static void pipeline_progress(pipeline_writer_t *w)
+{
+    __atomic_store_n(&w->t->written, w->wb.synced, __ATOMIC_RELAXED);
+    if(w->report) {
+        __atomic_store_n(&w->p->ctx->wrtnSize, w->wb.synced, __ATOMIC_RELAXED);
+        main_onProgress(w->p->ctx);
+    }
+}
+
+/**
+ * Write stage: release completed buffers in order, and keep the unflushed data within the
+ * writeback window. Returns 0 or an L_* error message index
+ */
+static int pipeline_complete(pipeline_writer_t *w)
+{
+    pipeline_slot_t *s;
+    int size;
+
+    while(1) {
+        pthread_mutex_lock(&w->cur.r->mutex);
+        s = &w->slot[w->cur.released % PIPELINE_NUMBUF];
+        if(w->cur.released == w->cur.taken || !s->done) s = NULL;
+        pthread_mutex_unlock(&w->cur.r->mutex);
+        if(!s) break;
+        size = s->b->size;
+        ring_release(&w->cur);
+        if(ioqueue_wbwritten(&w->wb, (uint64_t)size)) {
+            main_getErrorMessage();
+            return L_WRTRGERR;
+        }
+        pipeline_progress(w);
+    }
+    return 0;
+}
+
+/**
+ * Write stage: all pieces of a buffer are on the target, pass it to the verifier or release it
+ */
+static void pipeline_written(pipeline_writer_t *w, pipeline_slot_t *s)
+{
+    if(verbose) printf("write(%d) fd %d offset %" PRIu64 " done\n", s->b->size, w->fd, s->offset);
+    if(w->verify)
+        pipeline_verifypush(w, s);
+    else
+        ring_signal(&w->cur, &s->done, 0);
+}
+
+/**
+ * Returns true if the buffer is all zeros
+ */
+static int pipeline_iszero(const char *buf, int size)
+{
+    return !buf[0] && !memcmp(buf, buf + 1, size - 1);
+}
+
+/**
+ * Write stage: stop this target's verify and compare stages, and leave the output ring
+ */
+static void pipeline_leave(pipeline_writer_t *w)
+{
+    if(w->verifying) {
+        pthread_mutex_lock(&w->vmutex);
+        w->vqstop = 1;
+        pthread_cond_broadcast(&w->vcond);
+        pthread_mutex_unlock(&w->vmutex);
+        pthread_join(w->verifier, NULL);
+    }
+    ring_quit(&w->cur);
+    if(w->comparing) pthread_join(w->comparer, NULL);
+    ring_detach(&w->cur);
+}
+
+/**
+ * Device write stage of one target. When that fails, only this target leaves the output ring
+ */
+static void *pipeline_writer(void *data)
+{
+    pipeline_writer_t *w = (pipeline_writer_t*)data;
+    pipeline_buf_t *b;
+    pipeline_slot_t *s = NULL, *c;
+    uint64_t offset = 0, skipped = 0, same = 0;
+    int n, pos = 0, piece = w->piece, depth = w->q.depth, ret = 0;
+
+    while(1) {
+        if(!ret && w->verror) ret = w->verror;
+        if((n = pipeline_complete(w)) && !ret) ret = n;
+        if(w->tuning) { piece = w->tn.piece; depth = w->tn.depth; }
+        /* keep the queue full */
+        if(!ret && w->q.inflight < depth) {
+            if(!s || pos >= s->b->size) {
+                /* only block if there's nothing else to do, the verifier wakes us up too */
+                if((b = ring_take(&w->cur, !w->q.inflight))) {
+                    s = &w->slot[b - w->p->outbuf];
+                    s->b = b;
+                    s->offset = offset;
+                    s->pending = s->done = 0;
+                    offset += (uint64_t)b->size;
+                    pos = 0;
+                } else
+                if(!w->q.inflight && ring_finished(&w->cur)) break;
+            }
+            if(s && pos < s->b->size) {
+                b = s->b;
+                n = b->size - pos > piece ? piece : b->size - pos;
+                if(s->offset + pos + n <= w->zeroed && (b->hole || pipeline_iszero(b->data + pos, n))) {
+                    skipped += (uint64_t)n;
+                    pos += n;
+                } else
+                if(w->cmp && s->same[pos / w->piece]) {
+                    same += (uint64_t)n;
+                    pos += n;
+                } else
+                if(ioqueue_write(&w->q, b->data + pos, n, s->offset + pos, s)) {
+                    main_getErrorMessage();
+                    ret = L_WRTRGERR;
+                } else {
+                    s->pending++;
+                    pos += n;
+                }
+                if(!ret && !s->pending && pos >= b->size) pipeline_written(w, s);
+                continue;
+            }
+        }
+        if(!w->q.inflight) {
+            if(ret) break;
+            continue;
+        }
+        /* handle one completion, they may arrive in any order */
+        n = ioqueue_wait(&w->q, (void**)&c);
+        if(verbose > 1) printf("ioqueue_wait() fd %d offset %" PRIu64 " n %d errno=%d\r\n", w->fd, c ? c->offset : 0, n,
+            errno);
+        /* the queue has failed, the writes in flight are lost */
+        if(!c) {
+            if(!ret) {
+                main_getErrorMessage();
+                ret = L_WRTRGERR;
+            }
+            continue;
+        }
+        c->pending--;
+        if(n < 0) {
+            if(!ret) {
+                if(errno) main_errorMessage = strerror(errno);
+                ret = L_WRTRGERR;
+            }
+            continue;
+        }
+        if(w->tuning) tune_account(&w->tn, n);
+        if(c->pending || (c == s && pos < s->b->size) || ret) continue;
+        pipeline_written(w, c);
+    }
+    ioqueue_close(&w->q);
+    if(!ret) {
+        if(ioqueue_wbflush(&w->wb)) {
+            main_getErrorMessage();
+            ret = L_WRTRGERR;
+        } else
+            pipeline_progress(w);
+    }
+    if(verbose && w->zeroed) printf("pipeline_write() fd %d skipped %" PRIu64 " zero bytes\r\n", w->fd, skipped);
+    if(verbose && w->cmp) printf("pipeline_write() fd %d skipped %" PRIu64 " bytes already on target\r\n", w->fd, same);
+    pipeline_leave(w);
+    w->t->error = ret;
+    __atomic_store_n(&w->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Decompress the source and write it to the target disk
+ */
+int pipeline_write(stream_t *ctx, int dst, int needVerify)
+{
+    pipeline_target_t t;
+    int ret;
+
+    /* plain images need no processing, so if we don't have to look at the data, let the kernel move it.
+     * Stored zip entries have a CRC to check, so those have to go through the pipeline */
+    if(!needVerify && !compare && !disks_zero && !autotune && !ctx->hasCrc) {
+        ctx->secSize = disks_sectorsize((void*)((long int)dst));
+        if((ret = kcopy_write(ctx, dst))) {
+            if(ret > 0) return 0;
+            main_getErrorMessage();
+            return L_WRTRGERR;
+        }
+    }
+    memset(&t, 0, sizeof(pipeline_target_t));
+    t.fd = dst;
+    return pipeline_fanout(ctx, &t, 1, needVerify);
+}
+
+/**
+ * Decompress the source once and write it to several target disks in parallel
+ */
+int pipeline_fanout(stream_t *ctx, pipeline_target_t *targets, int num, int needVerify)
+{
+    static pipeline_t p;
+    pipeline_writer_t *w;
+    pthread_t reader, decoder, checker;
+    char *orig = ctx->buffer;
+    uint64_t slowest, size;
+    int i, j, n, ret = 0, reading = 0, decoding = 0, checking = 0, prefetch = ctx->type != TYPE_PLAIN && ctx->type != TYPE_QCOW2;
+
+    if(num < 1 || num > PIPELINE_MAXTARGETS) return L_WRTRGERR;
+    /* gzip, bzip2, xz, zstd and lz4 are decompressed on all cores, and those read the source on their own */
+    if(prefetch && (gzpar_open(ctx) || bzpar_open(ctx) || xzpar_open(ctx) || zstdpar_open(ctx) || lz4par_open(ctx))) prefetch = 0;
+    /* qcow2 is read randomly, so it never has a prefetch stage, but its clusters are decoded on all cores too */
+    qcow2par_open(ctx);
+    memset(&p, 0, sizeof(pipeline_t));
+    p.ctx = ctx;
+    /* the stream's own buffer is the first slot, so we only need a few more */
+    p.outbuf[0].data = orig;
+    for(i = 1; i < PIPELINE_NUMBUF; i++)
+        if(!(p.outbuf[i].data = (char*)stream_malloc(buffer_size))) { main_getErrorMessage(); ret = L_WRTRGERR; goto err; }
+    if(prefetch)
+        for(i = 0; i < PIPELINE_INBUF; i++)
+            if(!(p.inbuf[i].data = (char*)malloc(PIPELINE_INSIZE))) { main_getErrorMessage(); ret = L_RDSRCERR; goto err; }
+    for(i = 0; i < num; i++) {
+        w = &p.w[i];
+        if(needVerify && !(w->vbuf = (char*)stream_malloc(STREAM_VRFSIZE))) { main_getErrorMessage(); ret = L_VRFYERR; goto err; }
+        if(compare) {
+            if(!(w->cbuf = (char*)stream_malloc(STREAM_VRFSIZE))) { main_getErrorMessage(); ret = L_WRTRGERR; goto err; }
+            /* worst case, with the smallest piece size */
+            for(j = 0; j < PIPELINE_NUMBUF; j++)
+                if(!(w->slot[j].same = (unsigned char*)malloc(buffer_size / 4096 + 1))) {
+                    main_getErrorMessage(); ret = L_WRTRGERR; goto err;
+                }
+        }
+    }
+    ring_init(&p.in, p.inbuf, PIPELINE_INBUF);
+    ring_init(&p.out, p.outbuf, PIPELINE_NUMBUF);
+    if(prefetch) ring_attach(&p.in, &p.incur, 0);
+    /* the checker only follows the writers, it doesn't keep the decoder going if they all fail */
+    if(ctx->hasCrc || ctx->bmap) {
+        ring_attach(&p.out, &p.ccur, 0);
+        p.out.passive = 1;
+    }
+    ctx->secSize = 0;
+    for(i = 0; i < num; i++) {
+        w = &p.w[i];
+        w->p = &p;
+        w->t = &targets[i];
+        w->t->error = 0;
+        w->t->written = 0;
+        w->fd = targets[i].fd;
+        w->verify = needVerify;
+        w->cmp = compare;
+        w->tuning = autotune;
+        /* with more targets, the caller's thread reports the progress of the slowest one */
+        w->report = num == 1;
+        ioqueue_open(&w->q, w->fd, w->tuning && queue_depth < TUNE_MAXDEPTH ? TUNE_MAXDEPTH : queue_depth);
+        ioqueue_wbopen(&w->wb, w->fd);
+        /* there's no way to read back what we've sent to a serial port */
+        if(w->q.stream) w->verify = w->cmp = w->tuning = 0;
+        /* pieces are compared with a fixed size, so there's nothing to tune there */
+        if(w->cmp) w->tuning = 0;
+        ring_attach(&p.out, &w->cur, w->cmp);
+        /* direct I/O needs the last, partial buffer to be padded to the logical sector size. Sector
+         * sizes are powers of two, so padding to the largest one suits all targets */
+        n = disks_sectorsize((void*)((long int)w->fd));
+        if(n > ctx->secSize) ctx->secSize = n;
+        /* split buffers so that there are enough requests to keep the queue full */
+        w->piece = w->q.depth > 1 ? (buffer_size / w->q.depth) & ~4095 : buffer_size;
+        if(w->piece < 4096) w->piece = 4096;
+        if(w->tuning) tune_init(&w->tn, buffer_size, w->q.depth, disks_model((void*)((long int)w->fd)));
+        if(w->verify) p.verify = 1;
+        w->vfd = w->verify || w->cmp ? pipeline_verifyopen(w->fd) : -1;
+        /* if the target reads as zeros where the image goes, then there's no need to write zero blocks
+         * there. Not when comparing though, because that would wipe out what's already on the target.
+         * Sparse sources are mostly holes, so for those it's done even without being asked. The
+         * padding of the last sector is zeros too, so that might be skipped as well. The size of some
+         * compressed images is just a hint, so anything past it is written as usual */
+        if((disks_zero || ctx->sparse) && !w->cmp && !w->q.stream) {
+            size = (ctx->fileSize + ctx->secSize - 1) & ~((uint64_t)ctx->secSize - 1);
+            if(disks_zeroout((void*)((long int)w->fd), size)) w->zeroed = size;
+            /* every block is written then, that's not an error */
+            errno = 0;
+        }
+        pthread_mutex_init(&w->vmutex, NULL);
+        pthread_cond_init(&w->vcond, NULL);
+        if(verbose) printf("pipeline_write() fd %d numbuf %d prefetch %d depth %d piece %d verify %d%s zeroed %" PRIu64 " compare %d\r\n",
+            w->fd, PIPELINE_NUMBUF, prefetch, w->q.depth, w->piece, w->verify, w->vfd >= 0 && w->vfd != w->fd ? " direct" : "",
+            w->zeroed, w->cmp);
+    }
+
+    ctx->wrtnSize = 0;
+    ctx->pipelined = 1;
+    n = 0;
+    if(prefetch) {
+        ctx->input = pipeline_input;
+        ctx->inputData = &p;
+        reading = !(n = pthread_create(&reader, NULL, pipeline_reader, &p));
+    }
+    if(!n) decoding = !(n = pthread_create(&decoder, NULL, pipeline_decoder, &p));
+    if(!n && (ctx->hasCrc || ctx->bmap)) checking = !(n = pthread_create(&checker, NULL, pipeline_checker, &p));
+    for(i = 0; !n && i < num; i++) {
+        w = &p.w[i];
+        if(w->verify) w->verifying = !(n = pthread_create(&w->verifier, NULL, pipeline_verifier, w));
+        if(!n && w->cmp) w->comparing = !(n = pthread_create(&w->comparer, NULL, pipeline_comparer, w));
+    }
+    if(n) {
+        /* a stage couldn't be started, so stop the ones that were. Without a decoder, nobody would
+         * stop the prefetch and checker stages, otherwise it stops once every target has left */
+        if(!decoding) {
+            ring_stop(&p.out);
+            if(p.incur.r) ring_detach(&p.incur);
+        }
+        for(i = 0; i < num; i++) {
+            ioqueue_close(&p.w[i].q);
+            pipeline_leave(&p.w[i]);
+            targets[i].error = L_WRTRGERR;
+        }
+        errno = n;
+        main_getErrorMessage();
+    } else
+    if(num == 1)
+        /* a single target is written on the caller's thread so that it can update the UI */
+        pipeline_writer(&p.w[0]);
+    else {
+        for(i = 0; i < num; i++) {
+            w = &p.w[i];
+            if((n = pthread_create(&w->writer, NULL, pipeline_writer, w))) {
+                /* only this target is left out, the others go on */
+                ioqueue_close(&w->q);
+                pipeline_leave(w);
+                targets[i].error = L_WRTRGERR;
+                w->finished = 1;
+                errno = n;
+                main_getErrorMessage();
+            } else
+                w->writing = 1;
+        }
+        do {
+            usleep(STREAM_PROGRESSMS * 1000);
+            /* progress is that of the slowest target still going, failed ones don't hold back the rest */
+            for(i = n = 0, slowest = ~0ULL; i < num; i++) {
+                if(!__atomic_load_n(&p.w[i].finished, __ATOMIC_ACQUIRE)) n++; else
+                if(targets[i].error) continue;
+                if(__atomic_load_n(&targets[i].written, __ATOMIC_RELAXED) < slowest)
+                    slowest = __atomic_load_n(&targets[i].written, __ATOMIC_RELAXED);
+            }
+            if(slowest != ~0ULL) __atomic_store_n(&ctx->wrtnSize, slowest, __ATOMIC_RELAXED);
+            main_onProgress(ctx);
+        } while(n);
+        for(i = 0; i < num; i++)
+            if(p.w[i].writing) pthread_join(p.w[i].writer, NULL);
+    }
+    if(decoding) pthread_join(decoder, NULL);
+    if(reading) pthread_join(reader, NULL);
+    if(checking) {
+        pthread_join(checker, NULL);
+        /* the data is already on the targets by now, but the job must still fail */
+        if(!p.error && !stream_crcok(ctx)) p.error = L_RDSRCERR;
+    }
+    for(i = 0; i < num; i++) {
+        w = &p.w[i];
+        /* all targets share the same file, so the tuners are saved one after another */
+        if(w->tuning && !targets[i].error) tune_save(&w->tn);
+        if(w->vfd >= 0 && w->vfd != w->fd) close(w->vfd);
+        pthread_cond_destroy(&w->vcond);
+        pthread_mutex_destroy(&w->vmutex);
+        /* a read error affects every target */
+        if(!targets[i].error) targets[i].error = p.error;
+        if(!ret) ret = targets[i].error;
+    }
+    if(!ret && (!ctx->fileSize || ctx->multi)) ctx->fileSize = ctx->readSize;
+    ctx->input = NULL;
+    ctx->inputData = NULL;
+    ring_free(&p.out);
+    ring_free(&p.in);
+
+err:
+    gzpar_close(ctx);
+    bzpar_close(ctx);
+    xzpar_close(ctx);
+    zstdpar_close(ctx);
+    lz4par_close(ctx);
+    qcow2par_close(ctx);
+    ctx->buffer = orig;
+    for(i = 1; i < PIPELINE_NUMBUF; i++)
+        if(p.outbuf[i].data) stream_free(p.outbuf[i].data);
+    for(i = 0; i < PIPELINE_INBUF; i++)
+        if(p.inbuf[i].data) free(p.inbuf[i].data);
+    for(i = 0; i < num; i++) {
+        w = &p.w[i];
+        if(w->vbuf) stream_free(w->vbuf);
+        if(w->cbuf) stream_free(w->cbuf);
+        for(j = 0; j < PIPELINE_NUMBUF; j++)
+            if(w->slot[j].same) free(w->slot[j].same);
+    }
+    return ret;
+}
+
+#endif
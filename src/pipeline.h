@@ -0,0 +1,59 @@
+/*
+ * usbimager/pipeline.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Threaded read / decompress / write pipeline
+ *
+ */
+
+#define PIPELINE_NUMBUF 4               /* decompressed buffers in the ring, buffer_size each */
+#define PIPELINE_INBUF  8               /* compressed input chunks read ahead */
+#define PIPELINE_INSIZE (1024*1024)     /* size of one compressed input chunk */
+#define PIPELINE_MAXTARGETS 16          /* disks written at once by pipeline_fanout() */
+
+/* one target of a fan-out write */
+typedef struct {
+    int fd;             /* opened target disk */
+    int error;          /* 0 or an L_* error message index */
+    uint64_t written;   /* bytes written (and verified) so far */
+} pipeline_target_t;
+
+/**
+ * Manage the page cache of a source read sequentially, pos is how far it has been consumed,
+ * or -1 when finished
+ */
+void pipeline_advise(stream_t *ctx, int fd, uint64_t pos);
+
+/**
+ * Decompress the source and write it to the target disk, with prefetch, decompression
+ * and write running in parallel. Returns 0 on success, or an L_* error message index
+ */
+int pipeline_write(stream_t *ctx, int dst, int needVerify);
+
+/**
+ * Same as pipeline_write(), but the source is decompressed only once and written to num targets
+ * in parallel. A failing target doesn't stop the others, each target's result is in its error
+ * field. Returns 0 if all succeeded, otherwise the first error
+ */
+int pipeline_fanout(stream_t *ctx, pipeline_target_t *targets, int num, int needVerify);
@@ -0,0 +1,225 @@
+/*
+ * usbimager/qcow2.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief qcow2 virtual disk reader
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zlib.h"
+#include "zstd.h"
+#include "qcow2.h"
+
+#define QCOW2_OFFSET 0x00fffffffffffe00ULL      /* of L2 tables and standard clusters */
+#define QCOW2_COMPRESSED (1ULL << 62)
+#define QCOW2_ZERO 1ULL                         /* standard cluster that reads as zeros */
+#define QCOW2_MAXL1 (32*1024*1024)              /* same limit as qemu */
+
+/**
+ * Big endian values
+ */
+static uint32_t qcow2_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+static uint64_t qcow2_be64(const unsigned char *p)
+{
+    return ((uint64_t)qcow2_be32(p) << 32) | qcow2_be32(p + 4);
+}
+
+/**
+ * Parse the header and load the L1 table
+ */
+int qcow2_open(qcow2_t *q, const unsigned char *hdr, uint64_t fs, qcow2_read_t read, void *data)
+{
+    uint32_t version = qcow2_be32(hdr + 4), i;
+    uint64_t incompat, cs;
+
+    memset(q, 0, sizeof(qcow2_t));
+    q->fileSize = fs;
+    q->clusterBits = (int)qcow2_be32(hdr + 20);
+    q->size = qcow2_be64(hdr + 24);
+    q->l1Size = qcow2_be32(hdr + 36);
+    /* no backing file and no encryption */
+    if(version < 2 || version > 3 || qcow2_be64(hdr + 8) || qcow2_be32(hdr + 32) ||
+      q->clusterBits < 9 || q->clusterBits > 21 || q->l1Size > QCOW2_MAXL1 / 8) return 4;
+    if(version == 3) {
+        /* being dirty only affects the refcounts, which we don't need. The compression type is
+         * the only other feature we know; no external data file, no extended L2 entries */
+        incompat = qcow2_be64(hdr + 72);
+        if(incompat & ~9ULL) return 4;
+        if(incompat & 8) {
+            if(qcow2_be32(hdr + 100) < 105 || hdr[104] > 1) return 4;
+            q->zstd = hdr[104];
+        }
+    }
+    cs = 1ULL << q->clusterBits;
+    if(q->l1Size) {
+        if(!(q->l1 = (uint64_t*)malloc(q->l1Size * 8)) ||
+          !(*read)(data, q->l1, q->l1Size * 8, qcow2_be64(hdr + 40))) { free(q->l1); q->l1 = NULL; return 4; }
+        for(i = 0; i < q->l1Size; i++) {
+            q->l1[i] = qcow2_be64((unsigned char*)&q->l1[i]) & QCOW2_OFFSET;
+            /* L2 tables are cluster aligned */
+            if(q->l1[i] & (cs - 1)) { free(q->l1); q->l1 = NULL; return 4; }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Allocate a reader for ranges of at most maxSize bytes
+ */
+int qcow2_reader(qcow2_reader_t *r, qcow2_t *q, qcow2_read_t read, void *data, int maxSize)
+{
+    uint64_t cs = 1ULL << q->clusterBits;
+
+    memset(r, 0, sizeof(qcow2_reader_t));
+    r->q = q;
+    r->read = read;
+    r->data = data;
+    /* a range might start and end in the middle of a cluster */
+    r->l2Size = (uint32_t)(maxSize / cs + 2);
+    /* compressed data takes at most two clusters' worth of sectors */
+    if(!(r->l2 = (uint64_t*)malloc(r->l2Size * 8)) || !(r->cbuf = (unsigned char*)malloc(2 * cs)) ||
+      !(r->ubuf = (unsigned char*)malloc(cs)) || inflateInit2(&r->zs, -MAX_WBITS) != Z_OK) {
+        free(r->l2); free(r->cbuf); free(r->ubuf);
+        return 1;
+    }
+    if(q->zstd && !(r->zstd = ZSTD_createDCtx())) { qcow2_freereader(r); return 1; }
+    return 0;
+}
+
+/**
+ * Decompress a cluster into ubuf. Returns 0 on success
+ */
+static int qcow2_decompress(qcow2_reader_t *r, uint64_t cl, uint64_t e)
+{
+    qcow2_t *q = r->q;
+    uint64_t cs = 1ULL << q->clusterBits, off, len;
+    int x = 62 - (q->clusterBits - 8), ret;
+    ZSTD_inBuffer zi;
+    ZSTD_outBuffer zo;
+
+    if(r->ucl == cl + 1) return 0;
+    off = e & ((1ULL << x) - 1);
+    /* the data goes on for this many more sectors, but the last one may be cut short by the end of file */
+    len = (((e & ~(3ULL << 62)) >> x) + 1) * 512 - (off & 511);
+    if(off >= q->fileSize) return 1;
+    if(len > q->fileSize - off) len = q->fileSize - off;
+    if(len > 2 * cs || !(*r->read)(r->data, r->cbuf, (uint32_t)len, off)) return 1;
+    if(q->zstd) {
+        zi.src = r->cbuf; zi.size = len; zi.pos = 0;
+        zo.dst = r->ubuf; zo.size = cs; zo.pos = 0;
+        ZSTD_DCtx_reset(r->zstd, ZSTD_reset_session_only);
+        while(zo.pos < zo.size) {
+            if(zi.pos == zi.size || ZSTD_isError(ZSTD_decompressStream(r->zstd, &zo, &zi))) return 1;
+        }
+    } else {
+        inflateReset(&r->zs);
+        r->zs.next_in = r->cbuf;
+        r->zs.avail_in = (uInt)len;
+        r->zs.next_out = r->ubuf;
+        r->zs.avail_out = (uInt)cs;
+        ret = inflate(&r->zs, Z_FINISH);
+        /* the sectors are padded, so there might be garbage after the deflate stream */
+        if(r->zs.avail_out || (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR)) return 1;
+    }
+    r->ucl = cl + 1;
+    return 0;
+}
+
+/**
+ * Read a range of the virtual disk into buf, or just check if there's data in it
+ */
+int qcow2_fill(qcow2_reader_t *r, uint64_t off, unsigned char *buf, int size)
+{
+    qcow2_t *q = r->q;
+    uint64_t cs = 1ULL << q->clusterBits, per = cs / 8, cl, last, e, start, end, host;
+    uint32_t i, j, n;
+    int ret = 0;
+
+    if(size < 1) return 0;
+    for(cl = off >> q->clusterBits, last = (off + size - 1) >> q->clusterBits; cl <= last; cl += n) {
+        /* entries of one L2 table */
+        n = (uint32_t)(per - cl % per);
+        if(n > last - cl + 1) n = (uint32_t)(last - cl + 1);
+        if(n > r->l2Size) n = r->l2Size;
+        if(cl / per >= q->l1Size || !q->l1[cl / per]) memset(r->l2, 0, n * 8); else
+        if(!(*r->read)(r->data, r->l2, n * 8, q->l1[cl / per] + (cl % per) * 8)) return -1;
+        for(i = 0; i < n; i = j) {
+            e = qcow2_be64((unsigned char*)&r->l2[i]);
+            /* the part of this cluster that's in the range */
+            start = (cl + i) << q->clusterBits;
+            if(start < off) start = off;
+            end = (cl + i + 1) << q->clusterBits;
+            if(end > off + size) end = off + size;
+            j = i + 1;
+            if(!(e & QCOW2_COMPRESSED) && ((e & QCOW2_ZERO) || !(e & QCOW2_OFFSET))) {
+                if(buf) memset(buf + (start - off), 0, end - start);
+                continue;
+            }
+            if(!buf) return 1;
+            ret = 1;
+            if(e & QCOW2_COMPRESSED) {
+                if(qcow2_decompress(r, cl + i, e)) return -1;
+                memcpy(buf + (start - off), r->ubuf + (start & (cs - 1)), end - start);
+                continue;
+            }
+            /* clusters which follow each other in the image file too are read at once */
+            host = (e & QCOW2_OFFSET) + (start & (cs - 1));
+            while(j < n && end == (cl + j) << q->clusterBits && (e = qcow2_be64((unsigned char*)&r->l2[j])) &&
+              !(e & (QCOW2_COMPRESSED | QCOW2_ZERO)) && (e & QCOW2_OFFSET) == host + (end - start)) {
+                end += cs;
+                if(end > off + size) end = off + size;
+                j++;
+            }
+            if(!(*r->read)(r->data, buf + (start - off), (uint32_t)(end - start), host)) return -1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Free a reader
+ */
+void qcow2_freereader(qcow2_reader_t *r)
+{
+    if(!r->l2) return;
+    inflateEnd(&r->zs);
+    if(r->zstd) ZSTD_freeDCtx(r->zstd);
+    free(r->l2); free(r->cbuf); free(r->ubuf);
+    r->l2 = NULL;
+}
+
+/**
+ * Free the image
+ */
+void qcow2_close(qcow2_t *q)
+{
+    free(q->l1);
+    q->l1 = NULL;
+}
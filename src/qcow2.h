@@ -0,0 +1,85 @@
+/*
+ * usbimager/qcow2.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief qcow2 virtual disk reader
+ *
+ */
+
+#define QCOW2_MAGIC "QFI\xfb"
+#define QCOW2_HEADER 112        /* bytes needed to parse the header */
+
+/* the image */
+typedef struct {
+    uint64_t size;              /* of the virtual disk */
+    uint64_t fileSize;          /* of the image file */
+    int clusterBits;
+    int zstd;                   /* compressed clusters use zstd instead of deflate */
+    uint32_t l1Size;
+    uint64_t *l1;               /* offsets of the L2 tables */
+} qcow2_t;
+
+/* reads size bytes at offset from the image file, returns 1 on success */
+typedef int (*qcow2_read_t)(void *data, void *buf, uint32_t size, uint64_t offset);
+
+/* one reader per thread */
+typedef struct {
+    qcow2_t *q;
+    qcow2_read_t read;
+    void *data;
+    uint64_t *l2;               /* entries of an L2 table for the range being filled */
+    uint32_t l2Size;
+    unsigned char *cbuf;        /* compressed cluster */
+    unsigned char *ubuf;        /* and decompressed */
+    uint64_t ucl;               /* cluster in ubuf, plus one */
+    z_stream zs;
+    ZSTD_DCtx *zstd;
+} qcow2_reader_t;
+
+/**
+ * Parse the header and load the L1 table. Returns 0 on success, 4 if it's corrupt or
+ * uses something we don't support (backing files, encryption, extended L2 entries)
+ */
+int qcow2_open(qcow2_t *q, const unsigned char *hdr, uint64_t fs, qcow2_read_t read, void *data);
+
+/**
+ * Allocate a reader for ranges of at most maxSize bytes. Returns 0 on success
+ */
+int qcow2_reader(qcow2_reader_t *r, qcow2_t *q, qcow2_read_t read, void *data, int maxSize);
+
+/**
+ * Read a range of the virtual disk into buf, unallocated clusters read as zeros. With buf NULL,
+ * just check if there's data. Returns 1 if the range has data, 0 if it's a hole, -1 on error
+ */
+int qcow2_fill(qcow2_reader_t *r, uint64_t off, unsigned char *buf, int size);
+
+/**
+ * Free a reader
+ */
+void qcow2_freereader(qcow2_reader_t *r);
+
+/**
+ * Free the image
+ */
+void qcow2_close(qcow2_t *q);
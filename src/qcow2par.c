@@ -0,0 +1,236 @@
+/*
+ * usbimager/qcow2par.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel qcow2 reading
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lang.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "qcow2par.h"
+
+#define QCOW2PAR_MAXJOBS 1024
+
+enum { QCOW2PAR_FREE, QCOW2PAR_BUSY, QCOW2PAR_DONE, QCOW2PAR_FAIL };
+
+/* a range of the virtual disk */
+typedef struct {
+    char *data;         /* NULL for a hole */
+    int size;
+    int pos;            /* how much of it has been output */
+    int state;
+} qcow2par_job_t;
+
+typedef struct {
+    stream_t *ctx;
+    int fd, job;
+    int quit, alive;
+    pthread_t thread[QCOW2PAR_MAXTHREADS];
+    qcow2_reader_t reader[QCOW2PAR_MAXTHREADS];
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    qcow2par_job_t jobs[QCOW2PAR_MAXJOBS];
+    uint64_t num, next, cur;    /* number of ranges, taken by the workers, and output */
+    uint64_t mem;               /* data waiting in jobs */
+} qcow2par_t;
+
+static qcow2par_t qcow2par;
+
+/**
+ * Read callback for the readers
+ */
+static int qcow2par_pread(void *data, void *buf, uint32_t size, uint64_t offset)
+{
+    qcow2par_t *g = (qcow2par_t*)data;
+    return pread(g->fd, buf, size, (off_t)offset) == (ssize_t)size;
+}
+
+/**
+ * Read a range. Returns 1 on success
+ */
+static int qcow2par_range(qcow2par_t *g, qcow2_reader_t *r, uint64_t n, qcow2par_job_t *j)
+{
+    uint64_t off = n * g->job;
+    int ret;
+
+    j->size = g->ctx->fileSize - off < (uint64_t)g->job ? (int)(g->ctx->fileSize - off) : g->job;
+    /* look at the L2 entries first, so that holes don't need any memory */
+    if((ret = qcow2_fill(r, off, NULL, j->size)) < 1) return !ret;
+    if(!(j->data = (char*)malloc(j->size))) return 0;
+    ret = qcow2_fill(r, off, (unsigned char*)j->data, j->size);
+    if(verbose > 1) printf("qcow2par_range() offset %" PRIu64 " size %d ret %d\r\n", off, j->size, ret);
+    return ret >= 0;
+}
+
+/**
+ * Worker thread, reads the ranges in order, but no more than what fits in memory
+ */
+static void *qcow2par_worker(void *data)
+{
+    qcow2_reader_t *r = (qcow2_reader_t*)data;
+    qcow2par_t *g = &qcow2par;
+    qcow2par_job_t *j;
+    uint64_t n;
+    int ok;
+
+    pthread_mutex_lock(&g->mutex);
+    while(!g->quit) {
+        if(g->next >= g->num || g->next - g->cur >= QCOW2PAR_MAXJOBS || g->mem >= QCOW2PAR_MAXMEM) {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+        n = g->next++;
+        j = &g->jobs[n % QCOW2PAR_MAXJOBS];
+        j->state = QCOW2PAR_BUSY;
+        pthread_mutex_unlock(&g->mutex);
+        ok = qcow2par_range(g, r, n, j);
+        pthread_mutex_lock(&g->mutex);
+        j->state = ok ? QCOW2PAR_DONE : QCOW2PAR_FAIL;
+        if(j->data) g->mem += j->size;
+        pthread_cond_broadcast(&g->cond);
+    }
+    g->alive--;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    return NULL;
+}
+
+/**
+ * Output hook for stream_read(), fills the buffer unless we're at the end
+ */
+static int qcow2par_output(void *data, char *buf, int size)
+{
+    qcow2par_t *g = (qcow2par_t*)data;
+    qcow2par_job_t *j;
+    int n, ret = 0, hole = 1;
+
+    while(ret < size) {
+        pthread_mutex_lock(&g->mutex);
+        j = &g->jobs[g->cur % QCOW2PAR_MAXJOBS];
+        while(g->alive && g->cur < g->num && j->state != QCOW2PAR_DONE && j->state != QCOW2PAR_FAIL)
+            pthread_cond_wait(&g->cond, &g->mutex);
+        n = g->cur >= g->num ? 0 : j->state == QCOW2PAR_DONE ? 1 : -1;
+        pthread_mutex_unlock(&g->mutex);
+        if(n < 1) {
+            if(n < 0) return -1;
+            break;
+        }
+        n = j->size - j->pos < size - ret ? j->size - j->pos : size - ret;
+        if(j->data) {
+            memcpy(buf + ret, j->data + j->pos, n);
+            hole = 0;
+        } else
+            memset(buf + ret, 0, n);
+        j->pos += n;
+        ret += n;
+        if(j->pos >= j->size) {
+            pthread_mutex_lock(&g->mutex);
+            if(j->data) g->mem -= j->size;
+            free(j->data);
+            memset(j, 0, sizeof(qcow2par_job_t));
+            g->cur++;
+            pthread_cond_broadcast(&g->cond);
+            pthread_mutex_unlock(&g->mutex);
+        }
+    }
+    g->ctx->hole = ret && hole;
+    return ret;
+}
+
+/**
+ * Start reading a qcow2 source on all cores
+ */
+int qcow2par_open(stream_t *ctx)
+{
+    qcow2par_t *g = &qcow2par;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if(n < 2 || ctx->type != TYPE_QCOW2 || !ctx->qcow2) return 0;
+    if(n > QCOW2PAR_MAXTHREADS) n = QCOW2PAR_MAXTHREADS;
+    memset(g, 0, sizeof(qcow2par_t));
+    g->ctx = ctx;
+    g->fd = fileno(ctx->f);
+    /* ranges are whole clusters, so that compressed ones are only decoded once */
+    g->job = QCOW2PAR_JOB > (1 << ctx->qcow2->clusterBits) ? QCOW2PAR_JOB : 1 << ctx->qcow2->clusterBits;
+    g->num = (ctx->fileSize + g->job - 1) / g->job;
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    for(i = 0; i < n; i++) {
+        if(qcow2_reader(&g->reader[g->numthreads], ctx->qcow2, qcow2par_pread, g, g->job)) break;
+        if(pthread_create(&g->thread[g->numthreads], NULL, qcow2par_worker, &g->reader[g->numthreads])) {
+            qcow2_freereader(&g->reader[g->numthreads]);
+            break;
+        }
+        g->numthreads++;
+    }
+    if(!g->numthreads) {
+        pthread_cond_destroy(&g->cond);
+        pthread_mutex_destroy(&g->mutex);
+        return 0;
+    }
+    g->alive = g->numthreads;
+    if(verbose) printf("qcow2par_open() threads %d ranges %" PRIu64 "\r\n", g->numthreads, g->num);
+    ctx->output = qcow2par_output;
+    ctx->outputData = g;
+    return 1;
+}
+
+/**
+ * Stop the threads and free everything
+ */
+void qcow2par_close(stream_t *ctx)
+{
+    qcow2par_t *g = &qcow2par;
+    int i;
+
+    if(ctx->outputData != g) return;
+    pthread_mutex_lock(&g->mutex);
+    __atomic_store_n(&g->quit, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    for(i = 0; i < g->numthreads; i++) {
+        pthread_join(g->thread[i], NULL);
+        qcow2_freereader(&g->reader[i]);
+    }
+    for(i = 0; i < QCOW2PAR_MAXJOBS; i++)
+        free(g->jobs[i].data);
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->mutex);
+    ctx->output = NULL;
+    ctx->outputData = NULL;
+}
+
+#endif
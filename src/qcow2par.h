@@ -0,0 +1,44 @@
+/*
+ * usbimager/qcow2par.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel qcow2 reading
+ *
+ */
+
+#define QCOW2PAR_JOB (8*1024*1024)      /* the virtual disk is read in ranges this big */
+#define QCOW2PAR_MAXMEM (256*1024*1024) /* data waiting to be output */
+#define QCOW2PAR_MAXTHREADS 16
+
+/**
+ * Start reading a qcow2 source on all cores. Ranges of the virtual disk are read and their
+ * compressed clusters decoded concurrently, holes take no memory. Sets the stream's output hook,
+ * returns 1 if it did, 0 if stream_read() should be used as usual
+ */
+int qcow2par_open(stream_t *ctx);
+
+/**
+ * Stop the threads and free everything
+ */
+void qcow2par_close(stream_t *ctx);
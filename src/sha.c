@@ -0,0 +1,149 @@
+/*
+ * usbimager/sha.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief SHA-1 and SHA-256 hashes
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "sha.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t sha_k256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * Big endian word of a block
+ */
+static uint32_t sha_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Hash one 64 bytes long block with SHA-1
+ */
+static void sha_block1(uint32_t *h, const uint8_t *p)
+{
+    uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], t;
+    int i;
+
+    for(i = 0; i < 16; i++) w[i] = sha_be32(p + i * 4);
+    for(; i < 80; i++) w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    for(i = 0; i < 80; i++) {
+        t = ROL(a, 5) + e + w[i] + (i < 20 ? ((b & c) | (~b & d)) + 0x5a827999 :
+            i < 40 ? (b ^ c ^ d) + 0x6ed9eba1 : i < 60 ? ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc :
+            (b ^ c ^ d) + 0xca62c1d6);
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/**
+ * Hash one 64 bytes long block with SHA-256
+ */
+static void sha_block256(uint32_t *h, const uint8_t *p)
+{
+    uint32_t w[64], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7], t1, t2;
+    int i;
+
+    for(i = 0; i < 16; i++) w[i] = sha_be32(p + i * 4);
+    for(; i < 64; i++)
+        w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7] +
+            (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    for(i = 0; i < 64; i++) {
+        t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha_k256[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+/**
+ * Start a hash
+ */
+void sha_init(sha_t *s, int sha1)
+{
+    static const uint32_t h1[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    static const uint32_t h256[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    memset(s, 0, sizeof(sha_t));
+    s->sha1 = sha1;
+    if(sha1) memcpy(s->h, h1, sizeof(h1)); else memcpy(s->h, h256, sizeof(h256));
+}
+
+/**
+ * Hash a buffer
+ */
+void sha_update(sha_t *s, const uint8_t *data, size_t len)
+{
+    size_t n = s->len & 63, i;
+
+    s->len += len;
+    if(n) {
+        i = 64 - n < len ? 64 - n : len;
+        memcpy(s->buf + n, data, i);
+        data += i; len -= i;
+        if(n + i < 64) return;
+        if(s->sha1) sha_block1(s->h, s->buf); else sha_block256(s->h, s->buf);
+    }
+    /* whole blocks are hashed right where they are */
+    for(; len >= 64; data += 64, len -= 64)
+        if(s->sha1) sha_block1(s->h, data); else sha_block256(s->h, data);
+    if(len) memcpy(s->buf, data, len);
+}
+
+/**
+ * Get the digest
+ */
+void sha_final(sha_t *s, uint8_t *out)
+{
+    uint64_t bits = s->len << 3;
+    uint8_t pad[72];
+    int i, n = (int)(s->len & 63);
+
+    /* a one bit, zeros and the length in bits, so that it ends on a block boundary */
+    n = n < 56 ? 56 - n : 120 - n;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for(i = 0; i < 8; i++) pad[n + i] = (uint8_t)(bits >> (56 - i * 8));
+    sha_update(s, pad, n + 8);
+    for(i = 0; i < (s->sha1 ? 5 : 8); i++) {
+        out[i * 4] = (uint8_t)(s->h[i] >> 24); out[i * 4 + 1] = (uint8_t)(s->h[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(s->h[i] >> 8); out[i * 4 + 3] = (uint8_t)s->h[i];
+    }
+}
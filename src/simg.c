@@ -0,0 +1,216 @@
+/*
+ * usbimager/simg.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Android sparse image parser
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simg.h"
+
+#define SIMG_RAW        0xCAC1
+#define SIMG_FILL       0xCAC2
+#define SIMG_DONTCARE   0xCAC3
+#define SIMG_CRC32      0xCAC4
+#define SIMG_CHUNK      12      /* size of a chunk header we know */
+#define SIMG_SPARE      16      /* a chunk header and its fill value, which might cross two reads */
+
+/**
+ * Little endian values
+ */
+static uint16_t simg_le16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+static uint32_t simg_le32(const unsigned char *p)
+{
+    return (uint32_t)simg_le16(p) | ((uint32_t)simg_le16(p + 2) << 16);
+}
+
+/**
+ * Parse the header
+ */
+int simg_open(simg_t *s, const unsigned char *hdr, int len, int bufSize)
+{
+    uint32_t hdrSize;
+
+    memset(s, 0, sizeof(simg_t));
+    if(len < SIMG_HEADER || memcmp(hdr, SIMG_MAGIC, 4)) return 1;
+    hdrSize = simg_le16(hdr + 8);
+    s->chunkHdrSize = simg_le16(hdr + 10);
+    s->blkSize = simg_le32(hdr + 12);
+    s->totalBlks = simg_le32(hdr + 16);
+    s->totalChunks = simg_le32(hdr + 20);
+    /* minor versions are backwards compatible */
+    if(simg_le16(hdr + 4) != 1 || hdrSize < SIMG_HEADER || s->chunkHdrSize < SIMG_CHUNK ||
+      !s->blkSize || (s->blkSize & 3)) return 4;
+    s->size = (uint64_t)s->totalBlks * s->blkSize;
+    if(!(s->buf = (unsigned char*)malloc(SIMG_SPARE + bufSize))) return 4;
+    s->bufSize = bufSize;
+    s->pos = s->len = SIMG_SPARE;
+    /* the header is parsed already, the chunks come after that */
+    s->skip = hdrSize;
+    return 0;
+}
+
+/**
+ * Make sure there are at least n bytes of stored data in buf. Returns 1 if there are, 0 at the
+ * end and -1 on error
+ */
+static int simg_need(simg_t *s, simg_read_t read, void *data, int n)
+{
+    int r = s->len - s->pos, ret;
+
+    while(r < n) {
+        /* keep what's left of the previous read in the spare room before the new data */
+        memmove(s->buf + SIMG_SPARE - r, s->buf + s->pos, r);
+        if((ret = (*read)(data, s->buf + SIMG_SPARE)) < 1) return ret;
+        s->pos = SIMG_SPARE - r;
+        s->len = SIMG_SPARE + ret;
+        r += ret;
+    }
+    return 1;
+}
+
+/**
+ * Throw away the extra bytes of headers, those are newer fields that we don't need. Returns 0 on success
+ */
+static int simg_skip(simg_t *s, simg_read_t read, void *data)
+{
+    uint32_t n;
+
+    while(s->skip) {
+        if(simg_need(s, read, data, 1) < 1) return 1;
+        n = (uint32_t)(s->len - s->pos) < s->skip ? (uint32_t)(s->len - s->pos) : s->skip;
+        s->pos += n;
+        s->skip -= n;
+    }
+    return 0;
+}
+
+/**
+ * Parse the next chunk header. Returns 1 if there's one, 0 at the end and -1 on error
+ */
+static int simg_chunk(simg_t *s, simg_read_t read, void *data)
+{
+    unsigned char *p;
+    uint32_t blks, size;
+
+    if(simg_skip(s, read, data)) return -1;
+    if(s->chunk == s->totalChunks)
+        /* there must be no gap at the end */
+        return s->blks == s->totalBlks ? 0 : -1;
+    if(simg_need(s, read, data, SIMG_CHUNK) < 1) return -1;
+    p = s->buf + s->pos;
+    s->type = simg_le16(p);
+    blks = simg_le32(p + 4);
+    size = simg_le32(p + 8);
+    s->total = s->left = (uint64_t)blks * s->blkSize;
+    s->pos += SIMG_CHUNK;
+    s->skip = s->chunkHdrSize - SIMG_CHUNK;
+    s->chunk++;
+    if(blks > s->totalBlks - s->blks || simg_skip(s, read, data)) return -1;
+    s->blks += blks;
+    switch(s->type) {
+        case SIMG_RAW:
+            if(size != s->chunkHdrSize + s->left) return -1;
+        break;
+        case SIMG_FILL:
+        /* the checksum is left to the verification of the target */
+        case SIMG_CRC32:
+            if(size != s->chunkHdrSize + 4 || (s->type == SIMG_CRC32 && blks)) return -1;
+            if(simg_need(s, read, data, 4) < 1) return -1;
+            memcpy(s->fill, s->buf + s->pos, 4);
+            s->pos += 4;
+        break;
+        case SIMG_DONTCARE:
+            if(size != s->chunkHdrSize) return -1;
+        break;
+        default: return -1;
+    }
+    return 1;
+}
+
+/**
+ * Expand the next at most size bytes of the image into buf
+ */
+int simg_read(simg_t *s, simg_read_t read, void *data, char *buf, int size, int align, char *hole)
+{
+    int ret = 0, n, i, k, h;
+
+    *hole = 1;
+    while(ret < size) {
+        if(!s->left) {
+            if((i = simg_chunk(s, read, data)) < 1) {
+                if(i < 0) return -1;
+                break;
+            }
+            continue;
+        }
+        h = s->type == SIMG_DONTCARE || (s->type == SIMG_FILL && !memcmp(s->fill, "\0\0\0", 4));
+        /* holes are better returned in buffers of their own, so that the writer can skip them */
+        if(ret && h != *hole && !(ret & (align - 1))) break;
+        if(!h) *hole = 0;
+        n = s->left < (uint64_t)(size - ret) ? (int)s->left : size - ret;
+        switch(s->type) {
+            case SIMG_RAW:
+                for(k = 0; k < n; k += i) {
+                    if(s->pos == s->len && simg_need(s, read, data, 1) < 1) return -1;
+                    i = s->len - s->pos < n - k ? s->len - s->pos : n - k;
+                    memcpy(buf + ret + k, s->buf + s->pos, i);
+                    s->pos += i;
+                }
+            break;
+            case SIMG_FILL:
+                if(h) { memset(buf + ret, 0, n); break; }
+                /* the pattern starts at the beginning of the chunk */
+                for(i = 0, k = (int)((s->total - s->left) & 3); i < n && i < 4; i++)
+                    buf[ret + i] = (char)s->fill[(k + i) & 3];
+                for(k = 4; k < n; k += i) {
+                    i = n - k < k ? n - k : k;
+                    memcpy(buf + ret + k, buf + ret, i);
+                }
+            break;
+            default:
+                memset(buf + ret, 0, n);
+            break;
+        }
+        s->left -= n;
+        ret += n;
+    }
+    if(!ret) *hole = 0;
+    return ret;
+}
+
+/**
+ * Free the image
+ */
+void simg_close(simg_t *s)
+{
+    free(s->buf);
+    s->buf = NULL;
+}
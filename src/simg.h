@@ -0,0 +1,73 @@
+/*
+ * usbimager/simg.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Android sparse image parser
+ *
+ */
+
+#define SIMG_MAGIC "\x3a\xff\x26\xed"
+#define SIMG_HEADER 28          /* bytes needed to parse the header */
+
+/* the image */
+typedef struct {
+    uint32_t blkSize;
+    uint32_t totalBlks;
+    uint32_t totalChunks;
+    uint32_t chunkHdrSize;
+    uint64_t size;              /* of the expanded image */
+    uint64_t fileSize;          /* of the data the image is stored in, 0 if unknown, kept by the caller */
+    uint64_t readSize;          /* and how much of that has been read */
+    unsigned char *buf;         /* stored data not parsed yet */
+    int bufSize, pos, len;
+    uint32_t skip;              /* bytes to throw away before the next chunk header */
+    uint32_t chunk;             /* chunks parsed so far */
+    uint32_t blks;              /* and the blocks they cover */
+    int type;                   /* of the current chunk */
+    uint64_t left;              /* bytes of it still to be output */
+    uint64_t total;             /* and its whole size */
+    unsigned char fill[4];
+} simg_t;
+
+/* reads the next at most bufSize bytes of stored data into buf, returns the number of bytes, 0 at
+ * the end and -1 on error */
+typedef int (*simg_read_t)(void *data, unsigned char *buf);
+
+/**
+ * Parse the header from the first len bytes of the data. Returns 0 on success, 1 if it's not a
+ * sparse image and 4 if it's corrupt. The stored data is read in bufSize pieces
+ */
+int simg_open(simg_t *s, const unsigned char *hdr, int len, int bufSize);
+
+/**
+ * Expand the next at most size bytes of the image into buf. Zero fills and don't care chunks are
+ * holes; a buffer is ended where a hole begins or ends, if that's a multiple of align. Sets hole
+ * if everything returned was a hole. Returns the number of bytes, 0 at the end and -1 on error
+ */
+int simg_read(simg_t *s, simg_read_t read, void *data, char *buf, int size, int align, char *hole);
+
+/**
+ * Free the image
+ */
+void simg_close(simg_t *s);
@@ -28,19 +28,25 @@
  */
 
 #define _CRT_SECURE_NO_WARNINGS
+#define _GNU_SOURCE             /* for SEEK_DATA and SEEK_HOLE */
 
 #include <time.h>
 #include <errno.h>
 #include <sys/types.h>
 #include "lang.h"
 #include "stream.h"
+#include "crc.h"
 
 #ifdef WINVER
 #include <windows.h>
 #include <io.h>
+#include <malloc.h>
 /*extern int _fileno(FILE *f);*/
 #else
+#include <limits.h>
+#include <unistd.h>
 extern int fileno(FILE *f);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
 #endif
 #if !defined(WINVER) && !defined(MACOSX)
 uint64_t mytell (FILE * stream)
@@ -54,19 +60,74 @@ int myseek (FILE* stream, uint64_t offset)
 { fpos_t pos = (fpos_t)offset; return fsetpos(stream, &pos); }
 #endif
 
+#define STREAM_ALIGN 4096   /* buffer alignment, enough for direct I/O on any sector size */
+
 int verbose = 0;
 int buffer_size = 1024*1024;
 int baud = 115200;
 int force = 0;
+int compare = 0;
+int autotune = 0;
+int queue_depth = 4;
+int cache_window = 64;
+int writeback_window = 32;
 int dstfd = 0;
 
+/**
+ * Allocate a page aligned buffer, suitable for direct I/O
+ */
+void *stream_malloc(int size)
+{
+    void *ptr = NULL;
+#ifdef WINVER
+    ptr = _aligned_malloc(size, STREAM_ALIGN);
+#else
+    if(posix_memalign(&ptr, STREAM_ALIGN, size)) ptr = NULL;
+#endif
+    return ptr;
+}
+
+/**
+ * Free a buffer allocated by stream_malloc()
+ */
+void stream_free(void *ptr)
+{
+#ifdef WINVER
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+/**
+ * Returns true if it's time to refresh the progress, at most once every STREAM_PROGRESSMS
+ */
+int stream_progressdue(void)
+{
+    static uint64_t last = 0;
+    uint64_t now;
+#ifdef WINVER
+    now = GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    if(now - last < STREAM_PROGRESSMS) return 0;
+    last = now;
+    return 1;
+}
+
 /**
  * Returns progress percentage and the status string in str
  */
 int stream_status(stream_t *ctx, char *str, int done)
 {
     time_t t = time(NULL);
-    uint64_t d = 0;
+    /* when pipelined, decompression runs ahead, so report what's on the target. These counters
+     * are updated by the worker, and this might be called from the UI thread */
+    uint64_t d = 0, pos = ctx->pipelined ? __atomic_load_n(&ctx->wrtnSize, __ATOMIC_RELAXED) :
+        __atomic_load_n(&ctx->readSize, __ATOMIC_RELAXED);
     int h,m,s;
 #ifdef WINVER
     wchar_t rem[64];
@@ -75,7 +136,7 @@ int stream_status(stream_t *ctx, char *str, int done)
 #endif
     if(done) {
         memset(str, 0, 2);
-        if(ctx->fileSize && ctx->readSize >= ctx->fileSize
+        if(ctx->fileSize && pos >= ctx->fileSize
 #ifndef WINVER
             && !errno
 #endif
@@ -95,9 +156,9 @@ int stream_status(stream_t *ctx, char *str, int done)
     }
     rem[0] = 0;
     if(ctx->start < t) {
-        if(ctx->readSize) {
+        if(pos) {
             if(ctx->fileSize)
-                d = ctx->readSize / (t - ctx->start);
+                d = pos / (t - ctx->start);
             else
                 d = ctx->cmrdSize / (t - ctx->start);
             ctx->avgSpeedBytes += d;
@@ -106,7 +167,7 @@ int stream_status(stream_t *ctx, char *str, int done)
             if(verbose > 1) printf("  average speed %" PRIu64" bytes / sec\r\n", d);
         }
         if(ctx->avgSpeedNum > 2) {
-            d = d ? (ctx->fileSize ? ctx->fileSize - ctx->readSize : ctx->compSize - ctx->cmrdSize) / d : 0;
+            d = d ? (ctx->fileSize ? ctx->fileSize - pos : ctx->compSize - ctx->cmrdSize) / d : 0;
             h = d / 3600; d %= 3600; m = d / 60; if(h<0 || h>23) h = 0; if(m<0) m = 0;
 #ifdef WINVER
             if(h > 0) wsprintfW(rem, (wchar_t*)lang[h>1 && m>1 ? L_STATHSMS : (h>1 && m<2 ? L_STATHSM :
@@ -124,33 +185,115 @@ int stream_status(stream_t *ctx, char *str, int done)
 #ifdef WINVER
     if(ctx->fileSize)
         wsprintfW((wchar_t*)str, L"%6u %s / %u %s%s%s",
-            (unsigned int)(ctx->readSize >> 20), lang[L_MIB],
+            (unsigned int)(pos >> 20), lang[L_MIB],
             (unsigned int)(ctx->fileSize >> 20), lang[L_MIB], rem[0] ? L", " : L"", rem);
     else
         wsprintfW((wchar_t*)str, L"%6u %s %s%s%s",
-            (unsigned int)(ctx->readSize >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? L", " : L"", rem);
+            (unsigned int)(pos >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? L", " : L"", rem);
 #else
     if(ctx->fileSize)
         sprintf(str, "%6" PRIu64 " %s / %" PRIu64 " %s%s%s",
-            (ctx->readSize >> 20), lang[L_MIB],
+            (pos >> 20), lang[L_MIB],
             (ctx->fileSize >> 20), lang[L_MIB], rem[0] ? ", " : "", rem);
     else
         sprintf(str, "%6" PRIu64 " %s %s%s%s",
-            (ctx->readSize >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? ", " : "", rem);
+            (pos >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? ", " : "", rem);
 #endif
-    d = ctx->fileSize ? (ctx->readSize * 1000) / (ctx->fileSize * 10) :
+    d = ctx->fileSize ? (pos * 1000) / (ctx->fileSize * 10) :
         (ctx->cmrdSize * 1000) / (ctx->compSize * 10 + 1);
-    /* readSize can be greater than fileSize because it's rounded up to 512 bytes */
+    /* readSize can be greater than fileSize because it's rounded up to sector size */
     return d > 100 ? 100 : d;
 }
 
+/**
+ * Read callback for random access formats
+ */
+static int stream_pread(void *data, void *buf, uint32_t size, uint64_t offset)
+{
+    stream_t *ctx = (stream_t*)data;
+    return !myseek(ctx->f, offset) && fread(buf, size, 1, ctx->f);
+}
+
+/**
+ * Returns the offset of the first frame that's not a skippable one, zstd and lz4 both have these
+ */
+static int stream_skippable(uint8_t *hdr, int len)
+{
+    int x = 0;
+
+    while(x + 8 <= len && (hdr[x] & 0xF0) == 0x50 && hdr[x + 1] == 0x2A && hdr[x + 2] == 0x4D && hdr[x + 3] == 0x18 &&
+      !hdr[x + 6] && !hdr[x + 7])
+        x += 8 + hdr[x + 4] + (hdr[x + 5] << 8);
+    return x + 4 <= len ? x : 0;
+}
+
+/**
+ * Look for a block map next to the source, the way bmaptool does: image.img.xz.bmap, image.img.bmap
+ * and image.bmap. It's only used if it's for an image of the right size
+ */
+static void stream_bmapopen(stream_t *ctx, wchar_t *fn)
+{
+    FILE *f = NULL;
+#ifdef WINVER
+    wchar_t tmp[MAX_PATH + 8], *e;
+
+    if(wcslen(fn) > MAX_PATH) return;
+    wcscpy(tmp, fn);
+    for(e = tmp + wcslen(tmp); !f && e > tmp && e[-1] != L'\\' && e[-1] != L'/'; e--)
+        if(!*e || *e == L'.') { wcscpy(e, L".bmap"); f = _wfopen(tmp, L"rb"); }
+#else
+    char tmp[PATH_MAX + 8], *e;
+
+    if(strlen((char*)fn) > PATH_MAX) return;
+    strcpy(tmp, (char*)fn);
+    for(e = tmp + strlen(tmp); !f && e > tmp && e[-1] != '/'; e--)
+        if(!*e || *e == '.') { strcpy(e, ".bmap"); f = fopen(tmp, "rb"); }
+#endif
+    if(!f) return;
+    if((ctx->bmap = (bmap_t*)malloc(sizeof(bmap_t)))) {
+        /* raw images must be just as big as the map says, compressed ones are checked in the end */
+        if(bmap_load(ctx->bmap, f) || (!ctx->multi && ctx->fileSize != ctx->bmap->size)) {
+            bmap_free(ctx->bmap);
+            free(ctx->bmap);
+            ctx->bmap = NULL;
+        } else {
+            ctx->fileSize = ctx->bmap->size;
+            ctx->sparse = 1;
+        }
+    }
+    if(verbose) printf(" bmap %s block size %u ranges %d mapped %" PRIu64 "\r\n", ctx->bmap ? "found" : "ignored",
+        ctx->bmap ? ctx->bmap->blkSize : 0, ctx->bmap ? ctx->bmap->numRange : 0, ctx->bmap ? ctx->bmap->mapped : 0);
+    fclose(f);
+}
+
+/**
+ * Raw images with holes in them (as the filesystem stores them) are read by skipping those, and the
+ * target is zeroed out instead of writing them
+ */
+static void stream_holeopen(stream_t *ctx)
+{
+#ifdef SEEK_HOLE
+    off_t hole = lseek(fileno(ctx->f), 0, SEEK_HOLE);
+
+    /* the file's end is an implicit hole, so there's only a real one before that */
+    if(hole >= 0 && (uint64_t)hole < ctx->fileSize) ctx->sparse = 1;
+    myseek(ctx->f, 0L);
+    if(verbose) printf(" first hole at %" PRId64 "%s\r\n", (int64_t)hole, ctx->sparse ? " sparse file" : "");
+#else
+    (void)ctx;
+#endif
+}
+
+static int stream_simgopen(stream_t *ctx);
+
 /**
  * Open file and determine the source's format
  */
 int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
 {
-    static uint8_t hdr[65536], *buff;
+    static uint8_t hdr[65536];
     uint64_t fs = 0;
+    lz4_frame_t fh;
     int x, y;
 #ifndef WINVER
     struct stat st;
@@ -159,6 +302,8 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
     errno = 0;
     memset(ctx, 0, sizeof(stream_t));
     if(!fn || !*fn) return 1;
+    /* gzip, zip and xz checks use these */
+    crc_init();
 
     if(verbose) printf("stream_open(%S)\r\n", fn);
 
@@ -167,17 +312,10 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
         main_getErrorMessage();
         return 1;
     }
-    ctx->verifyBuf = (char*)malloc(buffer_size);
-    if(!ctx->verifyBuf) {
-        main_getErrorMessage();
-        free(ctx->compBuf); ctx->compBuf = NULL;
-        return 1;
-    }
-    ctx->buffer = (char*)malloc(buffer_size);
+    ctx->buffer = (char*)stream_malloc(buffer_size);
     if(!ctx->buffer) {
         main_getErrorMessage();
         free(ctx->compBuf); ctx->compBuf = NULL;
-        free(ctx->verifyBuf); ctx->verifyBuf = NULL;
         return 1;
     }
 #ifdef WINVER
@@ -201,24 +339,21 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
     if(hdr[0] == 0x1f && hdr[1] == 0x8b) {
         /* gzip */
         if(verbose) printf(" gzip\r\n");
+        /* the trailer only has the size of the last member, modulo 4G, so this is just a hint */
         myseek(ctx->f, fs - 4L);
         if(!fread(&ctx->fileSize, 4, 1, ctx->f))
             ctx->fileSize = 0;
-        ctx->compSize = fs - 8;
-        buff = hdr + 3;
-        x = *buff++; buff += 6;
-        if(x & 4) { y = *buff++; y += (*buff++ << 8); buff += y; }
-        if(x & 8) { while(*buff++ != 0); }
-        if(x & 16) { while(*buff++ != 0); }
-        if(x & 2) buff += 2;
-        ctx->compSize -= (uint64_t)(buff - hdr);
-        myseek(ctx->f, (uint64_t)(buff - hdr));
+        /* zlib parses the headers and checks the trailers, because there might be more members */
+        ctx->compSize = fs;
+        ctx->multi = 1;
+        myseek(ctx->f, 0L);
         ctx->type = TYPE_DEFLATE;
     } else
     if(hdr[0] == 'B' && hdr[1] == 'Z' && hdr[2] == 'h') {
         /* bzip2 */
         if(verbose) printf(" bzip2\r\n");
         ctx->compSize = fs;
+        ctx->multi = 1;
         myseek(ctx->f, 0L);
         ctx->type = TYPE_BZIP2;
     } else
@@ -226,6 +361,7 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
         /* xz */
         if(verbose) printf(" xz\r\n");
         ctx->compSize = fs;
+        ctx->multi = 1;
         myseek(ctx->f, 0L);
         ctx->type = TYPE_XZ;
     } else
@@ -242,6 +378,11 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
             case 12: ctx->type = TYPE_BZIP2; break;
             default: fclose(ctx->f); return 3;
         }
+        /* with a data descriptor, the CRC isn't in the local header */
+        if(!(hdr[6] & 8)) {
+            memcpy(&ctx->crcExpect, hdr + 14, 4);
+            ctx->hasCrc = 1;
+        }
         if(memcmp(hdr + 18, "\xff\xff\xff\xff\xff\xff\xff\xff", 8)) {
             memcpy(&ctx->compSize, hdr + 18, 4);
             memcpy(&ctx->fileSize, hdr + 22, 4);
@@ -259,14 +400,37 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
         }
         myseek(ctx->f, (uint64_t)(30 + hdr[26] + (hdr[27]<<8) + hdr[28] + (hdr[29]<<8)));
     } else
-    if(hdr[0] == 0x28 && hdr[1] == 0xB5 && hdr[2] == 0x2F && hdr[3] == 0xFD) {
+    if(!memcmp(hdr + stream_skippable(hdr, sizeof(hdr)), "\x04\x22\x4D\x18", 4)) {
+        /* lz4 */
+        if(verbose) printf(" lz4\r\n");
+        x = stream_skippable(hdr, sizeof(hdr));
+        ctx->compSize = fs;
+        /* more frames might follow, so this is just a hint */
+        if(lz4_header(hdr + x, sizeof(hdr) - x, &fh) > 0 && fh.hasSize) ctx->fileSize = fh.contentSize;
+        ctx->multi = 1;
+        myseek(ctx->f, 0L);
+        ctx->type = TYPE_LZ4;
+    } else
+    if((hdr[0] == 0x28 && hdr[1] == 0xB5 && hdr[2] == 0x2F && hdr[3] == 0xFD) ||
+      /* pzstd starts with a skippable frame */
+      ((hdr[0] & 0xF0) == 0x50 && hdr[1] == 0x2A && hdr[2] == 0x4D && hdr[3] == 0x18)) {
         /* zstandard */
         if(verbose) printf(" zstd\r\n");
         ctx->compSize = fs;
-        ctx->fileSize = (size_t)ZSTD_getFrameContentSize(hdr, sizeof(hdr));
+        /* more frames might follow, so this is just a hint */
+        ctx->fileSize = ZSTD_getFrameContentSize(hdr, sizeof(hdr));
+        if(ctx->fileSize >= ZSTD_CONTENTSIZE_ERROR) ctx->fileSize = 0;
+        ctx->multi = 1;
         myseek(ctx->f, 0L);
         ctx->type = TYPE_ZSTD;
     } else
+    if(!memcmp(hdr, QCOW2_MAGIC, 4)) {
+        /* qcow2 virtual disk, only the allocated clusters are read */
+        if(verbose) printf(" qcow2\r\n");
+        ctx->compSize = fs;
+        ctx->sparse = 1;
+        ctx->type = TYPE_QCOW2;
+    } else
     if(hdr[0] == '7' && hdr[1] == 'z' && hdr[2] == 0xBC && hdr[3] == 0xAF) {
         /* 7zip */
         if(verbose) printf(" 7z (deliberately not supported, use xz instead)\r\n");
@@ -283,7 +447,7 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
     }
     switch(ctx->type) {
         case TYPE_DEFLATE:
-            x = inflateInit2(&ctx->zstrm, -MAX_WBITS);
+            x = inflateInit2(&ctx->zstrm, ctx->multi ? 16 + MAX_WBITS : -MAX_WBITS);
             if (x != Z_OK) { fclose(ctx->f); return 4; }
         break;
         case TYPE_BZIP2:
@@ -291,8 +455,6 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
             if (x != BZ_OK) { fclose(ctx->f); return 4; }
         break;
         case TYPE_XZ:
-            xz_crc32_init();
-            xz_crc64_init();
             ctx->xz = xz_dec_init(XZ_DYNALLOC, 1 << 26);
             if (!ctx->xz) { fclose(ctx->f); return 4; }
         break;
@@ -300,33 +462,71 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr)
             ctx->zstd = ZSTD_createDCtx();
             if (!ctx->zstd) { fclose(ctx->f); return 4; }
         break;
+        case TYPE_LZ4:
+            ctx->lz4 = lz4_dec_init();
+            if (!ctx->lz4) { fclose(ctx->f); return 4; }
+        break;
+        case TYPE_QCOW2:
+            ctx->qcow2 = (qcow2_t*)malloc(sizeof(qcow2_t));
+            ctx->qr = (qcow2_reader_t*)malloc(sizeof(qcow2_reader_t));
+            if (!ctx->qcow2 || !ctx->qr) { free(ctx->qcow2); free(ctx->qr); ctx->qcow2 = NULL; ctx->qr = NULL; fclose(ctx->f); return 4; }
+            x = qcow2_open(ctx->qcow2, hdr, fs, stream_pread, ctx);
+            if (!x && qcow2_reader(ctx->qr, ctx->qcow2, stream_pread, ctx, buffer_size)) { qcow2_close(ctx->qcow2); x = 4; }
+            if (x) { free(ctx->qcow2); free(ctx->qr); ctx->qcow2 = NULL; ctx->qr = NULL; fclose(ctx->f); return x; }
+            ctx->fileSize = ctx->qcow2->size;
+            if(verbose) printf(" qcow2 cluster size %d L1 entries %u%s\r\n", 1 << ctx->qcow2->clusterBits,
+                ctx->qcow2->l1Size, ctx->qcow2->zstd ? " zstd" : "");
+        break;
     }
     if(verbose) printf(" type %d compSize %" PRIu64 " fileSize %" PRIu64
         " data offset %" PRIu64 "\r\n",
         ctx->type, ctx->compSize, ctx->fileSize, mytell(ctx->f));
     if(!ctx->compSize && !ctx->fileSize) { fclose(ctx->f); return 1; }
+    /* an Android sparse image might be stored in any of the formats above */
+    if(!uncompr && ctx->type != TYPE_QCOW2 && (x = stream_simgopen(ctx))) { fclose(ctx->f); return x; }
+    /* a block map next to a raw image tells which parts of it are worth writing */
+    if(!uncompr && ctx->type != TYPE_QCOW2 && !ctx->simg) stream_bmapopen(ctx, fn);
+    /* stored zip entries are not at the start of the file, and their CRC needs all the data anyway */
+    if(ctx->type == TYPE_PLAIN && !ctx->simg && !ctx->bmap && !ctx->hasCrc && !mytell(ctx->f)) stream_holeopen(ctx);
 
+    ctx->secSize = 512;
     ctx->start = time(NULL);
     return 0;
 }
 
 /**
- * Read no more than buffer_size uncompressed bytes of source data
+ * Read compressed input, either directly or from the prefetch stage
  */
-int stream_read(stream_t *ctx)
+static int stream_fread(stream_t *ctx, int64_t insiz)
+{
+    if(ctx->input)
+        return (*ctx->input)(ctx->inputData, ctx->compBuf, (int)insiz);
+    return (int)fread(ctx->compBuf, insiz, 1, ctx->f);
+}
+
+/**
+ * Decompress no more than buffer_size bytes into ctx->buffer. For sparse images that's the data the
+ * image is stored in, so the sizes are passed, those of the image are not the ones to use here
+ */
+static int64_t stream_decode(stream_t *ctx, uint64_t *fileSize, uint64_t readSize)
 {
     int ret = 0;
     int64_t size = 0, insiz;
 
-    errno = 0;
-    size = ctx->fileSize - ctx->readSize;
-    if(size < 1) { if(ctx->fileSize) return 0; size = 0; }
+    if(ctx->multi) size = buffer_size; else {
+        size = *fileSize - readSize;
+        if(size < 1) { if(*fileSize) return 0; size = 0; }
+    }
     if(size > buffer_size) size = buffer_size;
     if(verbose > 1)
         printf("stream_read() readSize %" PRIu64 " / fileSize %" PRIu64 " (input size %"
             PRId64 "), cmrdSize %" PRIu64 " / compSize %" PRIu64 "u\r\n",
-            ctx->readSize, ctx->fileSize, size, ctx->cmrdSize, ctx->compSize);
+            readSize, *fileSize, size, ctx->cmrdSize, ctx->compSize);
 
+    /* some formats are decompressed on several threads, they just give us the output in order */
+    if(ctx->output) {
+        if((size = (*ctx->output)(ctx->outputData, ctx->buffer, (int)size)) < 0) return -1;
+    } else
     switch(ctx->type) {
         case TYPE_PLAIN:
             if(!fread(ctx->buffer, size, 1, ctx->f)) {}
@@ -337,21 +537,33 @@ int stream_read(stream_t *ctx)
             do {
                 if(!ctx->zstrm.avail_in) {
                     insiz = ctx->compSize - ctx->cmrdSize;
-                    if(insiz < 1) { ret = Z_STREAM_END; break; }
+                    /* the input must not end in the middle of a member, its trailer has the CRC */
+                    if(insiz < 1) { ret = ctx->multi == 2 ? Z_STREAM_END : Z_DATA_ERROR; break; }
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose) printf("  deflate cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
                     ctx->zstrm.next_in = ctx->compBuf;
                     ctx->zstrm.avail_in = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
+                    if(!stream_fread(ctx, insiz)) break;
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
+                /* a new gzip member might follow the previous one, but ignore trailing garbage */
+                if(ctx->multi == 2) {
+                    if(ctx->zstrm.next_in[0] != 0x1f) { ret = Z_STREAM_END; break; }
+                    inflateReset(&ctx->zstrm);
+                    ctx->multi = 1;
+                    /* the trailer's size was only that of the last member */
+                    *fileSize = 0;
+                }
                 ret = inflate(&ctx->zstrm, Z_NO_FLUSH);
+                /* remember it, the output might be full right at the end of a member */
+                if(ret == Z_STREAM_END && ctx->multi) { ctx->multi = 2; ret = Z_OK; }
             } while(ret == Z_OK && ctx->zstrm.avail_out > 0);
             if(ret != Z_OK && ret != Z_STREAM_END) {
                 if(verbose) printf("  zlib inflate error %d\r\n", ret);
                 return -1;
             }
+            if(ctx->multi) size -= ctx->zstrm.avail_out;
         break;
         case TYPE_BZIP2:
             ctx->bstrm.next_out = ctx->buffer;
@@ -359,16 +571,30 @@ int stream_read(stream_t *ctx)
             do {
                 if(!ctx->bstrm.avail_in) {
                     insiz = ctx->compSize - ctx->cmrdSize;
-                    if(insiz < 1) { ret = BZ_STREAM_END; break; }
+                    /* the input must not end in the middle of a stream */
+                    if(insiz < 1) { ret = ctx->multi == 2 ? BZ_STREAM_END : BZ_DATA_ERROR; break; }
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose > 1) printf("  bzip2 cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
                     ctx->bstrm.next_in = (char*)ctx->compBuf;
                     ctx->bstrm.avail_in = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
+                    if(!stream_fread(ctx, insiz)) break;
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
                 ret = BZ2_bzDecompress(&ctx->bstrm);
+                if(ret == BZ_OK && ctx->multi) ctx->multi = 1;
+                /* pbzip2 and friends concatenate streams, so start a new one. A zip entry is just one */
+                if(ret == BZ_STREAM_END && ctx->multi) {
+                    BZ2_bzDecompressEnd(&ctx->bstrm);
+                    ret = BZ2_bzDecompressInit(&ctx->bstrm, 0, 0);
+                    ctx->multi = 2;
+                } else
+                /* but the magic can't be wrong for the first one, that's trailing garbage */
+                if(ret == BZ_DATA_ERROR_MAGIC && ctx->multi == 2) {
+                    ctx->bstrm.avail_in = 0;
+                    ctx->cmrdSize = ctx->compSize;
+                    ret = BZ_STREAM_END;
+                }
             } while(ret == BZ_OK && ctx->bstrm.avail_out > 0);
             if(ret != BZ_OK && ret != BZ_STREAM_END) {
                 if(verbose) printf("  bzip2 decompress error %d\r\n", ret);
@@ -383,20 +609,31 @@ int stream_read(stream_t *ctx)
             do {
                 if(ctx->xstrm.in_pos == ctx->xstrm.in_size) {
                     insiz = ctx->compSize - ctx->cmrdSize;
-                    if(insiz < 1) { ret = XZ_STREAM_END; break; }
+                    /* the input must not end in the middle of a stream */
+                    if(insiz < 1) { ret = ctx->multi == 2 ? XZ_STREAM_END : XZ_DATA_ERROR; break; }
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose > 1) printf("  xz cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
                     ctx->xstrm.in = (unsigned char*)ctx->compBuf;
                     ctx->xstrm.in_pos = 0;
                     ctx->xstrm.in_size = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
+                    if(!stream_fread(ctx, insiz)) break;
                     if(insiz < buffer_size)
                         memset(ctx->compBuf + insiz, 0, buffer_size - insiz);
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
+                /* more streams might follow, after some zero padding */
+                if(ctx->multi == 2) {
+                    while(ctx->xstrm.in_pos < ctx->xstrm.in_size && !ctx->xstrm.in[ctx->xstrm.in_pos])
+                        ctx->xstrm.in_pos++;
+                    if(ctx->xstrm.in_pos == ctx->xstrm.in_size) continue;
+                    xz_dec_reset(ctx->xz);
+                    ctx->multi = 1;
+                }
                 ret = xz_dec_run(ctx->xz, &ctx->xstrm);
                 if(ret == XZ_UNSUPPORTED_CHECK) ret = XZ_OK;
+                /* remember it, the output might be full right at the end of a stream */
+                if(ret == XZ_STREAM_END) { ctx->multi = 2; ret = XZ_OK; }
             } while(ret == XZ_OK && ctx->xstrm.out_pos < ctx->xstrm.out_size);
             if(ret != XZ_OK && ret != XZ_STREAM_END) {
                 if(verbose) printf("  xz decompress error %d\r\n", ret);
@@ -411,17 +648,19 @@ int stream_read(stream_t *ctx)
             do {
                 if(ctx->zi.pos == ctx->zi.size) {
                     insiz = ctx->compSize - ctx->cmrdSize;
-                    if(insiz < 1) { ret = 0; break; }
+                    /* the input must not end in the middle of a frame */
+                    if(insiz < 1) { ret = ctx->multi == 2 ? 0 : -1; break; }
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose > 1) printf("  zstd cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
                     ctx->zi.src = ctx->compBuf;
                     ctx->zi.pos = 0;
                     ctx->zi.size = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
+                    if(!stream_fread(ctx, insiz)) break;
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
                 ret = (int) ZSTD_decompressStream(ctx->zstd, &ctx->zo, &ctx->zi);
+                if(!ZSTD_isError(ret)) ctx->multi = ret ? 1 : 2;
             } while(!ZSTD_isError(ret) && ctx->zo.pos < ctx->zo.size);
             if(ZSTD_isError(ret)) {
                 if(verbose) printf("  xstd decompress error %d\r\n", ret);
@@ -429,13 +668,273 @@ int stream_read(stream_t *ctx)
             }
             size = ctx->zo.pos;
         break;
+        case TYPE_QCOW2:
+            if((ret = qcow2_fill(ctx->qr, readSize, (unsigned char*)ctx->buffer, (int)size)) < 0) {
+                if(verbose) printf("  qcow2 read error\r\n");
+                return -1;
+            }
+            ctx->hole = !ret;
+        break;
+        case TYPE_LZ4:
+            ctx->lstrm.out = (unsigned char*)ctx->buffer;
+            ctx->lstrm.out_pos = 0;
+            ctx->lstrm.out_size = buffer_size;
+            do {
+                if(ctx->lstrm.in_pos == ctx->lstrm.in_size) {
+                    insiz = ctx->compSize - ctx->cmrdSize;
+                    /* the input must not end in the middle of a frame */
+                    if(insiz < 1) { ret = ctx->multi == 2 ? LZ4_STREAM_END : LZ4_DATA_ERROR; break; }
+                    if(insiz > buffer_size) insiz = buffer_size;
+                    if(verbose > 1) printf("  lz4 cmrdSize %" PRIu64
+                        " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
+                    ctx->lstrm.in = ctx->compBuf;
+                    ctx->lstrm.in_pos = 0;
+                    ctx->lstrm.in_size = insiz;
+                    if(!stream_fread(ctx, insiz)) break;
+                    ctx->cmrdSize += (uint64_t)insiz;
+                }
+                ctx->multi = 1;
+                ret = lz4_dec_run(ctx->lz4, &ctx->lstrm);
+                /* remember it, the output might be full right at the end of a frame */
+                if(ret == LZ4_STREAM_END) { ctx->multi = 2; ret = LZ4_OK; }
+            } while(ret == LZ4_OK && ctx->lstrm.out_pos < ctx->lstrm.out_size);
+            if(ret != LZ4_OK && ret != LZ4_STREAM_END) {
+                if(verbose) printf("  lz4 decompress error %d\r\n", ret);
+                return -1;
+            }
+            size = ctx->lstrm.out_pos;
+        break;
+    }
+    return size;
+}
+
+/**
+ * Add data to the CRC being checked, leaving out the padding after the first fileSize bytes
+ */
+static void stream_crcadd(stream_t *ctx, unsigned char *buf, int size, uint64_t fileSize)
+{
+    if(!ctx->hasCrc || ctx->crcSize >= fileSize) return;
+    if((uint64_t)size > fileSize - ctx->crcSize) size = (int)(fileSize - ctx->crcSize);
+    ctx->crcSum = crc_crc32(ctx->crcSum, buf, size);
+    ctx->crcSize += size;
+}
+
+/**
+ * Input callback of the sparse image parser, decodes the data the image is stored in
+ */
+static int stream_simgread(void *data, unsigned char *buf)
+{
+    stream_t *ctx = (stream_t*)data;
+    simg_t *s = ctx->simg;
+    char *orig = ctx->buffer;
+    int64_t size;
+
+    ctx->buffer = (char*)buf;
+    size = stream_decode(ctx, &s->fileSize, s->readSize);
+    ctx->buffer = orig;
+    if(size > 0) {
+        s->readSize += (uint64_t)size;
+        /* the CRC of zip entries and gzip members is that of the stored data, not what it expands to */
+        stream_crcadd(ctx, buf, (int)size, s->fileSize);
+    }
+    return (int)size;
+}
+
+/**
+ * Start decoding the source again from the beginning
+ */
+static void stream_rewind(stream_t *ctx, uint64_t offs, char multi)
+{
+    myseek(ctx->f, offs);
+    ctx->cmrdSize = 0;
+    ctx->multi = multi;
+    switch(ctx->type) {
+        case TYPE_DEFLATE: inflateReset(&ctx->zstrm); ctx->zstrm.avail_in = 0; break;
+        case TYPE_BZIP2:
+            BZ2_bzDecompressEnd(&ctx->bstrm);
+            BZ2_bzDecompressInit(&ctx->bstrm, 0, 0);
+            ctx->bstrm.avail_in = 0;
+        break;
+        case TYPE_XZ: xz_dec_reset(ctx->xz); ctx->xstrm.in_pos = ctx->xstrm.in_size = 0; break;
+        case TYPE_ZSTD: ZSTD_DCtx_reset(ctx->zstd, ZSTD_reset_session_only); ctx->zi.pos = ctx->zi.size = 0; break;
+        case TYPE_LZ4: lz4_dec_reset(ctx->lz4); ctx->lstrm.in_pos = ctx->lstrm.in_size = 0; break;
+    }
+}
+
+/**
+ * Look for an Android sparse image in the first buffer of data, and rewind. Returns 0 on success
+ */
+static int stream_simgopen(stream_t *ctx)
+{
+    uint64_t offs = mytell(ctx->f), fileSize = ctx->fileSize;
+    char multi = ctx->multi;
+    int64_t size;
+
+    size = stream_decode(ctx, &fileSize, 0);
+    stream_rewind(ctx, offs, multi);
+    if(size < SIMG_HEADER || memcmp(ctx->buffer, SIMG_MAGIC, 4)) return 0;
+    if(!(ctx->simg = (simg_t*)malloc(sizeof(simg_t)))) return 4;
+    if(simg_open(ctx->simg, (unsigned char*)ctx->buffer, (int)size, buffer_size)) {
+        free(ctx->simg); ctx->simg = NULL;
+        return 4;
+    }
+    if(verbose) printf(" sparse image block size %u blocks %u chunks %u\r\n", ctx->simg->blkSize,
+        ctx->simg->totalBlks, ctx->simg->totalChunks);
+    /* from now on the sizes are those of the expanded image */
+    ctx->simg->fileSize = ctx->fileSize;
+    ctx->fileSize = ctx->simg->size;
+    ctx->sparse = 1;
+    return 0;
+}
+
+/**
+ * Read the source with a block map. What's not mapped is not needed, so those parts are zeros and
+ * holes; raw images aren't even read there
+ */
+static int64_t stream_bmapread(stream_t *ctx)
+{
+    uint64_t len;
+    int64_t size, pos, n;
+    int mapped;
+    char hole = 1;
+
+    if(ctx->type == TYPE_PLAIN) {
+        size = ctx->fileSize - ctx->readSize;
+        if(size < 1) return 0;
+        if(size > buffer_size) size = buffer_size;
+    } else
+    /* compressed data has to be decoded anyway, it's just not written */
+    if((size = stream_decode(ctx, &ctx->fileSize, ctx->readSize)) < 1) return size;
+    for(pos = 0; pos < size; pos += n) {
+        mapped = bmap_mapped(ctx->bmap, ctx->readSize + pos, &len);
+        n = len < (uint64_t)(size - pos) ? (int64_t)len : size - pos;
+        if(ctx->type == TYPE_PLAIN) {
+            /* holes are better returned in buffers of their own, so that the writer can skip them */
+            if(pos && mapped == hole && !(pos & (ctx->secSize - 1))) break;
+            /* unless it's a stored zip entry, whose CRC needs all the data */
+            if(mapped || ctx->hasCrc) {
+                if(!fread(ctx->buffer + pos, n, 1, ctx->f)) return -1;
+            } else
+                myseek(ctx->f, mytell(ctx->f) + n);
+        }
+        /* the CRC is that of the image, not what's written */
+        stream_crcadd(ctx, (unsigned char*)ctx->buffer + pos, (int)n, ctx->fileSize);
+        if(mapped) hole = 0; else memset(ctx->buffer + pos, 0, n);
     }
-    while(size & 511) ctx->buffer[size++] = 0;
+    ctx->hole = hole;
+    return pos;
+}
+
+/**
+ * Read a raw image with holes. Data is read up to the next hole, and a hole is returned as zeros in
+ * a buffer of its own, without reading it. Everything but the last buffer is sector aligned, so
+ * parts of a hole that's not might be read
+ */
+static int64_t stream_holeread(stream_t *ctx)
+{
+#ifdef SEEK_DATA
+    int fd = fileno(ctx->f);
+    off_t pos = (off_t)ctx->readSize, next;
+    int64_t size = ctx->fileSize - ctx->readSize, n;
+
+    if(size < 1) return 0;
+    if(size > buffer_size) size = buffer_size;
+    /* no data after pos means the rest is a hole */
+    if((next = lseek(fd, pos, SEEK_DATA)) < 0) next = errno == ENXIO ? (off_t)ctx->fileSize : pos;
+    n = (int64_t)(next - pos) & ~((int64_t)ctx->secSize - 1);
+    if(n > 0) {
+        if(n > size) n = size;
+        memset(ctx->buffer, 0, n);
+        ctx->hole = 1;
+    } else {
+        if((next = lseek(fd, pos, SEEK_HOLE)) < 0) next = (off_t)ctx->fileSize;
+        n = ((int64_t)(next - pos) + ctx->secSize - 1) & ~((int64_t)ctx->secSize - 1);
+        if(n < 1 || n > size) n = size;
+        if(pread(fd, ctx->buffer, n, pos) != n) return -1;
+    }
+    /* lseek() moved the descriptor under stdio, keep its position right for the prefetch advice */
+    myseek(ctx->f, (uint64_t)(pos + n));
+    errno = 0;
+    if(verbose > 1) printf("stream_read() readSize %" PRIu64 " / fileSize %" PRIu64 " %s %" PRId64 "\r\n",
+        ctx->readSize, ctx->fileSize, ctx->hole ? "hole" : "data", n);
+    return n;
+#else
+    return stream_decode(ctx, &ctx->fileSize, ctx->readSize);
+#endif
+}
+
+/**
+ * Read no more than buffer_size uncompressed bytes of source data
+ */
+int stream_read(stream_t *ctx)
+{
+    int64_t size;
+
+    errno = 0;
+    ctx->hole = 0;
+    if(ctx->simg) {
+        size = ctx->fileSize - ctx->readSize;
+        if(size > buffer_size) size = buffer_size;
+        if(verbose > 1) printf("stream_read() readSize %" PRIu64 " / fileSize %" PRIu64 " sparse\r\n",
+            ctx->readSize, ctx->fileSize);
+        size = simg_read(ctx->simg, stream_simgread, ctx, ctx->buffer, (int)size, ctx->secSize, &ctx->hole);
+        if(size < 0 && verbose) printf("  sparse image error\r\n");
+        /* the CRC is that of all the stored data, even if there's something after the image */
+        if(!size && ctx->hasCrc)
+            while((size = stream_simgread(ctx, (unsigned char*)ctx->buffer)) > 0);
+    } else
+    if(ctx->bmap)
+        size = stream_bmapread(ctx);
+    else
+    if(ctx->sparse && ctx->type == TYPE_PLAIN)
+        size = stream_holeread(ctx);
+    else
+        size = stream_decode(ctx, &ctx->fileSize, ctx->readSize);
+    if(size < 1) return (int)size;
+    /* pad to the target's sector size */
+    while(size & (ctx->secSize - 1)) ctx->buffer[size++] = 0;
     if(verbose > 1) printf("stream_read() output size %" PRId64 "\r\n", size);
-    ctx->readSize += (uint64_t)size;
+    __atomic_add_fetch(&ctx->readSize, (uint64_t)size, __ATOMIC_RELAXED);
     return size;
 }
 
+/**
+ * Set the size of the uncompressed data, which isn't the size of the image if that's sparse
+ */
+void stream_setsize(stream_t *ctx, uint64_t size)
+{
+    if(ctx->simg) ctx->simg->fileSize = size; else ctx->fileSize = size;
+}
+
+/**
+ * Add data returned by stream_read() to the CRC and the block map checksums being checked
+ */
+void stream_crc(stream_t *ctx, char *buf, int size)
+{
+    /* sparse images are checked before they're expanded, and images with a block map before the
+     * parts not needed are cleared */
+    if(ctx->bmap) bmap_check(ctx->bmap, (uint8_t*)buf, size); else
+    if(!ctx->simg) stream_crcadd(ctx, (unsigned char*)buf, size, ctx->fileSize);
+}
+
+/**
+ * Returns 0 if the source has a CRC or a block map and that doesn't match the data
+ */
+int stream_crcok(stream_t *ctx)
+{
+    uint64_t size = ctx->simg ? ctx->simg->fileSize : ctx->fileSize;
+
+    if(ctx->bmap) {
+        if(verbose) printf("stream_crcok() bmap ranges %d / %d bad %d\r\n", ctx->bmap->cur, ctx->bmap->numRange,
+            ctx->bmap->bad);
+        if(!bmap_ok(ctx->bmap)) return 0;
+    }
+    if(!ctx->hasCrc) return 1;
+    if(verbose) printf("stream_crcok() size %" PRIu64 " / %" PRIu64 " crc %08x / %08x\r\n", ctx->crcSize, size,
+        ctx->crcSum, ctx->crcExpect);
+    return ctx->crcSize == size && ctx->crcSum == ctx->crcExpect;
+}
+
 /**
  * Get a reference to the destination file system
  */
@@ -489,7 +988,7 @@ int stream_create(stream_t *ctx, wchar_t *fn, int comp, uint64_t size)
         main_getErrorMessage();
         return 1;
     }
-    ctx->buffer = (char*)malloc(buffer_size);
+    ctx->buffer = (char*)stream_malloc(buffer_size);
     if(!ctx->buffer) {
         main_getErrorMessage();
         free(ctx->compBuf); ctx->compBuf = NULL;
@@ -501,7 +1000,7 @@ int stream_create(stream_t *ctx, wchar_t *fn, int comp, uint64_t size)
         ctx->b = BZ2_bzopen(fn, L"wb");
         if(!ctx->b) {
             main_getErrorMessage();
-            free(ctx->buffer); ctx->buffer = NULL;
+            stream_free(ctx->buffer); ctx->buffer = NULL;
             free(ctx->compBuf); ctx->compBuf = NULL;
             return 1;
         }
@@ -514,13 +1013,14 @@ int stream_create(stream_t *ctx, wchar_t *fn, int comp, uint64_t size)
 #endif
         if(!ctx->f) {
             main_getErrorMessage();
-            free(ctx->buffer); ctx->buffer = NULL;
+            stream_free(ctx->buffer); ctx->buffer = NULL;
             free(ctx->compBuf); ctx->compBuf = NULL;
             return 1;
         }
     }
 
     ctx->fileSize = size;
+    ctx->secSize = 512;
     ctx->start = time(NULL);
     return 0;
 }
@@ -536,7 +1036,7 @@ int stream_write(stream_t *ctx, char *buffer, int size)
         printf("stream_write() readSize %" PRIu64 " / fileSize %" PRIu64 " (output size %d)\r\n",
             ctx->readSize, ctx->fileSize, size);
     errno = 0;
-    ctx->readSize += (uint64_t)size;
+    __atomic_add_fetch(&ctx->readSize, (uint64_t)size, __ATOMIC_RELAXED);
 
     /* don't rely on OS reporting "no space left on device", go ahead that by buffer size times 2. See issue #50 */
     if(dstfd && (avail = stream_avail(dstfd)) && avail <= (((uint64_t)buffer_size) << 1)) {
@@ -581,14 +1081,30 @@ void stream_close(stream_t *ctx)
 {
     if(verbose) printf("stream_close()\r\n");
     if(ctx->compBuf) free(ctx->compBuf);
-    if(ctx->verifyBuf) free(ctx->verifyBuf);
-    if(ctx->buffer) free(ctx->buffer);
+    if(ctx->buffer) stream_free(ctx->buffer);
     if(ctx->f) fclose(ctx->f);
     switch(ctx->type) {
         case TYPE_DEFLATE: inflateEnd(&ctx->zstrm); break;
         case TYPE_BZIP2: if(ctx->b) BZ2_bzclose(ctx->b); else BZ2_bzDecompressEnd(&ctx->bstrm); break;
         case TYPE_XZ: xz_dec_end(ctx->xz); break;
         case TYPE_ZSTD: ZSTD_freeDCtx(ctx->zstd); break;
+        case TYPE_LZ4: lz4_dec_end(ctx->lz4); break;
+        case TYPE_QCOW2:
+            if(ctx->qcow2) {
+                qcow2_freereader(ctx->qr);
+                qcow2_close(ctx->qcow2);
+                free(ctx->qr);
+                free(ctx->qcow2);
+            }
+        break;
+    }
+    if(ctx->simg) {
+        simg_close(ctx->simg);
+        free(ctx->simg);
+    }
+    if(ctx->bmap) {
+        bmap_free(ctx->bmap);
+        free(ctx->bmap);
     }
     dstfd = 0;
 }
@@ -41,6 +41,14 @@
 #define XZ_DEC_ANY_CHECK
 #include "xz.h"
 #include "zstd.h"
+#include "lz4.h"
+#include "qcow2.h"
+#include "simg.h"
+#include "sha.h"
+#include "bmap.h"
+#define XXH_NAMESPACE ZSTD_
+#define XXH_STATIC_LINKING_ONLY
+#include "common/xxhash.h"
 
 #ifndef PRIu64
 #if __WORDSIZE == 64
@@ -52,6 +60,9 @@
 #endif
 #endif
 
+#define STREAM_VRFSIZE (1024*1024)     /* read back chunk size when verifying */
+#define STREAM_PROGRESSMS 100          /* refresh progress on the UI at most this often */
+
 /* stream context */
 typedef struct {
     FILE *f;
@@ -59,11 +70,11 @@ typedef struct {
     uint64_t compSize;
     uint64_t readSize;
     uint64_t cmrdSize;
+    uint64_t wrtnSize;
     uint64_t avgSpeedBytes;
     uint64_t avgSpeedNum;
     unsigned char *compBuf;
     char *buffer;
-    char *verifyBuf;
     z_stream zstrm;
     bz_stream bstrm;
     struct xz_buf xstrm;
@@ -71,11 +82,47 @@ typedef struct {
     ZSTD_DCtx* zstd;
     ZSTD_inBuffer zi;
     ZSTD_outBuffer zo;
+    lz4_dec_t *lz4;
+    lz4_buf_t lstrm;
+    qcow2_t *qcow2;
+    qcow2_reader_t *qr;
+    simg_t *simg;           /* Android sparse image, stored in any of the formats */
+    bmap_t *bmap;           /* block map found next to the source */
     BZFILE *b;
+    int (*input)(void *data, unsigned char *buf, int size);
+    void *inputData;
+    int (*output)(void *data, char *buf, int size);
+    void *outputData;
+    int secSize;
+    uint64_t cacheHead;     /* source is prefetched up to here */
+    uint64_t cacheTail;     /* and dropped from the page cache below this */
+    uint32_t crcExpect;     /* CRC32 of the uncompressed data, if hasCrc is set */
+    uint32_t crcSum;        /* of the data checked so far */
+    uint64_t crcSize;
+    char hasCrc;
+    char sparse;            /* the source knows where its holes are, the target is better zeroed out first */
+    char hole;              /* the last stream_read() returned a hole of a sparse source, all zeros */
     char type;
+    char pipelined;
+    char multi;             /* concatenated streams, fileSize is just a hint (2: between two xz streams, zstd or lz4 frames) */
     time_t start;
 } stream_t;
 
+/**
+ * Allocate a page aligned buffer, suitable for direct I/O
+ */
+void *stream_malloc(int size);
+
+/**
+ * Free a buffer allocated by stream_malloc()
+ */
+void stream_free(void *ptr);
+
+/**
+ * Returns true if it's time to refresh the progress, at most once every STREAM_PROGRESSMS
+ */
+int stream_progressdue(void);
+
 /**
  * Returns progress percentage and the status string in str
  */
@@ -92,6 +139,21 @@ int stream_open(stream_t *ctx, wchar_t *fn, int uncompr);
  */
 int stream_read(stream_t *ctx);
 
+/**
+ * Set the size of the uncompressed data, which isn't the size of the image if that's sparse
+ */
+void stream_setsize(stream_t *ctx, uint64_t size);
+
+/**
+ * Add data returned by stream_read() to the CRC and the block map checksums being checked
+ */
+void stream_crc(stream_t *ctx, char *buf, int size);
+
+/**
+ * Returns 0 if the source has a CRC or a block map and that doesn't match the data
+ */
+int stream_crcok(stream_t *ctx);
+
 /**
  * Open file for writing
  */
@@ -0,0 +1,176 @@
+/*
+ * usbimager/tune.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Write request size and queue depth autotuning
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include "main.h"
+#include "tune.h"
+
+/**
+ * Returns a monotonic timestamp in milliseconds
+ */
+static uint64_t tune_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Returns the path of the file where settings are remembered
+ */
+static char *tune_file(void)
+{
+    static char fn[1024];
+    char *env;
+
+    if((env = getenv("XDG_CONFIG_HOME")))
+        snprintf(fn, sizeof(fn)-1, "%s/usbimager.tune", env);
+    else if((env = getenv("HOME")))
+        snprintf(fn, sizeof(fn)-1, "%s/.config/usbimager.tune", env);
+    else
+        return NULL;
+    return fn;
+}
+
+/**
+ * Initialize the tuner, uses the remembered setting for the device model if there's one
+ */
+void tune_init(tune_t *t, int maxpiece, int maxdepth, char *model)
+{
+    char *fn = tune_file(), line[512];
+    int piece, depth, n;
+    FILE *f;
+
+    memset(t, 0, sizeof(tune_t));
+    t->maxpiece = maxpiece < TUNE_MINPIECE ? TUNE_MINPIECE : maxpiece;
+    t->maxdepth = maxdepth < 1 ? 1 : maxdepth;
+    /* start with the depth search, using the usual 1M requests */
+    t->piece = t->maxpiece < 1024*1024 ? t->maxpiece : 1024*1024;
+    t->depth = 1;
+    if(model && *model) {
+        strncpy(t->key, model, sizeof(t->key)-1);
+        if(fn && (f = fopen(fn, "r"))) {
+            while(fgets(line, sizeof(line), f)) {
+                line[strcspn(line, "\r\n")] = 0;
+                if(sscanf(line, "%d %d %n", &piece, &depth, &n) == 2 && !strcmp(line + n, t->key) &&
+                  piece >= 4096 && piece <= t->maxpiece && depth >= 1 && depth <= t->maxdepth) {
+                    t->piece = t->bestpiece = piece;
+                    t->depth = t->bestdepth = depth;
+                    t->phase = 2;
+                }
+            }
+            fclose(f);
+        }
+    }
+    if(verbose) printf("tune_init(%s) piece %d depth %d%s\r\n", t->key, t->piece, t->depth,
+        t->phase == 2 ? " remembered" : "");
+}
+
+/**
+ * Account a completed write, and move on to the next setting when the trial is over
+ */
+void tune_account(tune_t *t, int bytes)
+{
+    uint64_t now, rate;
+
+    if(t->phase == 2 || bytes < 1) return;
+    now = tune_now();
+    /* the first completion only marks the start of the trial */
+    if(!t->start) { t->start = now; return; }
+    t->bytes += (uint64_t)bytes;
+    if(now - t->start < TUNE_TRIALMS) return;
+    rate = t->bytes / (now - t->start);
+    if(verbose) printf("tune_account() piece %d depth %d rate %" PRIu64 " KiB/s\r\n", t->piece, t->depth, rate * 1000 / 1024);
+    if(rate > t->bestrate) {
+        t->bestrate = rate;
+        t->bestpiece = t->piece;
+        t->bestdepth = t->depth;
+    }
+    t->bytes = t->start = 0;
+    if(t->phase == 0) {
+        /* deeper queues are only worth it as long as they keep getting faster */
+        if(t->depth < t->maxdepth && t->bestdepth == t->depth) { t->depth <<= 1; if(t->depth > t->maxdepth) t->depth = t->maxdepth; return; }
+        t->phase = 1;
+        t->depth = t->bestdepth;
+        t->piece = TUNE_MINPIECE;
+        if(t->piece != t->bestpiece) return;
+    }
+    if(t->phase == 1) {
+        /* try every power of two request size, the one used for the depth search is already measured */
+        do { t->piece <<= 1; } while(t->piece == t->bestpiece && t->piece < t->maxpiece);
+        if(t->piece <= t->maxpiece && t->piece != t->bestpiece) return;
+        t->phase = 2;
+        t->piece = t->bestpiece;
+        t->depth = t->bestdepth;
+        if(verbose) printf("tune_account() settled piece %d depth %d\r\n", t->piece, t->depth);
+    }
+}
+
+/**
+ * Remember the best setting for the device model. The file is written under a temporary name and
+ * renamed over the old one, so a crash or a full disk doesn't lose what was remembered before
+ */
+void tune_save(tune_t *t)
+{
+    char *fn = tune_file(), tmp[1040], line[512];
+    int n, ok;
+    FILE *f, *o;
+
+    if(!fn || !t->key[0] || t->phase != 2 || !t->bestrate) return;
+    snprintf(tmp, sizeof(tmp)-1, "%s.%d", fn, (int)getpid());
+    if(!(o = fopen(tmp, "w"))) return;
+    /* copy over settings of other devices */
+    if((f = fopen(fn, "r"))) {
+        while(fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\r\n")] = 0;
+            n = 0;
+            if(sscanf(line, "%*d %*d %n", &n) >= 0 && n > 0 && !strcmp(line + n, t->key)) continue;
+            fprintf(o, "%s\n", line);
+        }
+        fclose(f);
+    }
+    fprintf(o, "%d %d %s\n", t->bestpiece, t->bestdepth, t->key);
+    ok = !ferror(o);
+    if(fclose(o)) ok = 0;
+    if(!ok || rename(tmp, fn)) { remove(tmp); ok = 0; }
+    errno = 0;
+    if(verbose) printf("tune_save(%s) piece %d depth %d%s\r\n", fn, t->bestpiece, t->bestdepth, ok ? "" : " failed");
+}
+
+#endif
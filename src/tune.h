@@ -0,0 +1,60 @@
+/*
+ * usbimager/tune.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Write request size and queue depth autotuning
+ *
+ */
+
+#include <stdint.h>
+
+#define TUNE_TRIALMS    500             /* how long to measure one setting */
+#define TUNE_MINPIECE   (64*1024)       /* smallest write request tried */
+#define TUNE_MAXDEPTH   32              /* largest queue depth tried */
+
+/* tuner context */
+typedef struct {
+    int piece, depth;                   /* current setting, used by the writer */
+    int maxpiece, maxdepth;
+    int phase;                          /* 0 - searching depth, 1 - searching piece size, 2 - settled */
+    int bestpiece, bestdepth;
+    uint64_t bestrate;
+    uint64_t bytes, start;
+    char key[256];                      /* device vendor and model, empty if unknown */
+} tune_t;
+
+/**
+ * Initialize the tuner, uses the remembered setting for the device model if there's one
+ */
+void tune_init(tune_t *t, int maxpiece, int maxdepth, char *model);
+
+/**
+ * Account a completed write, and move on to the next setting when the trial is over
+ */
+void tune_account(tune_t *t, int bytes);
+
+/**
+ * Remember the best setting for the device model
+ */
+void tune_save(tune_t *t);
@@ -0,0 +1,356 @@
+/*
+ * usbimager/xzpar.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel xz decompression
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lang.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "xzpar.h"
+
+#define XZPAR_HDRSIZE 12                /* stream header and footer */
+
+enum { XZPAR_READY, XZPAR_BUSY, XZPAR_DONE, XZPAR_FAIL };
+
+/* a block, as listed in its stream's index */
+typedef struct {
+    uint64_t in;        /* offset of the block header */
+    uint64_t unpadded;  /* size without the padding */
+    uint64_t size;      /* uncompressed size */
+    unsigned char hdr[XZPAR_HDRSIZE];   /* its stream's header */
+    char *data;
+    uint64_t pos;       /* how much of it has been output */
+    int state;
+} xzpar_block_t;
+
+typedef struct {
+    stream_t *ctx;
+    int fd;
+    uint64_t fs;
+    int quit, alive;
+    pthread_t thread[XZPAR_MAXTHREADS];
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    xzpar_block_t *blk;
+    int numblk, next, cur;      /* blocks taken by the workers, and output */
+    uint64_t mem;               /* uncompressed size of the blocks being decoded or waiting */
+} xzpar_t;
+
+static xzpar_t xzpar;
+
+/**
+ * Decode a variable length integer. Returns 0 if it's invalid
+ */
+static int xzpar_getvli(unsigned char *buf, int len, int *pos, uint64_t *v)
+{
+    int i;
+
+    for(*v = 0, i = 0; i < 9 && *pos < len; i++) {
+        *v |= (uint64_t)(buf[*pos] & 0x7F) << (7 * i);
+        if(!(buf[(*pos)++] & 0x80)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Encode a variable length integer. Returns its length
+ */
+static int xzpar_putvli(unsigned char *buf, uint64_t v)
+{
+    int n = 0;
+
+    for(; v >= 0x80; v >>= 7) buf[n++] = (unsigned char)(v | 0x80);
+    buf[n++] = (unsigned char)v;
+    return n;
+}
+
+/**
+ * Little endian 32 bit value
+ */
+static uint32_t xzpar_get32(unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void xzpar_put32(unsigned char *buf, uint32_t v)
+{
+    buf[0] = v & 0xFF; buf[1] = (v >> 8) & 0xFF; buf[2] = (v >> 16) & 0xFF; buf[3] = v >> 24;
+}
+
+/**
+ * Parse the indices of the streams, from the last one backwards. Returns 0 if we can't
+ */
+static int xzpar_parse(xzpar_t *g)
+{
+    unsigned char ftr[XZPAR_HDRSIZE], hdr[XZPAR_HDRSIZE], *idx = NULL;
+    uint64_t pos = g->fs, start, sum, unpadded, size, n, i;
+    xzpar_block_t *b;
+    int len, p;
+
+    while(pos > 0) {
+        /* streams might be padded with zeros, in multiple of 4 bytes */
+        while(pos >= 4 && pread(g->fd, ftr, 4, pos - 4) == 4 && !xzpar_get32(ftr)) pos -= 4;
+        if(pos < 2 * XZPAR_HDRSIZE || pread(g->fd, ftr, XZPAR_HDRSIZE, pos - XZPAR_HDRSIZE) != XZPAR_HDRSIZE ||
+          ftr[10] != 'Y' || ftr[11] != 'Z' || xz_crc32(ftr + 4, 6, 0) != xzpar_get32(ftr) ||
+          /* we can't decode a block on its own with SHA-256 checks, we only have the streaming decoder for those */
+          ((ftr[9] & 15) != 0 && (ftr[9] & 15) != 1 && (ftr[9] & 15) != 4)) return 0;
+        len = (xzpar_get32(ftr + 4) + 1) * 4;
+        if(pos < (uint64_t)(2 * XZPAR_HDRSIZE + len) || !(idx = (unsigned char*)malloc(len))) return 0;
+        pos -= XZPAR_HDRSIZE + len;
+        p = 1;
+        if(pread(g->fd, idx, len, pos) != len || idx[0] || xz_crc32(idx, len - 4, 0) != xzpar_get32(idx + len - 4) ||
+          !xzpar_getvli(idx, len - 4, &p, &n) || n > (uint64_t)len) { free(idx); return 0; }
+        /* make room for this stream's blocks in front of the ones we already have */
+        if(!(b = (xzpar_block_t*)realloc(g->blk, (g->numblk + n) * sizeof(xzpar_block_t)))) { free(idx); return 0; }
+        g->blk = b;
+        memmove(b + n, b, g->numblk * sizeof(xzpar_block_t));
+        memset(b, 0, n * sizeof(xzpar_block_t));
+        g->numblk += n;
+        for(i = sum = 0; i < n; i++) {
+            if(!xzpar_getvli(idx, len - 4, &p, &unpadded) || !xzpar_getvli(idx, len - 4, &p, &size)) { free(idx); return 0; }
+            b[i].in = sum;
+            b[i].unpadded = unpadded;
+            b[i].size = size;
+            sum += (unpadded + 3) & ~3ULL;
+        }
+        free(idx);
+        if(pos < sum + XZPAR_HDRSIZE) return 0;
+        start = pos - sum - XZPAR_HDRSIZE;
+        if(pread(g->fd, hdr, XZPAR_HDRSIZE, start) != XZPAR_HDRSIZE || memcmp(hdr, "\xFD" "7zXZ", 6) ||
+          hdr[6] != ftr[8] || hdr[7] != ftr[9]) return 0;
+        for(i = 0; i < n; i++) {
+            b[i].in += start + XZPAR_HDRSIZE;
+            memcpy(b[i].hdr, hdr, XZPAR_HDRSIZE);
+        }
+        pos = start;
+    }
+    return 1;
+}
+
+/**
+ * Decode a block, wrapped in a stream of its own with an index that only lists this block
+ */
+static int xzpar_block(xzpar_t *g, struct xz_dec *xz, xzpar_block_t *b)
+{
+    uint64_t padded = (b->unpadded + 3) & ~3ULL;
+    unsigned char *syn;
+    struct xz_buf xb;
+    int p, idx, ret = XZ_MEM_ERROR;
+
+    if(!(syn = (unsigned char*)malloc(XZPAR_HDRSIZE + padded + 64)) || !(b->data = (char*)malloc(b->size + 1))) goto err;
+    memcpy(syn, b->hdr, XZPAR_HDRSIZE);
+    if(pread(g->fd, syn + XZPAR_HDRSIZE, padded, b->in) != (ssize_t)padded) { ret = XZ_DATA_ERROR; goto err; }
+    p = idx = XZPAR_HDRSIZE + padded;
+    syn[p++] = 0;
+    p += xzpar_putvli(syn + p, 1);
+    p += xzpar_putvli(syn + p, b->unpadded);
+    p += xzpar_putvli(syn + p, b->size);
+    while((p - idx) & 3) syn[p++] = 0;
+    xzpar_put32(syn + p, xz_crc32(syn + idx, p - idx, 0));
+    p += 4;
+    /* stream footer: backward size and the same flags as in the header */
+    xzpar_put32(syn + p + 4, (p - idx) / 4 - 1);
+    syn[p + 8] = b->hdr[6];
+    syn[p + 9] = b->hdr[7];
+    xzpar_put32(syn + p, xz_crc32(syn + p + 4, 6, 0));
+    syn[p + 10] = 'Y';
+    syn[p + 11] = 'Z';
+    p += XZPAR_HDRSIZE;
+    memset(&xb, 0, sizeof(xb));
+    xb.in = syn;
+    xb.in_size = p;
+    xb.out = (unsigned char*)b->data;
+    xb.out_size = b->size;
+    ret = xz_dec_run(xz, &xb);
+    if(ret == XZ_STREAM_END && xb.out_pos != b->size) ret = XZ_DATA_ERROR;
+err:
+    free(syn);
+    if(verbose > 1) printf("xzpar_block() offset %" PRIu64 " size %" PRIu64 " ret %d\r\n", b->in, b->size, ret);
+    return ret == XZ_STREAM_END;
+}
+
+/**
+ * Worker thread, decodes the blocks in order, but no more than what fits in memory
+ */
+static void *xzpar_worker(void *data)
+{
+    xzpar_t *g = (xzpar_t*)data;
+    struct xz_dec *xz = xz_dec_init(XZ_SINGLE, 0);
+    xzpar_block_t *b;
+    int ok;
+
+    pthread_mutex_lock(&g->mutex);
+    while(xz && !g->quit) {
+        /* one block is always allowed, even if it's bigger than the limit */
+        if(g->next >= g->numblk || (g->mem && g->mem + g->blk[g->next].size > XZPAR_MAXMEM)) {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+        b = &g->blk[g->next++];
+        g->mem += b->size;
+        b->state = XZPAR_BUSY;
+        pthread_mutex_unlock(&g->mutex);
+        ok = xzpar_block(g, xz, b);
+        pthread_mutex_lock(&g->mutex);
+        b->state = ok ? XZPAR_DONE : XZPAR_FAIL;
+        pthread_cond_broadcast(&g->cond);
+    }
+    g->alive--;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    if(xz) xz_dec_end(xz);
+    return NULL;
+}
+
+/**
+ * Output the next block. Returns the number of bytes, 0 at the end, -1 on error
+ */
+static int xzpar_nextblock(xzpar_t *g, char *buf, int size)
+{
+    xzpar_block_t *b;
+    int n;
+
+    while(g->cur < g->numblk) {
+        b = &g->blk[g->cur];
+        pthread_mutex_lock(&g->mutex);
+        while(b->state != XZPAR_DONE && b->state != XZPAR_FAIL && g->alive)
+            pthread_cond_wait(&g->cond, &g->mutex);
+        pthread_mutex_unlock(&g->mutex);
+        if(b->state != XZPAR_DONE) return -1;
+        n = b->size - b->pos < (uint64_t)size ? (int)(b->size - b->pos) : size;
+        memcpy(buf, b->data + b->pos, n);
+        b->pos += n;
+        if(b->pos >= b->size) {
+            pthread_mutex_lock(&g->mutex);
+            free(b->data);
+            b->data = NULL;
+            g->mem -= b->size;
+            g->cur++;
+            pthread_cond_broadcast(&g->cond);
+            pthread_mutex_unlock(&g->mutex);
+        }
+        if(n) return n;
+    }
+    return 0;
+}
+
+/**
+ * Output hook for stream_read(), fills the buffer unless we're at the end
+ */
+static int xzpar_output(void *data, char *buf, int size)
+{
+    xzpar_t *g = (xzpar_t*)data;
+    uint64_t pos;
+    int n, ret = 0;
+
+    while(ret < size) {
+        if((n = xzpar_nextblock(g, buf + ret, size - ret)) < 0) return -1;
+        if(!n) break;
+        ret += n;
+    }
+    if(ret < size) {
+        __atomic_store_n(&g->ctx->cmrdSize, g->fs, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, (uint64_t)-1);
+    } else {
+        pos = g->blk[g->cur < g->numblk ? g->cur : g->numblk - 1].in;
+        __atomic_store_n(&g->ctx->cmrdSize, pos, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, pos);
+    }
+    return ret;
+}
+
+/**
+ * Start decompressing an xz source on all cores
+ */
+int xzpar_open(stream_t *ctx)
+{
+    xzpar_t *g = &xzpar;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t total = 0;
+    int i;
+
+    if(n < 2 || ctx->type != TYPE_XZ) return 0;
+    if(n > XZPAR_MAXTHREADS) n = XZPAR_MAXTHREADS;
+    memset(g, 0, sizeof(xzpar_t));
+    g->ctx = ctx;
+    g->fd = fileno(ctx->f);
+    g->fs = ctx->compSize;
+    if(!xzpar_parse(g) || g->numblk < 2) {
+        free(g->blk);
+        g->blk = NULL;
+        return 0;
+    }
+    for(i = 0; i < g->numblk; i++)
+        total += g->blk[i].size;
+    /* the index has the exact size */
+    stream_setsize(ctx, total);
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    for(i = 0; i < n; i++)
+        if(!pthread_create(&g->thread[g->numthreads], NULL, xzpar_worker, g)) g->numthreads++;
+    g->alive = g->numthreads;
+    if(verbose) printf("xzpar_open() threads %d blocks %d\r\n", g->numthreads, g->numblk);
+    ctx->output = xzpar_output;
+    ctx->outputData = g;
+    return 1;
+}
+
+/**
+ * Stop the threads and free everything
+ */
+void xzpar_close(stream_t *ctx)
+{
+    xzpar_t *g = &xzpar;
+    int i;
+
+    if(ctx->outputData != g) return;
+    pthread_mutex_lock(&g->mutex);
+    __atomic_store_n(&g->quit, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    for(i = 0; i < g->numthreads; i++)
+        pthread_join(g->thread[i], NULL);
+    for(i = 0; i < g->numblk; i++)
+        free(g->blk[i].data);
+    free(g->blk);
+    g->blk = NULL;
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->mutex);
+    ctx->output = NULL;
+    ctx->outputData = NULL;
+}
+
+#endif
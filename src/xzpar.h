@@ -0,0 +1,43 @@
+/*
+ * usbimager/xzpar.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel xz decompression
+ *
+ */
+
+#define XZPAR_MAXMEM (256*1024*1024)    /* decoded data waiting to be output */
+#define XZPAR_MAXTHREADS 16
+
+/**
+ * Start decompressing an xz source on all cores. The blocks are listed in the index at the end of
+ * each stream, and every block is decoded on its own. Sets the stream's output hook, returns 1 if
+ * it did, 0 if stream_read() should be used as usual (like when there's only one block)
+ */
+int xzpar_open(stream_t *ctx);
+
+/**
+ * Stop the threads and free everything
+ */
+void xzpar_close(stream_t *ctx);
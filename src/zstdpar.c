@@ -0,0 +1,420 @@
+/*
+ * usbimager/zstdpar.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel zstd decompression
+ *
+ */
+
+#ifndef WINVER
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lang.h"
+/* for the frame header parser */
+#define ZSTD_STATIC_LINKING_ONLY
+#include "stream.h"
+#include "pipeline.h"
+#include "zstdpar.h"
+
+#define ZSTDPAR_MAXJOBS 1024
+#define ZSTDPAR_SKIPPABLE 0x184D2A50    /* pzstd puts the next frame's compressed size in one of these */
+#define ZSTDPAR_SEEKTABLE 0x184D2A5E    /* skippable frame with the seek table */
+#define ZSTDPAR_SEEKMAGIC 0x8F92EAB1    /* at the very end of a seekable file */
+
+enum { ZSTDPAR_FREE, ZSTDPAR_READY, ZSTDPAR_BUSY, ZSTDPAR_DONE, ZSTDPAR_FAIL };
+
+/* a frame */
+typedef struct {
+    uint64_t in;        /* offset of the frame */
+    uint64_t csize;     /* compressed size */
+    uint64_t expect;    /* content size from the frame header, if it's there */
+    char *data;
+    uint64_t size;
+    uint64_t pos;       /* how much of it has been output */
+    int state;
+} zstdpar_job_t;
+
+typedef struct {
+    stream_t *ctx;
+    int fd;
+    uint64_t fs;
+    int quit, alive, scanned, error;
+    pthread_t thread[ZSTDPAR_MAXTHREADS], scanner;
+    int numthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    zstdpar_job_t job[ZSTDPAR_MAXJOBS];
+    uint64_t found, next, cur;  /* jobs found by the scanner, taken by the workers, and output */
+    uint64_t mem;               /* decoded bytes waiting in jobs */
+    uint64_t pos;               /* compressed offset of the frame being output */
+    uint32_t *seek;             /* compressed frame sizes from the seek table */
+    uint32_t numseek;
+} zstdpar_t;
+
+static zstdpar_t zstdpar;
+
+/**
+ * Little endian 32 bit value
+ */
+static uint32_t zstdpar_get32(unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/**
+ * Find the end of a frame by walking its block headers. Returns the compressed size, 0 on error
+ * or if it's longer than the limit
+ */
+static uint64_t zstdpar_walk(zstdpar_t *g, uint64_t pos, unsigned char *hdr, int len, uint64_t limit)
+{
+    ZSTD_frameHeader fh;
+    unsigned char b[3];
+    uint64_t p;
+    size_t n = ZSTD_frameHeaderSize(hdr, len);
+    uint32_t v;
+
+    if(ZSTD_isError(n) || ZSTD_getFrameHeader(&fh, hdr, len)) return 0;
+    p = pos + n;
+    do {
+        if(p - pos > limit || pread(g->fd, b, 3, p) != 3) return 0;
+        v = b[0] | (b[1] << 8) | (b[2] << 16);
+        switch((v >> 1) & 3) {
+            case 0: case 2: p += 3 + (v >> 3); break;   /* raw and compressed blocks */
+            case 1: p += 4; break;                      /* RLE, just one byte */
+            default: return 0;
+        }
+    } while(!(v & 1) && !__atomic_load_n(&g->quit, __ATOMIC_RELAXED));
+    if(fh.checksumFlag) p += 4;
+    return p <= g->fs && p - pos <= limit ? p - pos : 0;
+}
+
+/**
+ * Read the seek table of the seekable format. Returns the number of frames, 0 if there's none
+ */
+static uint32_t zstdpar_seektable(zstdpar_t *g)
+{
+    unsigned char ftr[9], *tab;
+    uint64_t sum = 0, len;
+    uint32_t i, n, esize;
+
+    if(g->fs < 17 || pread(g->fd, ftr, 9, g->fs - 9) != 9 || zstdpar_get32(ftr + 5) != ZSTDPAR_SEEKMAGIC ||
+      (ftr[4] & 0x7C)) return 0;
+    n = zstdpar_get32(ftr);
+    esize = ftr[4] & 0x80 ? 12 : 8;
+    len = (uint64_t)n * esize + 9;
+    if(len + 8 > g->fs || !(tab = (unsigned char*)malloc(len + 8))) return 0;
+    if(pread(g->fd, tab, len + 8, g->fs - len - 8) != (ssize_t)(len + 8) ||
+      zstdpar_get32(tab) != ZSTDPAR_SEEKTABLE || zstdpar_get32(tab + 4) != len ||
+      !(g->seek = (uint32_t*)malloc((n + 1) * sizeof(uint32_t)))) { free(tab); return 0; }
+    for(i = 0; i < n; i++)
+        sum += g->seek[i] = zstdpar_get32(tab + 8 + i * esize);
+    free(tab);
+    /* the frames must fill the file up to the seek table */
+    if(sum != g->fs - len - 8) { free(g->seek); g->seek = NULL; return 0; }
+    return n;
+}
+
+/**
+ * Add a job, must be called with the mutex held. Returns 0 if we're quitting
+ */
+static int zstdpar_add(zstdpar_t *g, uint64_t in, uint64_t csize, uint64_t expect)
+{
+    zstdpar_job_t *j;
+
+    while(!g->quit && g->found - g->cur >= ZSTDPAR_MAXJOBS)
+        pthread_cond_wait(&g->cond, &g->mutex);
+    if(g->quit) return 0;
+    j = &g->job[g->found % ZSTDPAR_MAXJOBS];
+    memset(j, 0, sizeof(zstdpar_job_t));
+    j->in = in;
+    j->csize = csize;
+    j->expect = expect;
+    j->state = ZSTDPAR_READY;
+    g->found++;
+    pthread_cond_broadcast(&g->cond);
+    return 1;
+}
+
+/**
+ * Scanner thread, finds the frames one after another
+ */
+static void *zstdpar_scanner(void *data)
+{
+    zstdpar_t *g = (zstdpar_t*)data;
+    unsigned char hdr[ZSTD_FRAMEHEADERSIZE_MAX];
+    uint64_t pos = 0, csize, hint = 0, expect;
+    uint32_t magic, frame = 0;
+    int n, go = 1, err = 0;
+
+    while(go && pos < g->fs) {
+        /* don't read too far ahead of the output */
+        pthread_mutex_lock(&g->mutex);
+        while(!g->quit && pos > g->pos + ZSTDPAR_AHEAD)
+            pthread_cond_wait(&g->cond, &g->mutex);
+        go = !g->quit;
+        pthread_mutex_unlock(&g->mutex);
+        if(!go) break;
+        if((n = (int)pread(g->fd, hdr, sizeof(hdr), pos)) < 8) { err = 1; break; }
+        magic = zstdpar_get32(hdr);
+        if((magic & 0xFFFFFFF0) == ZSTDPAR_SKIPPABLE) {
+            if(magic == ZSTDPAR_SKIPPABLE && zstdpar_get32(hdr + 4) == 4 && n >= 12) hint = zstdpar_get32(hdr + 8);
+            pos += 8 + (uint64_t)zstdpar_get32(hdr + 4);
+            continue;
+        }
+        if(magic != ZSTD_MAGICNUMBER) { err = 1; break; }
+        csize = g->seek ? (frame < g->numseek ? g->seek[frame] : 0) : hint ? hint : zstdpar_walk(g, pos, hdr, n, g->fs);
+        expect = ZSTD_getFrameContentSize(hdr, n);
+        hint = 0;
+        frame++;
+        if(!csize || pos + csize > g->fs) { err = 1; break; }
+        pthread_mutex_lock(&g->mutex);
+        go = zstdpar_add(g, pos, csize, expect);
+        pthread_mutex_unlock(&g->mutex);
+        pos += csize;
+    }
+    pthread_mutex_lock(&g->mutex);
+    /* a frame that goes beyond the end means a truncated file */
+    if(err || pos > g->fs) g->error = 1;
+    g->scanned = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    return NULL;
+}
+
+/**
+ * Decode a frame. Returns 1 on success
+ */
+static int zstdpar_frame(zstdpar_t *g, ZSTD_DCtx *dctx, zstdpar_job_t *j)
+{
+    ZSTD_inBuffer zi;
+    ZSTD_outBuffer zo;
+    uint64_t cap;
+    size_t ret = 0;
+    char *p;
+
+    memset(&zi, 0, sizeof(zi));
+    memset(&zo, 0, sizeof(zo));
+    cap = j->expect < ZSTD_CONTENTSIZE_ERROR ? j->expect + 1 : j->csize * 4 + ZSTD_BLOCKSIZE_MAX;
+    if(!(zi.src = malloc(j->csize)) || !(j->data = (char*)malloc(cap)) ||
+      pread(g->fd, (void*)zi.src, j->csize, j->in) != (ssize_t)j->csize) { ret = (size_t)-1; goto err; }
+    zi.size = j->csize;
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    for(;;) {
+        zo.dst = j->data;
+        zo.size = cap;
+        ret = ZSTD_decompressStream(dctx, &zo, &zi);
+        if(ZSTD_isError(ret) || !ret || __atomic_load_n(&g->quit, __ATOMIC_RELAXED)) break;
+        if(zo.pos < zo.size) { ret = (size_t)-1; break; }   /* input ended before the frame did */
+        cap *= 2;
+        if(!(p = (char*)realloc(j->data, cap))) { ret = (size_t)-1; break; }
+        j->data = p;
+    }
+    j->size = zo.pos;
+    /* the frame must end exactly where the next one starts */
+    if(!ret && (zi.pos != zi.size || (j->expect < ZSTD_CONTENTSIZE_ERROR && j->size != j->expect))) ret = (size_t)-1;
+err:
+    free((void*)zi.src);
+    if(verbose > 1) printf("zstdpar_frame() offset %" PRIu64 " csize %" PRIu64 " size %" PRIu64 " ret %d\r\n",
+        j->in, j->csize, j->size, ZSTD_isError(ret) ? -1 : (int)ret);
+    return !ret;
+}
+
+/**
+ * Worker thread, decodes the frames in order, but no more than what fits in memory
+ */
+static void *zstdpar_worker(void *data)
+{
+    zstdpar_t *g = (zstdpar_t*)data;
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    zstdpar_job_t *j;
+    int ok;
+
+    pthread_mutex_lock(&g->mutex);
+    while(dctx && !g->quit) {
+        if(g->next >= g->found || g->mem >= ZSTDPAR_MAXMEM) {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+        j = &g->job[g->next++ % ZSTDPAR_MAXJOBS];
+        j->state = ZSTDPAR_BUSY;
+        pthread_mutex_unlock(&g->mutex);
+        ok = zstdpar_frame(g, dctx, j);
+        pthread_mutex_lock(&g->mutex);
+        j->state = ok ? ZSTDPAR_DONE : ZSTDPAR_FAIL;
+        if(ok) g->mem += j->size;
+        pthread_cond_broadcast(&g->cond);
+    }
+    g->alive--;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    if(dctx) ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+/**
+ * Wait for the job being output. Returns NULL at the end, must be called with the mutex held
+ */
+static zstdpar_job_t *zstdpar_wait(zstdpar_t *g)
+{
+    zstdpar_job_t *j = &g->job[g->cur % ZSTDPAR_MAXJOBS];
+
+    while(g->alive && (g->cur < g->found ? j->state != ZSTDPAR_DONE && j->state != ZSTDPAR_FAIL : !g->scanned))
+        pthread_cond_wait(&g->cond, &g->mutex);
+    return g->cur < g->found && (j->state == ZSTDPAR_DONE || j->state == ZSTDPAR_FAIL) ? j : NULL;
+}
+
+/**
+ * Output the next frame. Returns the number of bytes, 0 at the end, -1 on error
+ */
+static int zstdpar_nextframe(zstdpar_t *g, char *buf, int size)
+{
+    zstdpar_job_t *j;
+    int n;
+
+    for(;;) {
+        pthread_mutex_lock(&g->mutex);
+        if(!(j = zstdpar_wait(g)) || j->state == ZSTDPAR_FAIL) {
+            n = !j && g->scanned && !g->error && g->cur >= g->found ? 0 : -1;
+            pthread_mutex_unlock(&g->mutex);
+            return n;
+        }
+        pthread_mutex_unlock(&g->mutex);
+        n = j->size - j->pos < (uint64_t)size ? (int)(j->size - j->pos) : size;
+        memcpy(buf, j->data + j->pos, n);
+        j->pos += n;
+        if(j->pos >= j->size) {
+            pthread_mutex_lock(&g->mutex);
+            g->mem -= j->size;
+            free(j->data);
+            j->data = NULL;
+            j->state = ZSTDPAR_FREE;
+            g->cur++;
+            if(g->cur < g->found) g->pos = g->job[g->cur % ZSTDPAR_MAXJOBS].in;
+            pthread_cond_broadcast(&g->cond);
+            pthread_mutex_unlock(&g->mutex);
+        }
+        if(n) return n;
+    }
+}
+
+/**
+ * Output hook for stream_read(), fills the buffer unless we're at the end
+ */
+static int zstdpar_output(void *data, char *buf, int size)
+{
+    zstdpar_t *g = (zstdpar_t*)data;
+    int n, ret = 0;
+
+    while(ret < size) {
+        if((n = zstdpar_nextframe(g, buf + ret, size - ret)) < 0) return -1;
+        if(!n) break;
+        ret += n;
+    }
+    if(ret < size) {
+        __atomic_store_n(&g->ctx->cmrdSize, g->fs, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, (uint64_t)-1);
+    } else {
+        __atomic_store_n(&g->ctx->cmrdSize, g->pos, __ATOMIC_RELAXED);
+        pipeline_advise(g->ctx, g->fd, g->pos);
+    }
+    return ret;
+}
+
+/**
+ * Start decompressing a zstd source on all cores
+ */
+int zstdpar_open(stream_t *ctx)
+{
+    zstdpar_t *g = &zstdpar;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char hdr[ZSTD_FRAMEHEADERSIZE_MAX];
+    uint64_t csize;
+    int i, len;
+
+    if(n < 2 || ctx->type != TYPE_ZSTD) return 0;
+    if(n > ZSTDPAR_MAXTHREADS) n = ZSTDPAR_MAXTHREADS;
+    memset(g, 0, sizeof(zstdpar_t));
+    g->ctx = ctx;
+    g->fd = fileno(ctx->f);
+    g->fs = ctx->compSize;
+    if((len = (int)pread(g->fd, hdr, sizeof(hdr), 0)) < 8) return 0;
+    /* with a seek table or pzstd's headers we know where the frames are. Otherwise a single frame file
+     * is the most common, and we don't want to walk a huge frame just to find that out */
+    if(!(g->numseek = zstdpar_seektable(g)) && zstdpar_get32(hdr) != ZSTDPAR_SKIPPABLE &&
+      (!(csize = zstdpar_walk(g, 0, hdr, len, ZSTDPAR_AHEAD)) || csize >= g->fs)) return 0;
+    if(g->seek && g->numseek < 2) {
+        free(g->seek);
+        g->seek = NULL;
+        return 0;
+    }
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    if(pthread_create(&g->scanner, NULL, zstdpar_scanner, g)) {
+        pthread_cond_destroy(&g->cond);
+        pthread_mutex_destroy(&g->mutex);
+        free(g->seek);
+        g->seek = NULL;
+        return 0;
+    }
+    for(i = 0; i < n; i++)
+        if(!pthread_create(&g->thread[g->numthreads], NULL, zstdpar_worker, g)) g->numthreads++;
+    g->alive = g->numthreads;
+    if(verbose) printf("zstdpar_open() threads %d seek table %u\r\n", g->numthreads, g->numseek);
+    ctx->output = zstdpar_output;
+    ctx->outputData = g;
+    return 1;
+}
+
+/**
+ * Stop the threads and free everything
+ */
+void zstdpar_close(stream_t *ctx)
+{
+    zstdpar_t *g = &zstdpar;
+    int i;
+
+    if(ctx->outputData != g) return;
+    pthread_mutex_lock(&g->mutex);
+    __atomic_store_n(&g->quit, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    pthread_join(g->scanner, NULL);
+    for(i = 0; i < g->numthreads; i++)
+        pthread_join(g->thread[i], NULL);
+    for(i = 0; i < ZSTDPAR_MAXJOBS; i++)
+        free(g->job[i].data);
+    free(g->seek);
+    g->seek = NULL;
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->mutex);
+    ctx->output = NULL;
+    ctx->outputData = NULL;
+}
+
+#endif
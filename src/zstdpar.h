@@ -0,0 +1,45 @@
+/*
+ * usbimager/zstdpar.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Parallel zstd decompression
+ *
+ */
+
+#define ZSTDPAR_AHEAD (64*1024*1024)    /* look for frames at most this far ahead of the output */
+#define ZSTDPAR_MAXMEM (256*1024*1024)  /* decoded data waiting to be output */
+#define ZSTDPAR_MAXTHREADS 16
+
+/**
+ * Start decompressing a zstd source on all cores. Frames are decoded concurrently; their sizes are
+ * taken from the seek table of the seekable format, from pzstd's skippable frames, or else found by
+ * walking the block headers. Sets the stream's output hook, returns 1 if it did, 0 if stream_read()
+ * should be used as usual (like when there's only one frame)
+ */
+int zstdpar_open(stream_t *ctx);
+
+/**
+ * Stop the threads and free everything
+ */
+void zstdpar_close(stream_t *ctx);